@@ -6,25 +6,53 @@
  *-------------------------------------------------------------------------
  */
 #include "postgres.h"
+
+#include <ctype.h>
+#include <math.h>
+
 #include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
 #include "funcapi.h"
 #include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/jsonb.h"
 #include "utils/array.h"
 #include "utils/numeric.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 #include "catalog/pg_type.h"
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
+void _PG_init(void);
+
 /* Function declarations */
 PG_FUNCTION_INFO_V1(init_schema);
 PG_FUNCTION_INFO_V1(cache_query);
+PG_FUNCTION_INFO_V1(cache_negative);
 PG_FUNCTION_INFO_V1(get_cached_result);
 PG_FUNCTION_INFO_V1(invalidate_cache);
+PG_FUNCTION_INFO_V1(invalidate_cache_multi);
 PG_FUNCTION_INFO_V1(cache_stats);
 PG_FUNCTION_INFO_V1(cache_hit_rate);
 PG_FUNCTION_INFO_V1(evict_expired);
@@ -39,6 +67,391 @@ PG_FUNCTION_INFO_V1(get_vector_dimension);
 PG_FUNCTION_INFO_V1(set_index_type);
 PG_FUNCTION_INFO_V1(get_index_type);
 PG_FUNCTION_INFO_V1(rebuild_index);
+PG_FUNCTION_INFO_V1(coalesce_inflight);
+PG_FUNCTION_INFO_V1(take_refresh_lease);
+PG_FUNCTION_INFO_V1(release_refresh_lease);
+PG_FUNCTION_INFO_V1(note_readonly_lookup);
+PG_FUNCTION_INFO_V1(readonly_lookup_stats);
+PG_FUNCTION_INFO_V1(drain_pending_accesses);
+PG_FUNCTION_INFO_V1(discard_pending_accesses);
+PG_FUNCTION_INFO_V1(hash_filter_add);
+PG_FUNCTION_INFO_V1(rebuild_hash_filter);
+PG_FUNCTION_INFO_V1(get_cached_exact);
+PG_FUNCTION_INFO_V1(hash_filter_stats);
+PG_FUNCTION_INFO_V1(train_pq_codebook);
+PG_FUNCTION_INFO_V1(pq_encode);
+PG_FUNCTION_INFO_V1(pq_candidates);
+PG_FUNCTION_INFO_V1(unit_vector);
+PG_FUNCTION_INFO_V1(set_distance_metric);
+PG_FUNCTION_INFO_V1(get_distance_metric);
+PG_FUNCTION_INFO_V1(track_cache_gauges);
+PG_FUNCTION_INFO_V1(reconcile_cache_gauges);
+PG_FUNCTION_INFO_V1(cache_gauges);
+PG_FUNCTION_INFO_V1(rebuild_top_queries);
+PG_FUNCTION_INFO_V1(top_queries);
+PG_FUNCTION_INFO_V1(top_queries_stats);
+PG_FUNCTION_INFO_V1(hll_merge);
+PG_FUNCTION_INFO_V1(hll_estimate);
+PG_FUNCTION_INFO_V1(flush_access_sketches);
+PG_FUNCTION_INFO_V1(pending_access_sketches);
+PG_FUNCTION_INFO_V1(access_sketch_stats);
+
+/*
+ * Shared memory.  Everything here is optional: the library works without
+ * shared_preload_libraries, and the features below simply switch off.
+ */
+
+/* LWLocks in the "pg_semantic_cache" tranche */
+#define SC_LOCK_INFLIGHT		0
+#define SC_LOCK_ACCESS			1
+#define SC_LOCK_HASH_FILTER		2
+#define SC_LOCK_GAUGES			3
+#define SC_LOCK_TOP_QUERIES		4
+#define SC_LOCK_ACCESS_SKETCHES	5
+#define SC_NUM_LOCKS			6
+
+/* In-flight miss slot states */
+#define INFLIGHT_FREE			0
+#define INFLIGHT_PENDING		1	/* owner is computing the result */
+#define INFLIGHT_DONE			2	/* owner's cache_query() committed */
+#define INFLIGHT_ABANDONED		3	/* owner aborted or exited */
+
+typedef struct InflightSlot
+{
+	Oid			dboid;
+	int			owner_pid;
+	int			state;
+	uint32		generation;		/* bumped every time the slot is claimed */
+	int			dimension;
+	float4		threshold;		/* similarity the owner's entry must reach */
+	TimestampTz deadline;		/* slot is recycled after this */
+	int64		cache_id;		/* valid once state is INFLIGHT_DONE */
+} InflightSlot;
+
+/*
+ * Registry of recent misses for request coalescing.  The slot array is
+ * followed by nslots * max_dimension float4 embeddings.
+ */
+typedef struct InflightRegistry
+{
+	LWLock	   *lock;
+	ConditionVariable cv;		/* broadcast whenever a slot leaves PENDING */
+	int			nslots;
+	int			max_dimension;
+	InflightSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} InflightRegistry;
+
+/* One lookup of an entry, queued for shipping back to the primary */
+typedef struct AccessRecord
+{
+	Oid			dboid;
+	int64		cache_id;
+	TimestampTz accessed_at;
+} AccessRecord;
+
+/*
+ * Counters for lookups that must not write (hot standby, read-only
+ * transaction or lookup_mode = 'read_only').  get_cached_result() counts
+ * here instead of in cache_metadata, and optionally queues the entries it
+ * served for drain_pending_accesses().
+ */
+typedef struct LookupStats
+{
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+	pg_atomic_uint64 negative_hits;
+	pg_atomic_uint64 dropped_accesses;	/* queue was full */
+	LWLock	   *lock;			/* protects count and accesses */
+	int			capacity;
+	int			count;
+	AccessRecord accesses[FLEXIBLE_ARRAY_MEMBER];
+} LookupStats;
+
+/*
+ * Bloom filter over cache_entries.query_hash, used by get_cached_exact() to
+ * answer most misses without touching the table.  Bits are only ever added
+ * (by cache_query() and replicated entries), so deletes are absorbed by
+ * rebuild_hash_filter(), which loads the filter from one database; lookups
+ * from any other database, or on a standby, bypass it.  Adding and testing
+ * bits take the lock shared, a rebuild takes it exclusive to swap contents.
+ */
+#define HASH_FILTER_K			7	/* bits set per query hash */
+
+typedef struct HashFilter
+{
+	LWLock	   *lock;
+	Oid			dboid;			/* InvalidOid until the first rebuild */
+	TimestampTz rebuilt_at;
+	uint64		nbits;
+	pg_atomic_uint64 lookups;
+	pg_atomic_uint64 definite_misses;
+	pg_atomic_uint64 false_positives;
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 words[FLEXIBLE_ARRAY_MEMBER];
+} HashFilter;
+
+/*
+ * Gauges over cache_entries for the cache_health view, kept up to date by
+ * statement triggers (track_cache_gauges()) as writers commit, and reloaded
+ * from the table by reconcile_cache_gauges().  Like the hash filter they
+ * serve the database of the last reconciliation only.
+ *
+ * Expired entries cannot be counted as they happen, so entries are kept in a
+ * histogram of expiry times relative to reconciled_at: bucket 0 holds those
+ * already expired then, bucket k those expiring within
+ * GAUGE_EXPIRY_BASE_SECS * 2^(k-1) seconds, and the last bucket everything
+ * later.  The expired count is estimated by interpolating within the bucket
+ * the current time falls in.
+ */
+#define GAUGE_EXPIRY_BUCKETS	25
+#define GAUGE_EXPIRY_BASE_SECS	60
+
+typedef struct GaugeCounts
+{
+	int64		entries;
+	int64		size_bytes;
+	int64		accesses;
+	int64		negatives;
+	int64		expiry[GAUGE_EXPIRY_BUCKETS];
+} GaugeCounts;
+
+typedef struct CacheGauges
+{
+	LWLock	   *lock;
+	Oid			dboid;			/* InvalidOid until the first reconciliation */
+	TimestampTz reconciled_at;	/* also the anchor of the expiry histogram */
+	GaugeCounts counts;
+} CacheGauges;
+
+/*
+ * Space-Saving sketches of the queries with the most cache hits and the most
+ * cost saved, fed by log_cache_access() so top_cached_queries need not group
+ * the whole access log.  Each sketch has a fixed number of counters; a query
+ * that is not tracked takes over the smallest one and inherits its value as
+ * error, so an estimate is never below the true total and exceeds it by at
+ * most that error.  Updates take the lock exclusive and scan the counters.
+ * Like the hash filter they serve the database of the last rebuild only.
+ *
+ * Query hashes are matched by a 64-bit hash of the whole text and kept for
+ * display up to TOP_QUERY_HASH_LEN bytes.
+ */
+#define TOP_QUERY_HASH_LEN		64
+#define TOP_BY_HITS				0
+#define TOP_BY_COST				1
+
+typedef struct TopQuerySlot
+{
+	uint64		key;
+	double		count;			/* estimate: hits, or cost saved */
+	double		error;			/* count inherited from the evicted query */
+	int64		hits;			/* seen while tracked */
+	double		similarity_sum; /* over those hits */
+	TimestampTz last_access;
+	char		query_hash[TOP_QUERY_HASH_LEN + 1];
+} TopQuerySlot;
+
+typedef struct TopQueries
+{
+	LWLock	   *lock;
+	Oid			dboid;			/* InvalidOid until the first rebuild */
+	TimestampTz rebuilt_at;
+	int			nslots;			/* counters per sketch */
+	int			used[2];
+	double		total[2];		/* hits and cost saved seen by each sketch */
+	TopQuerySlot slots[FLEXIBLE_ARRAY_MEMBER];	/* by hits, then by cost */
+} TopQueries;
+
+/*
+ * HyperLogLog sketches of the distinct query hashes logged per hour, one over
+ * all accesses and one over misses.  log_cache_access() adds to the bucket of
+ * the current hour; flush_access_sketches() merges the buckets of its
+ * database into cache_access_sketches and frees those whose hour is over.
+ * When every bucket is taken, the oldest one is recycled unflushed.
+ *
+ * A sketch is HLL_REGISTERS one-byte registers, stored as bytea; merging two
+ * is a register-wise maximum, so buckets combine into any window.
+ */
+#define HLL_BITS				12
+#define HLL_REGISTERS			(1 << HLL_BITS)
+#define ACCESS_SKETCH_BUCKET_SECS	3600
+
+typedef struct AccessSketchBucket
+{
+	Oid			dboid;			/* InvalidOid when free */
+	TimestampTz bucket_start;
+	int64		accesses;		/* logged since the last flush */
+	uint8		queries[HLL_REGISTERS];
+	uint8		missed[HLL_REGISTERS];
+} AccessSketchBucket;
+
+typedef struct AccessSketches
+{
+	LWLock	   *lock;
+	int			nbuckets;
+	pg_atomic_uint64 recycled;	/* buckets lost unflushed */
+	AccessSketchBucket buckets[FLEXIBLE_ARRAY_MEMBER];
+} AccessSketches;
+
+/*
+ * Backend-local view of the cache_entries layout.  With the partitioned
+ * layout, cache_query() assigns each entry to the partition of its nearest
+ * centroid; the centroids are read once and kept until a relcache
+ * invalidation on cache_entries or cache_centroids (table swap, TRUNCATE).
+ * set_distance_metric() goes through rebuild_index(), which truncates
+ * cache_entries, so the cached metric is refreshed the same way.
+ */
+typedef struct PartitionLayout
+{
+	bool		valid;
+	bool		partitioned;
+	bool		normalize;		/* distance_metric is cosine */
+	Oid			entries_relid;
+	Oid			centroids_relid;
+	int			nclusters;
+	int			dimension;
+	int32	   *cluster_ids;
+	float4	   *centroids;		/* nclusters * dimension */
+} PartitionLayout;
+
+static PartitionLayout layout = {false};
+
+/*
+ * Backend-local copy of the product-quantization codebook (see
+ * enable_pq_lookup()).  The embedding is split into nsub contiguous
+ * subspaces, each with up to PQ_MAX_CODES centroids, so an entry is stored in
+ * cache_pq_codes as one byte per subspace.  Centroids are trained on
+ * normalized embeddings; codes are scored by inner product, which then
+ * approximates cosine similarity.  Kept until a relcache invalidation on
+ * cache_pq_codebook (it is always replaced with TRUNCATE).  Each training
+ * takes a new version from cache_pq_codebook_version; codes are stored with
+ * the version they were encoded under and only those of the current one are
+ * scored.
+ */
+#define PQ_MAX_CODES			256
+
+typedef struct PQCodebook
+{
+	bool		valid;
+	Oid			codebook_relid;
+	int64		version;
+	int			nsub;			/* 0 when PQ lookups are off */
+	int			dimension;
+	int		   *starts;			/* first dimension of each subspace */
+	int		   *counts;			/* dimensions in each subspace */
+	int		   *ncodes;			/* centroids in each subspace */
+	int		   *offsets;		/* start of each subspace in centroids */
+	float4	   *centroids;		/* code-major within each subspace */
+} PQCodebook;
+
+static PQCodebook pq = {false};
+
+/* GUC variables */
+static int	coalesce_slots = 64;
+static int	coalesce_max_dimension = 2048;
+static int	access_queue_size = 8192;
+static int	hash_filter_kb = 1024;
+static int	top_queries_slots = 128;
+static int	access_sketch_buckets = 24;
+
+/* Saved hook values */
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* Pointers into shared memory, NULL when not preloaded */
+static InflightRegistry *inflight = NULL;
+static LookupStats *lookup_stats = NULL;
+static HashFilter *hash_filter = NULL;
+static CacheGauges *gauges = NULL;
+static TopQueries *top_queries_sketch = NULL;
+static AccessSketches *access_sketches = NULL;
+
+/* The in-flight slot this backend owns, if any */
+static int	my_inflight_slot = -1;
+static uint32 my_inflight_generation = 0;
+static int64 my_pending_cache_id = 0;
+static bool inflight_exit_registered = false;
+
+/*
+ * Stale-while-revalidate leases this session holds, and whether the current
+ * transaction stored an entry (a refresh, under whatever query_hash).
+ */
+static int64 *my_leases = NULL;
+static int	my_nleases = 0;
+static int	my_maxleases = 0;
+static bool my_stored_entry = false;
+
+/*
+ * Accesses merged into cache_access_sketches by this transaction.  They are
+ * taken out of the shared buckets only when it commits; after a rollback the
+ * buckets are untouched and the next flush writes them again.
+ */
+typedef struct FlushedAccesses
+{
+	TimestampTz bucket_start;
+	int64		accesses;
+	SubTransactionId subid;		/* subtransaction that wrote them */
+} FlushedAccesses;
+
+static FlushedAccesses *my_flushed = NULL;
+static int	my_nflushed = 0;
+static int	my_maxflushed = 0;
+
+/*
+ * Accesses logged by this transaction, fed to the top-queries and
+ * distinct-query sketches when it commits so that rolled-back accesses are
+ * never counted; those of a prepared transaction are not counted either.
+ * The hashes live in TopTransactionContext.
+ */
+typedef struct LoggedAccess
+{
+	char	   *query_hash;		/* NULL when logged without one */
+	bool		cache_hit;
+	float4		similarity;
+	double		cost_saved;
+	SubTransactionId subid;		/* subtransaction that logged it */
+} LoggedAccess;
+
+static LoggedAccess *my_logged = NULL;
+static int	my_nlogged = 0;
+static int	my_maxlogged = 0;
+
+static void top_queries_note_hit(const char *hash, float4 similarity, double cost_saved);
+static void access_sketch_note(const char *hash, bool cache_hit);
+
+/*
+ * Changes to cache_entries made by this transaction, applied to the gauges
+ * at commit.  reset means the gauges are replaced by base first: by the
+ * counts of a reconciliation, or by zeros after a TRUNCATE.  Histogram
+ * buckets are relative to anchor, and dropped if the gauges were reconciled
+ * again in the meantime.
+ */
+typedef struct GaugeDelta
+{
+	bool		active;
+	bool		reset;
+	bool		claim;			/* reset from a reconciliation: take over the gauges */
+	TimestampTz anchor;
+	GaugeCounts base;
+	GaugeCounts delta;
+} GaugeDelta;
+
+static GaugeDelta my_gauge_delta = {false};
+
+/*
+ * The changes as they stood when each open subtransaction first touched
+ * them, innermost last, restored if that subtransaction aborts.
+ */
+typedef struct SavedGaugeDelta
+{
+	SubTransactionId subid;
+	GaugeDelta	saved;
+} SavedGaugeDelta;
+
+static SavedGaugeDelta *my_gauge_saved = NULL;
+static int	my_ngauge_saved = 0;
+static int	my_maxgauge_saved = 0;
 
 /* Helper functions */
 static void execute_sql(const char *query)
@@ -81,273 +494,3850 @@ pg_escape_string(const char *str)
 	return result;
 }
 
-/* Initialize schema */
-Datum
-init_schema(PG_FUNCTION_ARGS)
+/*
+ * Read an integer setting from semantic_cache.cache_config.  The caller must
+ * be connected to SPI.  A missing or NULL value yields default_value.
+ */
+static int32
+get_config_int(const char *key, int32 default_value)
 {
-	int32 dimension = 1536;  /* Default: OpenAI ada-002 */
-	char *index_type = "ivfflat";  /* Default: ivfflat */
+	Oid argtypes[1] = { TEXTOID };
+	Datum argvals[1];
+	int32 result = default_value;
 	int ret;
-	bool isnull;
-	StringInfoData buf;
 
-	/* First create config table and metadata tables */
-	const char *base_sql =
-		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_config ("
-		"  key TEXT PRIMARY KEY, value TEXT"
-		");"
-		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_metadata ("
-		"  id SERIAL PRIMARY KEY,"
-		"  total_hits BIGINT DEFAULT 0,"
-		"  total_misses BIGINT DEFAULT 0,"
-		"  total_cost_saved NUMERIC(12,6) DEFAULT 0.0"
-		");"
-		"INSERT INTO semantic_cache.cache_metadata (id) VALUES (1) ON CONFLICT (id) DO NOTHING;"
-		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_access_log ("
-		"  id BIGSERIAL PRIMARY KEY,"
-		"  access_time TIMESTAMPTZ DEFAULT NOW(),"
-		"  query_hash TEXT,"
-		"  cache_hit BOOLEAN NOT NULL,"
-		"  similarity_score REAL,"
-		"  query_cost NUMERIC(10,6),"
-		"  cost_saved NUMERIC(10,6)"
-		");"
-		"CREATE INDEX IF NOT EXISTS idx_access_log_time "
-		"  ON semantic_cache.cache_access_log(access_time);"
-		"CREATE INDEX IF NOT EXISTS idx_access_log_hash "
-		"  ON semantic_cache.cache_access_log(query_hash);"
-		"INSERT INTO semantic_cache.cache_config (key, value) "
-		"  VALUES ('vector_dimension', '1536') ON CONFLICT (key) DO NOTHING;"
-		"INSERT INTO semantic_cache.cache_config (key, value) "
-		"  VALUES ('index_type', 'ivfflat') ON CONFLICT (key) DO NOTHING;";
+	argvals[0] = CStringGetTextDatum(key);
 
-	SPI_connect();
-	execute_sql(base_sql);
+	ret = SPI_execute_with_args(
+		"SELECT value FROM semantic_cache.cache_config WHERE key = $1",
+		1, argtypes, argvals, NULL, true, 1);
 
-	/* Get configured dimension */
-	ret = SPI_execute(
-		"SELECT value FROM semantic_cache.cache_config WHERE key = 'vector_dimension'",
-		true, 0);
 	if (ret == SPI_OK_SELECT && SPI_processed > 0)
 	{
+		bool isnull;
 		Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
 		if (!isnull)
 		{
-			char *dim_str = TextDatumGetCString(val);
-			dimension = atoi(dim_str);
-			pfree(dim_str);
+			char *str = TextDatumGetCString(val);
+			result = atoi(str);
+			pfree(str);
 		}
 	}
 
-	/* Get configured index type */
-	ret = SPI_execute(
-		"SELECT value FROM semantic_cache.cache_config WHERE key = 'index_type'",
-		true, 0);
+	return result;
+}
+
+/*
+ * Read a text setting from semantic_cache.cache_config as a palloc'd string.
+ * The caller must be connected to SPI.  A missing or NULL value yields a copy
+ * of default_value.
+ */
+static char *
+get_config_text(const char *key, const char *default_value)
+{
+	Oid argtypes[1] = { TEXTOID };
+	Datum argvals[1];
+	int ret;
+
+	argvals[0] = CStringGetTextDatum(key);
+
+	ret = SPI_execute_with_args(
+		"SELECT value FROM semantic_cache.cache_config WHERE key = $1",
+		1, argtypes, argvals, NULL, true, 1);
+
 	if (ret == SPI_OK_SELECT && SPI_processed > 0)
 	{
+		bool isnull;
 		Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
 		if (!isnull)
-		{
-			index_type = TextDatumGetCString(val);
-		}
+			return TextDatumGetCString(val);
 	}
 
-	/* Create cache_entries table with configured dimension */
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_entries ("
-		"  id BIGSERIAL PRIMARY KEY,"
-		"  query_hash TEXT NOT NULL UNIQUE,"
-		"  query_text TEXT NOT NULL,"
-		"  query_embedding vector(%d),"
-		"  result_data JSONB NOT NULL,"
-		"  result_size_bytes INTEGER,"
-		"  created_at TIMESTAMPTZ DEFAULT NOW(),"
-		"  last_accessed_at TIMESTAMPTZ DEFAULT NOW(),"
-		"  access_count INTEGER DEFAULT 0,"
-		"  ttl_seconds INTEGER,"
-		"  expires_at TIMESTAMPTZ,"
-		"  tags TEXT[]"
-		");",
-		dimension);
+	return pstrdup(default_value);
+}
 
-	execute_sql(buf.data);
-	pfree(buf.data);
+/*
+ * Append the key and operator class of idx_cache_embedding for a
+ * distance_metric.  cosine stores unit vectors and so shares inner product's
+ * vector_ip_ops; hamming indexes the sign bits of each dimension (pgvector
+ * 0.7+).  get_cached_result() spells its ORDER BY to match.
+ */
+static void
+append_embedding_index_key(StringInfo buf, const char *metric, int32 dimension)
+{
+	if (strcmp(metric, "l2") == 0)
+		appendStringInfoString(buf, "query_embedding vector_l2_ops");
+	else if (strcmp(metric, "hamming") == 0)
+		appendStringInfo(buf, "(binary_quantize(query_embedding)::bit(%d)) bit_hamming_ops",
+						 dimension);
+	else
+		appendStringInfoString(buf, "query_embedding vector_ip_ops");
+}
+
+/*
+ * Create a vector index of the configured type on an embedding table.  lists
+ * only applies to IVFFlat.
+ */
+static void
+create_embedding_index(const char *index_name, const char *table, const char *index_type,
+					   const char *metric, int32 dimension, int lists)
+{
+	StringInfoData buf;
 
-	/* Create index with configured type */
 	initStringInfo(&buf);
 
 	if (strcmp(index_type, "hnsw") == 0)
 	{
 		/* HNSW index - more accurate, requires pgvector 0.5.0+ */
 		appendStringInfo(&buf,
-			"CREATE INDEX IF NOT EXISTS idx_cache_embedding "
-			"  ON semantic_cache.cache_entries "
-			"  USING hnsw (query_embedding vector_cosine_ops);");
+			"CREATE INDEX IF NOT EXISTS %s ON semantic_cache.%s USING hnsw (",
+			index_name, table);
+		append_embedding_index_key(&buf, metric, dimension);
+		appendStringInfoChar(&buf, ')');
 	}
 	else
 	{
 		/* IVFFlat index - default, widely supported */
 		appendStringInfo(&buf,
-			"CREATE INDEX IF NOT EXISTS idx_cache_embedding "
-			"  ON semantic_cache.cache_entries "
-			"  USING ivfflat (query_embedding vector_cosine_ops) WITH (lists = 100);");
+			"CREATE INDEX IF NOT EXISTS %s ON semantic_cache.%s USING ivfflat (",
+			index_name, table);
+		append_embedding_index_key(&buf, metric, dimension);
+		appendStringInfo(&buf, ") WITH (lists = %d)", lists);
 	}
 
 	execute_sql(buf.data);
 	pfree(buf.data);
+}
 
-	SPI_finish();
+/*
+ * Parse a pgvector text literal ("[0.1, 0.2, ...]") into a palloc'd float4
+ * array, for the code paths that compare embeddings without going through
+ * the table.
+ */
+static float4 *
+parse_embedding(const char *str, int *dim)
+{
+	const char *p = str;
+	int capacity = 64;
+	int n = 0;
+	float4 *result = palloc(sizeof(float4) * capacity);
 
-	PG_RETURN_VOID();
+	while (isspace((unsigned char) *p))
+		p++;
+	if (*p++ != '[')
+		elog(ERROR, "invalid embedding: must start with \"[\"");
+
+	for (;;)
+	{
+		char *end;
+		float val;
+
+		while (isspace((unsigned char) *p))
+			p++;
+
+		errno = 0;
+		val = strtof(p, &end);
+		if (end == p || errno == ERANGE || isinf(val) || isnan(val))
+			elog(ERROR, "invalid embedding: bad value at position %d", (int) (p - str));
+
+		if (n == capacity)
+		{
+			capacity *= 2;
+			result = repalloc(result, sizeof(float4) * capacity);
+		}
+		result[n++] = val;
+
+		p = end;
+		while (isspace((unsigned char) *p))
+			p++;
+
+		if (*p == ',')
+		{
+			p++;
+			continue;
+		}
+		if (*p == ']')
+			break;
+		elog(ERROR, "invalid embedding: expected \",\" or \"]\" at position %d", (int) (p - str));
+	}
+
+	if (n > 16000)
+		elog(ERROR, "invalid embedding: more than 16000 dimensions");
+
+	*dim = n;
+	return result;
 }
 
-/* Cache a query */
-Datum
-cache_query(PG_FUNCTION_ARGS)
+/* Cosine similarity of two embeddings of the same dimension */
+static float8
+cosine_similarity(const float4 *a, const float4 *b, int dim)
+{
+	float8 dot = 0.0;
+	float8 norm_a = 0.0;
+	float8 norm_b = 0.0;
+	int i;
+
+	for (i = 0; i < dim; i++)
+	{
+		dot += (float8) a[i] * b[i];
+		norm_a += (float8) a[i] * a[i];
+		norm_b += (float8) b[i] * b[i];
+	}
+
+	if (norm_a == 0.0 || norm_b == 0.0)
+		return 0.0;
+
+	return dot / sqrt(norm_a * norm_b);
+}
+
+static void
+layout_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == layout.entries_relid ||
+		relid == layout.centroids_relid)
+		layout.valid = false;
+}
+
+/*
+ * Make sure the backend-local layout is current.  Must be called while
+ * connected to SPI.
+ */
+static void
+load_partition_layout(const char *fname)
 {
-	text *query_text;
-	text *emb_text;
-	Jsonb *result;
-	int32 ttl;
-	bool has_tags;
-	char *qstr, *estr, *rstr;
-	char *qesc, *eesc;
-	StringInfoData buf;
 	int ret;
-	int64 cache_id = 0;
-	SPIPlanPtr plan;
-	Oid argtypes[7];
-	Datum values[7];
-	char nulls[7];
-	int nargs;
-	size_t result_len;
+	bool isnull;
+	uint64 i;
 
-	query_text = PG_GETARG_TEXT_PP(0);
-	emb_text = PG_GETARG_TEXT_PP(1);
-	result = PG_GETARG_JSONB_P(2);
-	ttl = PG_ARGISNULL(3) ? 3600 : PG_GETARG_INT32(3);
-	has_tags = !PG_ARGISNULL(4);
+	if (layout.valid)
+		return;
 
-	/* Validate TTL */
-	if (ttl < 0)
-		elog(ERROR, "cache_query: ttl_seconds must be non-negative");
-	if (ttl > 31536000)  /* 1 year max */
-		elog(ERROR, "cache_query: ttl_seconds exceeds maximum (1 year)");
-	
-	qstr = text_to_cstring(query_text);
-	estr = text_to_cstring(emb_text);
-	rstr = JsonbToCString(NULL, &result->root, VARSIZE(result));
+	if (layout.cluster_ids)
+		pfree(layout.cluster_ids);
+	if (layout.centroids)
+		pfree(layout.centroids);
+	layout.cluster_ids = NULL;
+	layout.centroids = NULL;
+	layout.nclusters = 0;
+	layout.dimension = 0;
 
-	/* Validate result size */
-	result_len = strlen(rstr);
-	if (result_len > 10485760)  /* 10MB max */
-		elog(ERROR, "cache_query: result_data exceeds maximum size (10MB)");
+	ret = SPI_execute(
+		"SELECT c.oid, c.relkind = 'p', "
+		"  'semantic_cache.cache_centroids'::regclass::oid "
+		"FROM pg_class c "
+		"WHERE c.oid = 'semantic_cache.cache_entries'::regclass",
+		true, 0);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "%s: could not look up cache_entries", fname);
+
+	layout.entries_relid = DatumGetObjectId(
+		SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+	layout.partitioned = DatumGetBool(
+		SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+	layout.centroids_relid = DatumGetObjectId(
+		SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3, &isnull));
+
+	{
+		char *metric = get_config_text("distance_metric", "cosine");
+
+		layout.normalize = (strcmp(metric, "cosine") == 0);
+		pfree(metric);
+	}
+
+	if (layout.partitioned)
+	{
+		ret = SPI_execute(
+			"SELECT cluster_id, centroid::text FROM semantic_cache.cache_centroids "
+			"ORDER BY cluster_id",
+			true, 0);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+		if (SPI_processed == 0)
+			elog(ERROR, "%s: cache_entries is partitioned but cache_centroids is empty", fname);
+
+		layout.cluster_ids = MemoryContextAlloc(TopMemoryContext,
+												sizeof(int32) * SPI_processed);
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[i];
+			char *text = SPI_getvalue(tuple, SPI_tuptable->tupdesc, 2);
+			float4 *vec;
+			int dim;
+
+			vec = parse_embedding(text, &dim);
+			if (layout.centroids == NULL)
+			{
+				layout.dimension = dim;
+				layout.centroids = MemoryContextAlloc(TopMemoryContext,
+													  sizeof(float4) * dim * SPI_processed);
+			}
+			else if (dim != layout.dimension)
+				elog(ERROR, "%s: centroids have mixed dimensions (%d and %d)",
+					 fname, layout.dimension, dim);
+
+			layout.cluster_ids[i] = DatumGetInt32(
+				SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+			memcpy(layout.centroids + i * dim, vec, sizeof(float4) * dim);
+			pfree(vec);
+			pfree(text);
+		}
+		layout.nclusters = (int) SPI_processed;
+	}
+
+	layout.valid = true;
+}
+
+/* Cluster of the centroid nearest to an embedding */
+static int32
+nearest_cluster(const char *fname, const float4 *vec, int dim)
+{
+	int32 best = layout.cluster_ids[0];
+	float8 best_sim = -2.0;
+	int i;
+
+	if (dim != layout.dimension)
+		elog(ERROR, "%s: embedding has %d dimensions, centroids have %d",
+			 fname, dim, layout.dimension);
+
+	for (i = 0; i < layout.nclusters; i++)
+	{
+		float8 sim = cosine_similarity(vec, layout.centroids + i * dim, dim);
+
+		if (sim > best_sim)
+		{
+			best_sim = sim;
+			best = layout.cluster_ids[i];
+		}
+	}
+
+	return best;
+}
+
+static void
+pq_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == pq.codebook_relid)
+		pq.valid = false;
+}
+
+/*
+ * Make sure the backend-local PQ codebook is current.  Must be called while
+ * connected to SPI.
+ */
+static void
+load_pq_codebook(const char *fname)
+{
+	int ret;
+	bool isnull;
+	uint64 i;
+	int total = 0;
+
+	if (pq.valid)
+		return;
+
+	if (pq.starts)
+		pfree(pq.starts);
+	if (pq.centroids)
+		pfree(pq.centroids);
+	pq.starts = pq.counts = pq.ncodes = pq.offsets = NULL;
+	pq.centroids = NULL;
+	pq.nsub = 0;
+	pq.dimension = 0;
+	pq.version = 0;
+
+	ret = SPI_execute(
+		"SELECT 'semantic_cache.cache_pq_codebook'::regclass::oid",
+		true, 0);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "%s: could not look up cache_pq_codebook", fname);
+	pq.codebook_relid = DatumGetObjectId(
+		SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+	ret = SPI_execute(
+		"SELECT dim_start, dim_count, centroids, version FROM semantic_cache.cache_pq_codebook "
+		"ORDER BY subspace",
+		true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+
+	if (SPI_processed > 0)
+	{
+		int nsub = (int) SPI_processed;
+
+		/* starts, counts, ncodes and offsets share one allocation */
+		pq.starts = MemoryContextAlloc(TopMemoryContext, sizeof(int) * nsub * 4);
+		pq.counts = pq.starts + nsub;
+		pq.ncodes = pq.counts + nsub;
+		pq.offsets = pq.ncodes + nsub;
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[i];
+			ArrayType *arr;
+			int n;
+
+			pq.starts[i] = DatumGetInt32(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+			pq.counts[i] = DatumGetInt32(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull));
+			arr = DatumGetArrayTypeP(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 3, &isnull));
+			n = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+
+			if (pq.counts[i] <= 0 || n % pq.counts[i] != 0 ||
+				n / pq.counts[i] > PQ_MAX_CODES || ARR_HASNULL(arr))
+				elog(ERROR, "%s: cache_pq_codebook subspace %d is malformed", fname, (int) i);
+
+			pq.ncodes[i] = n / pq.counts[i];
+			pq.offsets[i] = total;
+			total += n;
+		}
+
+		pq.centroids = MemoryContextAlloc(TopMemoryContext, sizeof(float4) * total);
+		for (i = 0; i < SPI_processed; i++)
+		{
+			ArrayType *arr = DatumGetArrayTypeP(
+				SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 3, &isnull));
+
+			memcpy(pq.centroids + pq.offsets[i], ARR_DATA_PTR(arr),
+				   sizeof(float4) * pq.ncodes[i] * pq.counts[i]);
+		}
+
+		pq.nsub = nsub;
+		pq.dimension = pq.starts[nsub - 1] + pq.counts[nsub - 1];
+		pq.version = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+												 4, &isnull));
+	}
+
+	pq.valid = true;
+}
+
+/*
+ * pgvector's vector datum.  pgvector installs no headers, so its layout, which
+ * has not changed since its first release, is mirrored here.
+ */
+typedef struct EmbeddingVector
+{
+	int32 vl_len_;
+	int16 dim;
+	int16 unused;
+	float4 x[FLEXIBLE_ARRAY_MEMBER];
+} EmbeddingVector;
+
+/* Scale an embedding to unit length in place (zero vectors are left alone) */
+static void
+normalize_embedding(float4 *vec, int dim)
+{
+	float8 norm = 0.0;
+	int i;
+
+	for (i = 0; i < dim; i++)
+		norm += (float8) vec[i] * vec[i];
+
+	if (norm == 0.0)
+		return;
+
+	norm = sqrt(norm);
+	for (i = 0; i < dim; i++)
+		vec[i] = (float4) (vec[i] / norm);
+}
+
+/* Index of the centroid nearest (by squared L2) to a subvector */
+static int
+pq_nearest_code(const float4 *x, const float4 *centroids, int ncodes, int count)
+{
+	int best = 0;
+	float8 best_dist = -1.0;
+	int c;
+
+	for (c = 0; c < ncodes; c++)
+	{
+		const float4 *centroid = centroids + c * count;
+		float8 dist = 0.0;
+		int d;
+
+		for (d = 0; d < count; d++)
+		{
+			float8 diff = (float8) x[d] - centroid[d];
+
+			dist += diff * diff;
+		}
+
+		if (best_dist < 0.0 || dist < best_dist)
+		{
+			best_dist = dist;
+			best = c;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * PQ codes of an embedding, as a palloc'd bytea with one byte per subspace.
+ * vec is normalized in place.
+ */
+static bytea *
+pq_encode_embedding(const char *fname, float4 *vec, int dim)
+{
+	bytea *codes;
+	uint8 *out;
+	int s;
+
+	if (dim != pq.dimension)
+		elog(ERROR, "%s: embedding has %d dimensions, the PQ codebook has %d",
+			 fname, dim, pq.dimension);
+
+	normalize_embedding(vec, dim);
+
+	codes = palloc(VARHDRSZ + pq.nsub);
+	SET_VARSIZE(codes, VARHDRSZ + pq.nsub);
+	out = (uint8 *) VARDATA(codes);
+
+	for (s = 0; s < pq.nsub; s++)
+		out[s] = (uint8) pq_nearest_code(vec + pq.starts[s], pq.centroids + pq.offsets[s],
+										 pq.ncodes[s], pq.counts[s]);
+
+	return codes;
+}
+
+/*
+ * Lloyd's k-means over one subspace of the (normalized) samples, seeded with
+ * the first ncodes samples, which come in random order.  A centroid that loses
+ * all its samples keeps its previous position.
+ */
+static void
+pq_kmeans(const float4 *samples, int nsamples, int dim, int start, int count,
+		  int ncodes, int iterations, float4 *centroids)
+{
+	float8 *sums = palloc(sizeof(float8) * ncodes * count);
+	int *sizes = palloc(sizeof(int) * ncodes);
+	int i, c, d, iter;
+
+	for (c = 0; c < ncodes; c++)
+		memcpy(centroids + c * count, samples + (Size) c * dim + start, sizeof(float4) * count);
+
+	for (iter = 0; iter < iterations; iter++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		memset(sums, 0, sizeof(float8) * ncodes * count);
+		memset(sizes, 0, sizeof(int) * ncodes);
+
+		for (i = 0; i < nsamples; i++)
+		{
+			const float4 *x = samples + (Size) i * dim + start;
+			int best = pq_nearest_code(x, centroids, ncodes, count);
+
+			sizes[best]++;
+			for (d = 0; d < count; d++)
+				sums[best * count + d] += x[d];
+		}
+
+		for (c = 0; c < ncodes; c++)
+		{
+			if (sizes[c] == 0)
+				continue;
+			for (d = 0; d < count; d++)
+				centroids[c * count + d] = (float4) (sums[c * count + d] / sizes[c]);
+		}
+	}
+
+	pfree(sums);
+	pfree(sizes);
+}
+
+/* Shared memory sizing */
+
+static Size
+inflight_shmem_size(void)
+{
+	Size size;
+
+	size = add_size(offsetof(InflightRegistry, slots),
+					mul_size(sizeof(InflightSlot), coalesce_slots));
+	size = MAXALIGN(size);
+	size = add_size(size, mul_size(mul_size(coalesce_slots, coalesce_max_dimension),
+								   sizeof(float4)));
+	return size;
+}
+
+static Size
+lookup_stats_shmem_size(void)
+{
+	return add_size(offsetof(LookupStats, accesses),
+					mul_size(sizeof(AccessRecord), access_queue_size));
+}
+
+static uint64
+hash_filter_words(void)
+{
+	return (uint64) hash_filter_kb * 1024 / sizeof(uint64);
+}
+
+static Size
+hash_filter_shmem_size(void)
+{
+	return add_size(offsetof(HashFilter, words),
+					mul_size(sizeof(pg_atomic_uint64), hash_filter_words()));
+}
+
+static Size
+top_queries_shmem_size(void)
+{
+	return add_size(offsetof(TopQueries, slots),
+					mul_size(sizeof(TopQuerySlot), mul_size(2, top_queries_slots)));
+}
+
+static Size
+access_sketches_shmem_size(void)
+{
+	return add_size(offsetof(AccessSketches, buckets),
+					mul_size(sizeof(AccessSketchBucket), access_sketch_buckets));
+}
+
+static float4 *
+inflight_embedding(int slot)
+{
+	char *base = (char *) inflight +
+		MAXALIGN(offsetof(InflightRegistry, slots) +
+				 sizeof(InflightSlot) * inflight->nslots);
+
+	return (float4 *) base + (Size) slot * inflight->max_dimension;
+}
+
+static void
+semantic_cache_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(inflight_shmem_size());
+	RequestAddinShmemSpace(lookup_stats_shmem_size());
+	if (hash_filter_kb > 0)
+		RequestAddinShmemSpace(hash_filter_shmem_size());
+	RequestAddinShmemSpace(sizeof(CacheGauges));
+	if (top_queries_slots > 0)
+		RequestAddinShmemSpace(top_queries_shmem_size());
+	if (access_sketch_buckets > 0)
+		RequestAddinShmemSpace(access_sketches_shmem_size());
+	RequestNamedLWLockTranche("pg_semantic_cache", SC_NUM_LOCKS);
+}
+
+static void
+semantic_cache_shmem_startup(void)
+{
+	LWLockPadded *locks;
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	locks = GetNamedLWLockTranche("pg_semantic_cache");
+
+	inflight = ShmemInitStruct("pg_semantic_cache inflight",
+							   inflight_shmem_size(), &found);
+	if (!found)
+	{
+		memset(inflight, 0, inflight_shmem_size());
+		inflight->lock = &locks[SC_LOCK_INFLIGHT].lock;
+		ConditionVariableInit(&inflight->cv);
+		inflight->nslots = coalesce_slots;
+		inflight->max_dimension = coalesce_max_dimension;
+	}
+
+	lookup_stats = ShmemInitStruct("pg_semantic_cache lookup stats",
+								   lookup_stats_shmem_size(), &found);
+	if (!found)
+	{
+		pg_atomic_init_u64(&lookup_stats->hits, 0);
+		pg_atomic_init_u64(&lookup_stats->misses, 0);
+		pg_atomic_init_u64(&lookup_stats->negative_hits, 0);
+		pg_atomic_init_u64(&lookup_stats->dropped_accesses, 0);
+		lookup_stats->lock = &locks[SC_LOCK_ACCESS].lock;
+		lookup_stats->capacity = access_queue_size;
+		lookup_stats->count = 0;
+	}
+
+	if (hash_filter_kb > 0)
+	{
+		hash_filter = ShmemInitStruct("pg_semantic_cache hash filter",
+									  hash_filter_shmem_size(), &found);
+		if (!found)
+		{
+			uint64 i;
+
+			hash_filter->lock = &locks[SC_LOCK_HASH_FILTER].lock;
+			hash_filter->dboid = InvalidOid;
+			hash_filter->rebuilt_at = 0;
+			hash_filter->nbits = hash_filter_words() * 64;
+			pg_atomic_init_u64(&hash_filter->lookups, 0);
+			pg_atomic_init_u64(&hash_filter->definite_misses, 0);
+			pg_atomic_init_u64(&hash_filter->false_positives, 0);
+			pg_atomic_init_u64(&hash_filter->hits, 0);
+			for (i = 0; i < hash_filter_words(); i++)
+				pg_atomic_init_u64(&hash_filter->words[i], 0);
+		}
+	}
+
+	gauges = ShmemInitStruct("pg_semantic_cache gauges",
+							 sizeof(CacheGauges), &found);
+	if (!found)
+	{
+		memset(gauges, 0, sizeof(CacheGauges));
+		gauges->lock = &locks[SC_LOCK_GAUGES].lock;
+		gauges->dboid = InvalidOid;
+	}
+
+	if (top_queries_slots > 0)
+	{
+		top_queries_sketch = ShmemInitStruct("pg_semantic_cache top queries",
+											 top_queries_shmem_size(), &found);
+		if (!found)
+		{
+			memset(top_queries_sketch, 0, top_queries_shmem_size());
+			top_queries_sketch->lock = &locks[SC_LOCK_TOP_QUERIES].lock;
+			top_queries_sketch->dboid = InvalidOid;
+			top_queries_sketch->nslots = top_queries_slots;
+		}
+	}
+
+	if (access_sketch_buckets > 0)
+	{
+		access_sketches = ShmemInitStruct("pg_semantic_cache access sketches",
+										  access_sketches_shmem_size(), &found);
+		if (!found)
+		{
+			memset(access_sketches, 0, access_sketches_shmem_size());
+			access_sketches->lock = &locks[SC_LOCK_ACCESS_SKETCHES].lock;
+			access_sketches->nbuckets = access_sketch_buckets;
+			pg_atomic_init_u64(&access_sketches->recycled, 0);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Bit positions of a query hash, by double hashing: bit i is
+ * (h1 + i * h2) mod nbits.  h2 is odd so the positions do not collapse.
+ */
+static void
+hash_filter_hashes(const char *hash, int len, uint64 *h1, uint64 *h2)
+{
+	*h1 = hash_bytes_extended((const unsigned char *) hash, len, 0);
+	*h2 = hash_bytes_extended((const unsigned char *) hash, len, 1) | 1;
+}
+
+/* Add a query hash to the filter if it was built for this database */
+static void
+hash_filter_set(const char *hash, int len)
+{
+	uint64 h1, h2;
+	int i;
+
+	if (hash_filter == NULL)
+		return;
+
+	hash_filter_hashes(hash, len, &h1, &h2);
+
+	LWLockAcquire(hash_filter->lock, LW_SHARED);
+	if (hash_filter->dboid == MyDatabaseId)
+	{
+		for (i = 0; i < HASH_FILTER_K; i++)
+		{
+			uint64 bit = (h1 + i * h2) % hash_filter->nbits;
+
+			pg_atomic_fetch_or_u64(&hash_filter->words[bit / 64],
+								   UINT64CONST(1) << (bit % 64));
+		}
+	}
+	LWLockRelease(hash_filter->lock);
+}
+
+/*
+ * Whether a query hash may be cached.  false is definite; true means the
+ * filter says maybe or cannot be used here (*consulted tells which).
+ */
+static bool
+hash_filter_test(const char *hash, int len, bool *consulted)
+{
+	uint64 h1, h2;
+	bool maybe = true;
+	int i;
+
+	*consulted = false;
+	if (hash_filter == NULL || RecoveryInProgress())
+		return true;
+
+	hash_filter_hashes(hash, len, &h1, &h2);
+
+	LWLockAcquire(hash_filter->lock, LW_SHARED);
+	if (hash_filter->dboid == MyDatabaseId)
+	{
+		*consulted = true;
+		for (i = 0; i < HASH_FILTER_K && maybe; i++)
+		{
+			uint64 bit = (h1 + i * h2) % hash_filter->nbits;
+
+			if ((pg_atomic_read_u64(&hash_filter->words[bit / 64]) &
+				 (UINT64CONST(1) << (bit % 64))) == 0)
+				maybe = false;
+		}
+	}
+	LWLockRelease(hash_filter->lock);
+
+	return maybe;
+}
+
+/*
+ * Does vec answer the miss this backend registered?  Only such an entry is
+ * handed to the waiters; anything else cached in the same transaction is
+ * unrelated to the query they are waiting on.
+ */
+static bool
+inflight_matches(const float4 *vec, int dim)
+{
+	InflightSlot *slot;
+	bool matches = false;
+
+	if (inflight == NULL || my_inflight_slot < 0)
+		return false;
+
+	LWLockAcquire(inflight->lock, LW_SHARED);
+	slot = &inflight->slots[my_inflight_slot];
+	if (slot->owner_pid == MyProcPid &&
+		slot->generation == my_inflight_generation &&
+		slot->state == INFLIGHT_PENDING &&
+		slot->dimension == dim)
+		matches = cosine_similarity(vec, inflight_embedding(my_inflight_slot),
+									dim) >= slot->threshold;
+	LWLockRelease(inflight->lock);
+
+	return matches;
+}
+
+/*
+ * Move this backend's in-flight slot out of PENDING and wake the waiters.
+ * The generation check keeps us from touching a slot that already expired
+ * and was claimed by someone else.
+ */
+static void
+inflight_finish(int state, int64 cache_id)
+{
+	InflightSlot *slot;
+
+	if (inflight == NULL || my_inflight_slot < 0)
+		return;
+
+	LWLockAcquire(inflight->lock, LW_EXCLUSIVE);
+	slot = &inflight->slots[my_inflight_slot];
+	if (slot->owner_pid == MyProcPid &&
+		slot->generation == my_inflight_generation &&
+		slot->state == INFLIGHT_PENDING)
+	{
+		slot->state = state;
+		slot->cache_id = cache_id;
+	}
+	LWLockRelease(inflight->lock);
+
+	ConditionVariableBroadcast(&inflight->cv);
+
+	my_inflight_slot = -1;
+	my_pending_cache_id = 0;
+}
+
+static void
+inflight_shmem_exit(int code, Datum arg)
+{
+	inflight_finish(INFLIGHT_ABANDONED, 0);
+}
+
+/*
+ * Expiry histogram bucket of an entry (see CacheGauges), and the end of a
+ * bucket's time range.
+ */
+static int
+gauge_expiry_bucket(TimestampTz anchor, TimestampTz expires_at)
+{
+	double secs;
+	int k = 1;
+
+	if (expires_at <= anchor)
+		return 0;
+
+	secs = (double) (expires_at - anchor) / USECS_PER_SEC;
+	while (k < GAUGE_EXPIRY_BUCKETS - 1 &&
+		   secs > GAUGE_EXPIRY_BASE_SECS * ldexp(1.0, k - 1))
+		k++;
+
+	return k;
+}
+
+static TimestampTz
+gauge_bucket_end(TimestampTz anchor, int k)
+{
+	if (k == 0)
+		return anchor;
+	return anchor + (TimestampTz) (GAUGE_EXPIRY_BASE_SECS * ldexp(1.0, k - 1) * USECS_PER_SEC);
+}
+
+/* Add (sign 1) or remove (sign -1) one cache_entries row from counts */
+static void
+gauge_count_row(GaugeCounts *counts, TimestampTz anchor, int sign,
+				Datum size, bool size_null, Datum accesses, bool accesses_null,
+				bool negative, Datum expires_at, bool expires_null)
+{
+	counts->entries += sign;
+	if (!size_null)
+		counts->size_bytes += sign * (int64) DatumGetInt32(size);
+	if (!accesses_null)
+		counts->accesses += sign * (int64) DatumGetInt32(accesses);
+	if (negative)
+		counts->negatives += sign;
+	if (!expires_null)
+		counts->expiry[gauge_expiry_bucket(anchor, DatumGetTimestampTz(expires_at))] += sign;
+}
+
+/* Apply this transaction's gauge changes; called at commit */
+static void
+gauge_delta_apply(void)
+{
+	int k;
+
+	if (gauges == NULL || !my_gauge_delta.active)
+		return;
+
+	LWLockAcquire(gauges->lock, LW_EXCLUSIVE);
+
+	if (my_gauge_delta.reset &&
+		(my_gauge_delta.claim || gauges->dboid == MyDatabaseId))
+	{
+		gauges->dboid = MyDatabaseId;
+		gauges->reconciled_at = my_gauge_delta.anchor;
+		gauges->counts = my_gauge_delta.base;
+	}
+
+	if (gauges->dboid == MyDatabaseId)
+	{
+		GaugeCounts *c = &gauges->counts;
+
+		c->entries = Max(c->entries + my_gauge_delta.delta.entries, 0);
+		c->size_bytes = Max(c->size_bytes + my_gauge_delta.delta.size_bytes, 0);
+		c->accesses = Max(c->accesses + my_gauge_delta.delta.accesses, 0);
+		c->negatives = Max(c->negatives + my_gauge_delta.delta.negatives, 0);
+		if (gauges->reconciled_at == my_gauge_delta.anchor)
+			for (k = 0; k < GAUGE_EXPIRY_BUCKETS; k++)
+				c->expiry[k] = Max(c->expiry[k] + my_gauge_delta.delta.expiry[k], 0);
+	}
+
+	LWLockRelease(gauges->lock);
+}
+
+/*
+ * Refresh leases are session-level advisory locks in the two-int4 key space
+ * (pg_locks shows them with objsubid 2).  The high half of the entry id is
+ * folded into the class key, so each id maps to its own lock.
+ */
+#define REFRESH_LEASE_CLASS		1396920902
+
+static void
+refresh_lease_tag(LOCKTAG *tag, int64 cache_id)
+{
+	SET_LOCKTAG_ADVISORY(*tag, MyDatabaseId,
+						 (uint32) REFRESH_LEASE_CLASS ^ (uint32) ((uint64) cache_id >> 32),
+						 (uint32) cache_id, 2);
+}
+
+static bool
+refresh_lease_release(int64 cache_id)
+{
+	LOCKTAG tag;
+	int i;
+
+	for (i = 0; i < my_nleases; i++)
+	{
+		if (my_leases[i] != cache_id)
+			continue;
+		refresh_lease_tag(&tag, cache_id);
+		LockRelease(&tag, ExclusiveLock, true);
+		my_leases[i] = my_leases[--my_nleases];
+		return true;
+	}
+	return false;
+}
+
+static void
+refresh_lease_release_all(void)
+{
+	while (my_nleases > 0)
+		refresh_lease_release(my_leases[my_nleases - 1]);
+}
+
+/*
+ * Take what this transaction flushed out of the shared buckets, and free
+ * finished buckets with nothing new.  Called at commit.
+ */
+static void
+access_sketches_apply_flush(void)
+{
+	TimestampTz now;
+	int i, j;
+
+	if (access_sketches == NULL || my_nflushed == 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	LWLockAcquire(access_sketches->lock, LW_EXCLUSIVE);
+	for (j = 0; j < my_nflushed; j++)
+	{
+		for (i = 0; i < access_sketches->nbuckets; i++)
+		{
+			AccessSketchBucket *b = &access_sketches->buckets[i];
+
+			if (b->dboid != MyDatabaseId || b->bucket_start != my_flushed[j].bucket_start)
+				continue;
+
+			b->accesses -= my_flushed[j].accesses;
+			if (b->accesses == 0 &&
+				b->bucket_start + (int64) ACCESS_SKETCH_BUCKET_SECS * USECS_PER_SEC <= now)
+				b->dboid = InvalidOid;
+			break;
+		}
+	}
+	LWLockRelease(access_sketches->lock);
+}
+
+/* Feed the accesses this transaction logged to the sketches.  Called at commit. */
+static void
+logged_accesses_apply(void)
+{
+	int i;
+
+	for (i = 0; i < my_nlogged; i++)
+	{
+		LoggedAccess *a = &my_logged[i];
+
+		if (a->cache_hit && a->query_hash && top_queries_sketch != NULL)
+			top_queries_note_hit(a->query_hash, a->similarity, a->cost_saved);
+		if (access_sketches != NULL)
+			access_sketch_note(a->query_hash, a->cache_hit);
+	}
+}
+
+/*
+ * Publish the leader's result only once its transaction is visible, so a
+ * woken waiter is guaranteed to find the row.  Gauge changes are applied at
+ * the same point, while the writer still holds its lock on cache_entries.
+ */
+static void
+semantic_cache_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			gauge_delta_apply();
+			access_sketches_apply_flush();
+			logged_accesses_apply();
+			if (my_inflight_slot >= 0 && my_pending_cache_id != 0)
+				inflight_finish(INFLIGHT_DONE, my_pending_cache_id);
+			/* The refresh is stored; hand the leases back */
+			if (my_stored_entry)
+				refresh_lease_release_all();
+			break;
+		case XACT_EVENT_ABORT:
+			/* Let a waiter take over as leader instead of timing out */
+			if (my_inflight_slot >= 0)
+				inflight_finish(INFLIGHT_ABANDONED, 0);
+			/* A failed refresh must not keep other sessions from trying */
+			refresh_lease_release_all();
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			/* Whether the flush sticks is only known at COMMIT PREPARED */
+			if (my_nflushed > 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has flushed access sketches")));
+			break;
+		default:
+			break;
+	}
+
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+		event == XACT_EVENT_PREPARE)
+	{
+		my_gauge_delta.active = false;
+		my_ngauge_saved = 0;
+		my_stored_entry = false;
+		my_nflushed = 0;
+		my_nlogged = 0;
+	}
+}
+
+/*
+ * Flushes made, accesses logged and gauge changes counted in a rolled-back
+ * subtransaction (or its children) never happened.  A committed one hands
+ * its saved gauge changes to its parent, unless the parent saved its own.
+ */
+static void
+semantic_cache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								SubTransactionId parentSubid, void *arg)
+{
+	int i = 0;
+
+	if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		if (my_ngauge_saved > 0 && my_gauge_saved[my_ngauge_saved - 1].subid == mySubid)
+		{
+			if (parentSubid == TopSubTransactionId ||
+				(my_ngauge_saved > 1 && my_gauge_saved[my_ngauge_saved - 2].subid == parentSubid))
+				my_ngauge_saved--;
+			else
+				my_gauge_saved[my_ngauge_saved - 1].subid = parentSubid;
+		}
+		return;
+	}
+
+	if (event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	while (my_ngauge_saved > 0 && my_gauge_saved[my_ngauge_saved - 1].subid >= mySubid)
+		my_gauge_delta = my_gauge_saved[--my_ngauge_saved].saved;
+
+	while (i < my_nflushed)
+	{
+		if (my_flushed[i].subid >= mySubid)
+			my_flushed[i] = my_flushed[--my_nflushed];
+		else
+			i++;
+	}
+
+	/* Logged in order, so the aborted ones are at the end */
+	while (my_nlogged > 0 && my_logged[my_nlogged - 1].subid >= mySubid)
+		my_nlogged--;
+}
+
+/*
+ * ON CONFLICT clause used by store_cache_entry().
+ *
+ * Re-caching a live entry only bumps its access stats.  Re-caching an expired
+ * entry (one served stale by get_cached_result, or not yet evicted) replaces
+ * it in place, and so does caching a real result over a negative entry or
+ * over one invalidated by invalidate_cache_lazy().  The second RETURNING
+ * column feeds the hash filter.
+ */
+static void
+append_upsert_clause(StringInfo buf, bool partitioned)
+{
+	static const char *const refresh_columns[] = {
+		"query_embedding", "result_data", "result_size_bytes",
+		"ttl_seconds", "expires_at", "created_at", "is_negative", "generation"
+	};
+	size_t i;
+
+	/* Partitioned tables need the partition key in every unique constraint */
+	appendStringInfo(buf,
+		"ON CONFLICT (%s) DO UPDATE SET "
+		"  last_accessed_at = NOW(), "
+		"  access_count = semantic_cache.cache_entries.access_count + 1",
+		partitioned ? "query_hash, cluster_id" : "query_hash");
+
+	for (i = 0; i < lengthof(refresh_columns); i++)
+		appendStringInfo(buf,
+			", %s = CASE WHEN semantic_cache.cache_entries.expires_at <= NOW() "
+			"OR (semantic_cache.cache_entries.is_negative AND NOT EXCLUDED.is_negative) "
+			"OR semantic_cache.generation_invalidated(semantic_cache.cache_entries.generation, "
+			"semantic_cache.cache_entries.tags) "
+			"THEN EXCLUDED.%s ELSE semantic_cache.cache_entries.%s END",
+			refresh_columns[i], refresh_columns[i], refresh_columns[i]);
+
+	appendStringInfoString(buf, " RETURNING id, query_hash");
+}
+
+/* Module load */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("pg_semantic_cache.coalesce_slots",
+							"Number of in-flight miss slots used for request coalescing.",
+							"0 disables coalescing. Only takes effect via shared_preload_libraries.",
+							&coalesce_slots,
+							64, 0, 4096,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_semantic_cache.coalesce_max_dimension",
+							"Largest embedding dimension the coalescing registry can hold.",
+							NULL,
+							&coalesce_max_dimension,
+							2048, 1, 16000,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_semantic_cache.access_queue_size",
+							"Number of read-only lookups that can be queued for drain_pending_accesses().",
+							"0 disables the queue. Only takes effect via shared_preload_libraries.",
+							&access_queue_size,
+							8192, 0, 1048576,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_semantic_cache.hash_filter_kb",
+							"Size of the bloom filter get_cached_exact() uses to reject misses.",
+							"0 disables the filter. Only takes effect via shared_preload_libraries.",
+							&hash_filter_kb,
+							1024, 0, 524288,
+							PGC_POSTMASTER, GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_semantic_cache.top_queries_slots",
+							"Number of queries each top_cached_queries sketch tracks.",
+							"0 disables the sketches. Only takes effect via shared_preload_libraries.",
+							&top_queries_slots,
+							128, 0, 65536,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_semantic_cache.access_sketch_buckets",
+							"Number of hourly distinct-query sketches kept in shared memory until flushed.",
+							"0 disables the sketches. Only takes effect via shared_preload_libraries.",
+							&access_sketch_buckets,
+							24, 0, 8760,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pg_semantic_cache");
+#else
+	EmitWarningsOnPlaceholders("pg_semantic_cache");
+#endif
+
+	RegisterXactCallback(semantic_cache_xact_callback, NULL);
+	RegisterSubXactCallback(semantic_cache_subxact_callback, NULL);
+	CacheRegisterRelcacheCallback(layout_relcache_callback, (Datum) 0);
+	CacheRegisterRelcacheCallback(pq_relcache_callback, (Datum) 0);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = semantic_cache_shmem_request;
+#else
+	semantic_cache_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = semantic_cache_shmem_startup;
+}
+
+/*
+ * Indexes used by invalidate_cache(): GIN on tags, and a trigram GIN on
+ * query_text for LIKE patterns when pg_trgm is installed.  Either is dropped
+ * when its cache_config key (tag_index, pattern_index) is 'off'.  The btree on
+ * generation lets collect_invalidated() find lazily invalidated entries.  The
+ * caller must be connected to SPI.
+ */
+static void
+create_invalidation_indexes(void)
+{
+	int ret;
+	bool isnull;
+	bool tag_index = true;
+	bool pattern_index = true;
+	char *trgm_schema = NULL;
+	StringInfoData buf;
+
+	ret = SPI_execute(
+		"SELECT COALESCE(MAX(CASE WHEN key = 'tag_index' THEN value END), 'on') <> 'off',"
+		"       COALESCE(MAX(CASE WHEN key = 'pattern_index' THEN value END), 'on') <> 'off',"
+		"       (SELECT quote_ident(n.nspname) FROM pg_extension e"
+		"        JOIN pg_namespace n ON n.oid = e.extnamespace"
+		"        WHERE e.extname = 'pg_trgm') "
+		"FROM semantic_cache.cache_config "
+		"WHERE key IN ('tag_index', 'pattern_index')",
+		true, 0);
+	if (ret == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		HeapTuple tuple = SPI_tuptable->vals[0];
+		TupleDesc tupdesc = SPI_tuptable->tupdesc;
+		Datum val;
+
+		tag_index = DatumGetBool(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		pattern_index = DatumGetBool(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		val = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+		if (!isnull)
+			trgm_schema = TextDatumGetCString(val);
+	}
+
+	execute_sql("CREATE INDEX IF NOT EXISTS idx_cache_generation "
+				"  ON semantic_cache.cache_entries (generation)");
+
+	if (tag_index)
+		execute_sql("CREATE INDEX IF NOT EXISTS idx_cache_tags "
+					"  ON semantic_cache.cache_entries USING gin (tags)");
+	else
+		execute_sql("DROP INDEX IF EXISTS semantic_cache.idx_cache_tags");
+
+	if (!pattern_index)
+		execute_sql("DROP INDEX IF EXISTS semantic_cache.idx_cache_query_text_trgm");
+	else if (trgm_schema != NULL)
+	{
+		initStringInfo(&buf);
+		appendStringInfo(&buf,
+			"CREATE INDEX IF NOT EXISTS idx_cache_query_text_trgm "
+			"  ON semantic_cache.cache_entries USING gin (query_text %s.gin_trgm_ops)",
+			trgm_schema);
+		execute_sql(buf.data);
+		pfree(buf.data);
+	}
+}
+
+/* Initialize schema */
+Datum
+init_schema(PG_FUNCTION_ARGS)
+{
+	int32 dimension = 1536;  /* Default: OpenAI ada-002 */
+	char *index_type = "ivfflat";  /* Default: ivfflat */
+	char *metric;
+	int ret;
+	bool isnull;
+	StringInfoData buf;
+
+	/* First create config table and metadata tables */
+	const char *base_sql =
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_config ("
+		"  key TEXT PRIMARY KEY, value TEXT"
+		");"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_metadata ("
+		"  id SERIAL PRIMARY KEY,"
+		"  total_hits BIGINT DEFAULT 0,"
+		"  total_misses BIGINT DEFAULT 0,"
+		"  total_cost_saved NUMERIC(12,6) DEFAULT 0.0,"
+		"  total_negative_hits BIGINT DEFAULT 0"
+		");"
+		"INSERT INTO semantic_cache.cache_metadata (id) VALUES (1) ON CONFLICT (id) DO NOTHING;"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_access_log ("
+		"  id BIGSERIAL PRIMARY KEY,"
+		"  access_time TIMESTAMPTZ DEFAULT NOW(),"
+		"  query_hash TEXT,"
+		"  cache_hit BOOLEAN NOT NULL,"
+		"  similarity_score REAL,"
+		"  query_cost NUMERIC(10,6),"
+		"  cost_saved NUMERIC(10,6)"
+		");"
+		"CREATE INDEX IF NOT EXISTS idx_access_log_time "
+		"  ON semantic_cache.cache_access_log(access_time);"
+		"CREATE INDEX IF NOT EXISTS idx_access_log_hash "
+		"  ON semantic_cache.cache_access_log(query_hash);"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_sync_events ("
+		"  id BIGSERIAL PRIMARY KEY,"
+		"  event_time TIMESTAMPTZ DEFAULT NOW(),"
+		"  kind CHAR(1) NOT NULL,"
+		"  query_hash TEXT NOT NULL,"
+		"  query_text TEXT,"
+		"  query_embedding vector,"
+		"  result_data JSONB,"
+		"  result_size_bytes INTEGER,"
+		"  is_negative BOOLEAN DEFAULT false,"
+		"  ttl_seconds INTEGER,"
+		"  created_at TIMESTAMPTZ,"
+		"  expires_at TIMESTAMPTZ,"
+		"  tags TEXT[]"
+		");"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_centroids ("
+		"  cluster_id INTEGER PRIMARY KEY,"
+		"  centroid vector NOT NULL"
+		");"
+		"CREATE SEQUENCE IF NOT EXISTS semantic_cache.cache_generation;"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_dependencies ("
+		"  source_table TEXT NOT NULL,"
+		"  tag TEXT NOT NULL,"
+		"  key_column TEXT,"
+		"  created_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  PRIMARY KEY (source_table, tag)"
+		");"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_pending_invalidations ("
+		"  tag TEXT NOT NULL,"
+		"  all_keys BOOLEAN NOT NULL DEFAULT false,"
+		"  queued_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  changes BIGINT NOT NULL DEFAULT 1,"
+		"  PRIMARY KEY (tag, all_keys)"
+		");"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_invalidation_cutoffs ("
+		"  tag TEXT PRIMARY KEY,"
+		"  generation BIGINT NOT NULL,"
+		"  invalidated_at TIMESTAMPTZ DEFAULT NOW()"
+		");"
+		"CREATE SEQUENCE IF NOT EXISTS semantic_cache.cache_pq_codebook_version;"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_pq_codebook ("
+		"  subspace INTEGER PRIMARY KEY,"
+		"  dim_start INTEGER NOT NULL,"
+		"  dim_count INTEGER NOT NULL,"
+		"  centroids REAL[] NOT NULL,"
+		"  version BIGINT NOT NULL DEFAULT 0"
+		");"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_pq_codes ("
+		"  cache_id BIGINT PRIMARY KEY,"
+		"  cluster_id INTEGER NOT NULL DEFAULT 0,"
+		"  expires_at TIMESTAMPTZ,"
+		"  is_negative BOOLEAN NOT NULL DEFAULT false,"
+		"  generation BIGINT NOT NULL DEFAULT 0,"
+		"  codebook_version BIGINT NOT NULL DEFAULT 0,"
+		"  codes BYTEA NOT NULL"
+		");"
+		"CREATE INDEX IF NOT EXISTS idx_pq_codes_cluster "
+		"  ON semantic_cache.cache_pq_codes (cluster_id);"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_embedding_memo ("
+		"  model TEXT NOT NULL,"
+		"  text_hash TEXT NOT NULL,"
+		"  embedding vector NOT NULL,"
+		"  created_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  last_used_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  expires_at TIMESTAMPTZ,"
+		"  PRIMARY KEY (model, text_hash)"
+		");"
+		"CREATE INDEX IF NOT EXISTS idx_embedding_memo_last_used "
+		"  ON semantic_cache.cache_embedding_memo (last_used_at);"
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_access_sketches ("
+		"  bucket_start TIMESTAMPTZ PRIMARY KEY,"
+		"  accesses BIGINT NOT NULL DEFAULT 0,"
+		"  queries BYTEA NOT NULL,"
+		"  missed_queries BYTEA NOT NULL"
+		");"
+		"INSERT INTO semantic_cache.cache_config (key, value) "
+		"  VALUES ('vector_dimension', '1536') ON CONFLICT (key) DO NOTHING;"
+		"INSERT INTO semantic_cache.cache_config (key, value) "
+		"  VALUES ('index_type', 'ivfflat') ON CONFLICT (key) DO NOTHING;";
+
+	SPI_connect();
+	execute_sql(base_sql);
+
+	/* Get configured dimension */
+	ret = SPI_execute(
+		"SELECT value FROM semantic_cache.cache_config WHERE key = 'vector_dimension'",
+		true, 0);
+	if (ret == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+		if (!isnull)
+		{
+			char *dim_str = TextDatumGetCString(val);
+			dimension = atoi(dim_str);
+			pfree(dim_str);
+		}
+	}
+
+	/* Get configured index type */
+	ret = SPI_execute(
+		"SELECT value FROM semantic_cache.cache_config WHERE key = 'index_type'",
+		true, 0);
+	if (ret == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+		if (!isnull)
+		{
+			index_type = TextDatumGetCString(val);
+		}
+	}
+
+	metric = get_config_text("distance_metric", "cosine");
+
+	/* Create cache_entries table with configured dimension */
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_entries ("
+		"  id BIGSERIAL PRIMARY KEY,"
+		"  query_hash TEXT NOT NULL UNIQUE,"
+		"  query_text TEXT NOT NULL,"
+		"  query_embedding vector(%d),"
+		"  result_data JSONB,"
+		"  result_size_bytes INTEGER,"
+		"  created_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  last_accessed_at TIMESTAMPTZ DEFAULT NOW(),"
+		"  access_count INTEGER DEFAULT 0,"
+		"  ttl_seconds INTEGER,"
+		"  expires_at TIMESTAMPTZ,"
+		"  tags TEXT[],"
+		"  is_negative BOOLEAN NOT NULL DEFAULT false,"
+		"  cluster_id INTEGER NOT NULL DEFAULT 0,"
+		"  generation BIGINT NOT NULL DEFAULT semantic_cache.cache_generation()"
+		");",
+		dimension);
+
+	execute_sql(buf.data);
+	pfree(buf.data);
+
+	/* Extra embeddings of an entry (see attach_embedding()), deleted with it */
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"CREATE TABLE IF NOT EXISTS semantic_cache.cache_entry_aliases ("
+		"  id BIGSERIAL PRIMARY KEY,"
+		"  cache_id BIGINT NOT NULL,"
+		"  query_embedding vector(%d) NOT NULL,"
+		"  created_at TIMESTAMPTZ DEFAULT NOW()"
+		");"
+		"CREATE INDEX IF NOT EXISTS idx_alias_cache_id "
+		"  ON semantic_cache.cache_entry_aliases (cache_id);",
+		dimension);
+
+	execute_sql(buf.data);
+	pfree(buf.data);
+
+	/* Create indexes with configured type */
+	create_embedding_index("idx_cache_embedding", "cache_entries", index_type, metric, dimension, 100);
+	create_embedding_index("idx_alias_embedding", "cache_entry_aliases", index_type, metric, dimension, 100);
+
+	create_invalidation_indexes();
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Scale a vector to unit length.  With the cosine distance_metric embeddings
+ * are stored this way, so the inner product (vector_ip_ops, <#>) of a stored
+ * embedding and a normalized query is their cosine similarity without
+ * computing any norms.
+ */
+Datum
+unit_vector(PG_FUNCTION_ARGS)
+{
+	EmbeddingVector *vec = (EmbeddingVector *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(0));
+
+	normalize_embedding(vec->x, vec->dim);
+
+	PG_RETURN_POINTER(vec);
+}
+
+/*
+ * Insert (or refresh) a cache entry.  rstr is the JSON text of the result, or
+ * NULL for a negative entry, which records that the query has no usable answer
+ * and carries no payload.  Returns the entry id.
+ */
+static int64
+store_cache_entry(const char *fname, const char *qstr, const char *estr,
+				  const char *rstr, int32 ttl, bool has_tags, Datum tags)
+{
+	char *qesc, *eesc;
+	StringInfoData buf;
+	int ret;
+	int64 cache_id = 0;
+	Oid argtypes[1];
+	Datum values[1];
+	char nulls[1];
+	int nargs = 0;
+
+	/* Everything below lives in the SPI context and goes away at SPI_finish */
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "%s: SPI_connect failed", fname);
+
+	load_partition_layout(fname);
+	load_pq_codebook(fname);
+
+	qesc = pg_escape_string(qstr);
+	eesc = pg_escape_string(estr);
+
+	initStringInfo(&buf);
+
+	appendStringInfoString(&buf,
+		"INSERT INTO semantic_cache.cache_entries "
+		"(query_hash, query_text, query_embedding, result_data, "
+		" result_size_bytes, ttl_seconds, expires_at, is_negative");
+	if (layout.partitioned)
+		appendStringInfoString(&buf, ", cluster_id");
+	if (has_tags)
+		appendStringInfoString(&buf, ", tags");
+
+	/* With the cosine metric lookups compare unit vectors by inner product */
+	if (layout.normalize)
+		appendStringInfo(&buf, ") VALUES (md5(%s), %s, semantic_cache.unit_vector(%s::vector), ",
+						 qesc, qesc, eesc);
+	else
+		appendStringInfo(&buf, ") VALUES (md5(%s), %s, %s::vector, ", qesc, qesc, eesc);
+
+	/* Use dollar-quoted strings for JSONB to avoid escaping issues */
+	if (rstr != NULL)
+		appendStringInfo(&buf,
+			"$$%s$$::jsonb, %d, %d, NOW() + interval '%d seconds', false",
+			rstr, (int)strlen(rstr), ttl, ttl);
+	else
+		appendStringInfo(&buf,
+			"NULL, 0, %d, NOW() + interval '%d seconds', true",
+			ttl, ttl);
+
+	if (layout.partitioned)
+	{
+		int dim;
+		float4 *vec = parse_embedding(estr, &dim);
+
+		/* A query already cached keeps its partition, so query_hash stays unique */
+		appendStringInfo(&buf, ", semantic_cache.entry_cluster(md5(%s), %d)",
+						 qesc, nearest_cluster(fname, vec, dim));
+	}
+
+	if (has_tags)
+	{
+		/* Only tags parameter needed */
+		appendStringInfoString(&buf, ", $1) ");
+		argtypes[0] = TEXTARRAYOID;
+		values[0] = tags;
+		nulls[0] = ' ';
+		nargs = 1;
+	}
+	else
+		appendStringInfoString(&buf, ") ");
+
+	append_upsert_clause(&buf, layout.partitioned);
+	
+	if (nargs > 0)
+	{
+		ret = SPI_execute_with_args(buf.data, nargs, argtypes, values, nulls, false, 0);
+	}
+	else
+	{
+		ret = SPI_execute(buf.data, false, 0);
+	}
+	
+	if (ret < 0)
+		elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+	
+	if ((ret == SPI_OK_INSERT_RETURNING || ret == SPI_OK_UPDATE_RETURNING) && 
+	    SPI_processed > 0)
+	{
+		bool isnull;
+		Datum val = SPI_getbinval(SPI_tuptable->vals[0], 
+		                          SPI_tuptable->tupdesc, 1, &isnull);
+		if (!isnull)
+			cache_id = DatumGetInt64(val);
+
+		/* Set before commit, so get_cached_exact() never misses the entry */
+		val = SPI_getbinval(SPI_tuptable->vals[0],
+		                    SPI_tuptable->tupdesc, 2, &isnull);
+		if (!isnull)
+		{
+			text *hash = DatumGetTextPP(val);
+
+			hash_filter_set(VARDATA_ANY(hash), VARSIZE_ANY_EXHDR(hash));
+		}
+	}
+
+	/*
+	 * Keep the PQ shadow store in step; re-caching may have replaced the
+	 * embedding.  The partition, expiry and generation are copied next to the
+	 * codes so pq_candidates() can filter without reading the entries.
+	 */
+	if (pq.nsub > 0 && cache_id != 0)
+	{
+		Oid pq_argtypes[3] = { INT8OID, BYTEAOID, INT8OID };
+		Datum pq_values[3];
+		int dim;
+		float4 *vec = parse_embedding(estr, &dim);
+
+		pq_values[0] = Int64GetDatum(cache_id);
+		pq_values[1] = PointerGetDatum(pq_encode_embedding(fname, vec, dim));
+		pq_values[2] = Int64GetDatum(pq.version);
+		ret = SPI_execute_with_args(
+			"INSERT INTO semantic_cache.cache_pq_codes "
+			"  (cache_id, cluster_id, expires_at, is_negative, generation, codebook_version, codes) "
+			"SELECT id, cluster_id, expires_at, is_negative, generation, $3, $2 "
+			"FROM semantic_cache.cache_entries WHERE id = $1 "
+			"ON CONFLICT (cache_id) DO UPDATE SET "
+			"  cluster_id = EXCLUDED.cluster_id, expires_at = EXCLUDED.expires_at, "
+			"  is_negative = EXCLUDED.is_negative, generation = EXCLUDED.generation, "
+			"  codebook_version = EXCLUDED.codebook_version, codes = EXCLUDED.codes",
+			3, pq_argtypes, pq_values, NULL, false, 0);
+		if (ret < 0)
+			elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+	}
+
+	/* Remember the embedding of this text so clients can skip the model call */
+	{
+		Oid memo_argtypes[2] = { TEXTOID, TEXTOID };
+		Datum memo_values[2];
+
+		memo_values[0] = CStringGetTextDatum(qstr);
+		memo_values[1] = CStringGetTextDatum(estr);
+		ret = SPI_execute_with_args(
+			"SELECT semantic_cache.remember_embedding($1, $2)",
+			2, memo_argtypes, memo_values, NULL, false, 0);
+		if (ret < 0)
+			elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+	}
+
+	/* Waiters coalesced onto this backend's miss get the id at commit */
+	if (my_inflight_slot >= 0 && cache_id != 0)
+	{
+		int dim;
+		float4 *vec = parse_embedding(estr, &dim);
+
+		if (inflight_matches(vec, dim))
+			my_pending_cache_id = cache_id;
+		pfree(vec);
+	}
+
+	/*
+	 * Any stale-while-revalidate lease this session took out in
+	 * get_cached_result() is handed back when this transaction commits.
+	 */
+	my_stored_entry = true;
+	
+	SPI_finish();
+	
+	if (cache_id == 0)
+		elog(ERROR, "%s: Failed to get cache ID", fname);
+
+	return cache_id;
+}
+
+/* Cache a query */
+Datum
+cache_query(PG_FUNCTION_ARGS)
+{
+	text *query_text;
+	text *emb_text;
+	Jsonb *result;
+	int32 ttl;
+	bool has_tags;
+	char *qstr, *estr, *rstr;
+	int64 cache_id;
+	size_t result_len;
+
+	query_text = PG_GETARG_TEXT_PP(0);
+	emb_text = PG_GETARG_TEXT_PP(1);
+	result = PG_GETARG_JSONB_P(2);
+	ttl = PG_ARGISNULL(3) ? 3600 : PG_GETARG_INT32(3);
+	has_tags = !PG_ARGISNULL(4);
+
+	/* Validate TTL */
+	if (ttl < 0)
+		elog(ERROR, "cache_query: ttl_seconds must be non-negative");
+	if (ttl > 31536000)  /* 1 year max */
+		elog(ERROR, "cache_query: ttl_seconds exceeds maximum (1 year)");
+	
+	qstr = text_to_cstring(query_text);
+	estr = text_to_cstring(emb_text);
+	rstr = JsonbToCString(NULL, &result->root, VARSIZE(result));
+
+	/* Validate result size */
+	result_len = strlen(rstr);
+	if (result_len > 10485760)  /* 10MB max */
+		elog(ERROR, "cache_query: result_data exceeds maximum size (10MB)");
+
+	cache_id = store_cache_entry("cache_query", qstr, estr, rstr, ttl,
+								 has_tags, has_tags ? PG_GETARG_DATUM(4) : (Datum) 0);
+
+	pfree(qstr);
+	pfree(estr);
+	pfree(rstr);
+	
+	PG_RETURN_INT64(cache_id);
+}
+
+/*
+ * Cache a negative entry: the query is known to fail upstream or to have no
+ * usable answer.  Stored without a payload; lookups report it with
+ * negative = true so callers can skip the upstream call until it expires.
+ * ttl_seconds defaults to the negative_ttl_seconds setting (300).
+ */
+Datum
+cache_negative(PG_FUNCTION_ARGS)
+{
+	char *qstr, *estr;
+	int32 ttl;
+	bool has_tags;
+	int64 cache_id;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		elog(ERROR, "cache_negative: query_text and query_embedding are required");
+
+	has_tags = !PG_ARGISNULL(3);
+
+	if (PG_ARGISNULL(2))
+	{
+		SPI_connect();
+		ttl = get_config_int("negative_ttl_seconds", 300);
+		SPI_finish();
+	}
+	else
+		ttl = PG_GETARG_INT32(2);
+
+	/* Validate TTL */
+	if (ttl < 0)
+		elog(ERROR, "cache_negative: ttl_seconds must be non-negative");
+	if (ttl > 31536000)  /* 1 year max */
+		elog(ERROR, "cache_negative: ttl_seconds exceeds maximum (1 year)");
+
+	qstr = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	estr = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	cache_id = store_cache_entry("cache_negative", qstr, estr, NULL, ttl,
+								 has_tags, has_tags ? PG_GETARG_DATUM(3) : (Datum) 0);
+
+	pfree(qstr);
+	pfree(estr);
+
+	PG_RETURN_INT64(cache_id);
+}
+
+/*
+ * get_cached_result - REPLACED WITH SQL IMPLEMENTATION
+ *
+ * This function is now implemented in SQL (see sql/pg_semantic_cache--0.1.0-beta3.sql)
+ * for better memory management and simpler maintenance.
+ *
+ * Benefits of SQL implementation:
+ * - Avoids complex SPI memory context issues with pass-by-reference types (JSONB)
+ * - Provides identical functionality
+ * - Better performance (no C/SQL boundary overhead)
+ * - Easier to maintain and debug
+ * - No memory corruption issues
+ *
+ * This stub is kept only for the PG_FUNCTION_INFO_V1 declaration but is never called.
+ */
+Datum
+get_cached_result(PG_FUNCTION_ARGS)
+{
+	elog(ERROR, "get_cached_result C stub should not be called - using SQL implementation");
+	PG_RETURN_NULL();
+}
+
+/*
+ * Request coalescing for concurrent misses.
+ *
+ * Called by get_cached_result() on a miss.  If another backend registered a
+ * miss for a query within similarity_threshold and has not finished yet, wait
+ * (up to timeout_ms) for its cache_query() to commit and return that entry's
+ * id.  Otherwise register this backend as the one computing the result and
+ * return NULL.  Without shared_preload_libraries this always returns NULL.
+ */
+Datum
+coalesce_inflight(PG_FUNCTION_ARGS)
+{
+	float4 *query_vec;
+	int dim;
+	float4 threshold;
+	int32 timeout_ms;
+	TimestampTz deadline;
+	int64 result = 0;
+
+	if (PG_ARGISNULL(0) || inflight == NULL || inflight->nslots == 0)
+		PG_RETURN_NULL();
+
+	threshold = PG_ARGISNULL(1) ? 0.95 : PG_GETARG_FLOAT4(1);
+	timeout_ms = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2);
+	if (timeout_ms <= 0)
+		PG_RETURN_NULL();
+
+	query_vec = parse_embedding(text_to_cstring(PG_GETARG_TEXT_PP(0)), &dim);
+	if (dim > inflight->max_dimension)
+		PG_RETURN_NULL();
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+
+	for (;;)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+		int best = -1;
+		float8 best_similarity = -1.0;
+		int free_slot = -1;
+		int state = INFLIGHT_FREE;
+		bool reused = false;
+		int i;
+
+		LWLockAcquire(inflight->lock, LW_EXCLUSIVE);
+
+		for (i = 0; i < inflight->nslots; i++)
+		{
+			InflightSlot *slot = &inflight->slots[i];
+			float8 similarity;
+
+			/* Recycle slots whose owner outlived the coalescing window */
+			if (slot->state != INFLIGHT_FREE && slot->deadline <= now)
+				slot->state = INFLIGHT_FREE;
+
+			if (slot->state == INFLIGHT_FREE)
+			{
+				if (free_slot < 0)
+					free_slot = i;
+				continue;
+			}
+
+			if (slot->state == INFLIGHT_ABANDONED ||
+				slot->dboid != MyDatabaseId ||
+				slot->owner_pid == MyProcPid ||
+				slot->dimension != dim)
+				continue;
+
+			similarity = cosine_similarity(query_vec, inflight_embedding(i), dim);
+			if (similarity >= threshold && similarity > best_similarity)
+			{
+				best = i;
+				best_similarity = similarity;
+			}
+		}
+
+		if (best >= 0)
+		{
+			state = inflight->slots[best].state;
+			result = inflight->slots[best].cache_id;
+		}
+		else
+		{
+			/*
+			 * Nobody is computing this yet: we are the leader.  A backend
+			 * only leads one miss at a time, so reuse our old slot and wake
+			 * anyone still waiting on it.
+			 */
+			if (my_inflight_slot >= 0 &&
+				inflight->slots[my_inflight_slot].owner_pid == MyProcPid &&
+				inflight->slots[my_inflight_slot].generation == my_inflight_generation)
+			{
+				free_slot = my_inflight_slot;
+				reused = true;
+			}
+
+			if (free_slot >= 0)
+			{
+				InflightSlot *slot = &inflight->slots[free_slot];
+
+				slot->dboid = MyDatabaseId;
+				slot->owner_pid = MyProcPid;
+				slot->state = INFLIGHT_PENDING;
+				slot->generation++;
+				slot->dimension = dim;
+				slot->threshold = threshold;
+				slot->deadline = deadline;
+				slot->cache_id = 0;
+				memcpy(inflight_embedding(free_slot), query_vec, sizeof(float4) * dim);
+
+				my_inflight_slot = free_slot;
+				my_inflight_generation = slot->generation;
+				my_pending_cache_id = 0;
+			}
+		}
+
+		LWLockRelease(inflight->lock);
+
+		if (reused)
+			ConditionVariableBroadcast(&inflight->cv);
+
+		if (best < 0 || state == INFLIGHT_DONE)
+			break;
+
+		/* Someone else is computing a near-identical query: wait for it */
+		if (now >= deadline)
+		{
+			result = 0;
+			break;
+		}
+		ConditionVariableTimedSleep(&inflight->cv,
+									TimestampDifferenceMilliseconds(now, deadline),
+									PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	if (my_inflight_slot >= 0 && !inflight_exit_registered)
+	{
+		before_shmem_exit(inflight_shmem_exit, (Datum) 0);
+		inflight_exit_registered = true;
+	}
+
+	pfree(query_vec);
+
+	if (result == 0)
+		PG_RETURN_NULL();
+	PG_RETURN_INT64(result);
+}
+
+/*
+ * Try to take the stale-while-revalidate lease on an entry.  Called by
+ * get_cached_result() when it serves a stale entry.  The lease is held until
+ * a transaction of this session that stores an entry commits, a transaction
+ * aborts, release_refresh_lease() is called, or the session exits.
+ */
+Datum
+take_refresh_lease(PG_FUNCTION_ARGS)
+{
+	int64 cache_id = PG_GETARG_INT64(0);
+	LOCKTAG tag;
+	int i;
+
+	for (i = 0; i < my_nleases; i++)
+		if (my_leases[i] == cache_id)
+			PG_RETURN_BOOL(true);
+
+	/* Make room first, so a held lock is never left untracked */
+	if (my_nleases == my_maxleases)
+	{
+		int newmax = my_maxleases == 0 ? 8 : my_maxleases * 2;
+
+		if (my_leases == NULL)
+			my_leases = MemoryContextAlloc(TopMemoryContext, sizeof(int64) * newmax);
+		else
+			my_leases = repalloc(my_leases, sizeof(int64) * newmax);
+		my_maxleases = newmax;
+	}
+
+	refresh_lease_tag(&tag, cache_id);
+	if (LockAcquire(&tag, ExclusiveLock, true, true) == LOCKACQUIRE_NOT_AVAIL)
+		PG_RETURN_BOOL(false);
+
+	my_leases[my_nleases++] = cache_id;
+	PG_RETURN_BOOL(true);
+}
+
+/* Hand back the refresh lease this session holds on an entry, if any */
+Datum
+release_refresh_lease(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(refresh_lease_release(PG_GETARG_INT64(0)));
+}
+
+/*
+ * Count a lookup made without writing to the cache tables.  When cache_id is
+ * given, the access is also queued for drain_pending_accesses().  Without
+ * shared_preload_libraries this does nothing.
+ */
+Datum
+note_readonly_lookup(PG_FUNCTION_ARGS)
+{
+	bool hit = !PG_ARGISNULL(0) && PG_GETARG_BOOL(0);
+	bool negative = !PG_ARGISNULL(1) && PG_GETARG_BOOL(1);
+
+	if (lookup_stats == NULL)
+		PG_RETURN_VOID();
+
+	if (negative)
+		pg_atomic_fetch_add_u64(&lookup_stats->negative_hits, 1);
+	else if (hit)
+		pg_atomic_fetch_add_u64(&lookup_stats->hits, 1);
+	else
+		pg_atomic_fetch_add_u64(&lookup_stats->misses, 1);
+
+	if (!PG_ARGISNULL(2) && lookup_stats->capacity > 0)
+	{
+		LWLockAcquire(lookup_stats->lock, LW_EXCLUSIVE);
+		if (lookup_stats->count < lookup_stats->capacity)
+		{
+			AccessRecord *rec = &lookup_stats->accesses[lookup_stats->count++];
+
+			rec->dboid = MyDatabaseId;
+			rec->cache_id = PG_GETARG_INT64(2);
+			rec->accessed_at = GetCurrentTimestamp();
+		}
+		else
+			pg_atomic_fetch_add_u64(&lookup_stats->dropped_accesses, 1);
+		LWLockRelease(lookup_stats->lock);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/* Read-only lookup counters for this server; all NULL when not preloaded */
+Datum
+readonly_lookup_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[5];
+	bool nulls[5] = {false};
+	int pending;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (lookup_stats == NULL)
+	{
+		memset(nulls, true, sizeof(nulls));
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	LWLockAcquire(lookup_stats->lock, LW_SHARED);
+	pending = lookup_stats->count;
+	LWLockRelease(lookup_stats->lock);
+
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&lookup_stats->hits));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&lookup_stats->misses));
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&lookup_stats->negative_hits));
+	values[3] = Int32GetDatum(pending);
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&lookup_stats->dropped_accesses));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Drop the queued accesses of one database, or with InvalidOid those of every
+ * database no longer in pg_database.  The queue is shared by all databases
+ * but drained per database, so without this the accesses of a dropped
+ * database, or of one nobody drains, would hold their slots forever.  The
+ * catalog is checked outside the lock; a database is dropped only once.
+ */
+static int64
+access_queue_discard(Oid dboid)
+{
+	Oid		   *gone;
+	int			ngone = 0;
+	int64		dropped = 0;
+	int			keep = 0;
+	int			i, j;
+
+	if (lookup_stats == NULL || lookup_stats->capacity <= 0)
+		return 0;
+
+	if (OidIsValid(dboid))
+	{
+		gone = palloc(sizeof(Oid));
+		gone[ngone++] = dboid;
+	}
+	else
+	{
+		Oid		   *seen = palloc(sizeof(Oid) * lookup_stats->capacity);
+		int			nseen = 0;
+
+		LWLockAcquire(lookup_stats->lock, LW_SHARED);
+		for (i = 0; i < lookup_stats->count; i++)
+		{
+			Oid			db = lookup_stats->accesses[i].dboid;
+
+			for (j = 0; j < nseen && seen[j] != db; j++)
+				;
+			if (j == nseen)
+				seen[nseen++] = db;
+		}
+		LWLockRelease(lookup_stats->lock);
+
+		gone = palloc(sizeof(Oid) * Max(nseen, 1));
+		for (j = 0; j < nseen; j++)
+		{
+			if (!SearchSysCacheExists1(DATABASEOID, ObjectIdGetDatum(seen[j])))
+				gone[ngone++] = seen[j];
+		}
+		pfree(seen);
+	}
+
+	if (ngone == 0)
+	{
+		pfree(gone);
+		return 0;
+	}
+
+	LWLockAcquire(lookup_stats->lock, LW_EXCLUSIVE);
+	for (i = 0; i < lookup_stats->count; i++)
+	{
+		AccessRecord *rec = &lookup_stats->accesses[i];
+
+		for (j = 0; j < ngone && gone[j] != rec->dboid; j++)
+			;
+		if (j < ngone)
+			dropped++;
+		else
+			lookup_stats->accesses[keep++] = *rec;
+	}
+	lookup_stats->count = keep;
+	LWLockRelease(lookup_stats->lock);
+
+	pfree(gone);
+	return dropped;
+}
+
+/*
+ * Drop queued accesses of another database, or with NULL those of databases
+ * that have been dropped.  Returns the number discarded, NULL when not
+ * preloaded.
+ */
+Datum
+discard_pending_accesses(PG_FUNCTION_ARGS)
+{
+	if (lookup_stats == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(access_queue_discard(PG_ARGISNULL(0) ? InvalidOid : PG_GETARG_OID(0)));
+}
+
+/*
+ * Remove up to max_rows queued accesses for the current database and return
+ * them, oldest first.  Meant to be run on a standby by whatever ships the
+ * batch to apply_access_batch() on the primary; rows are gone once returned.
+ */
+Datum
+drain_pending_accesses(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	AccessRecord *drained;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		int32 max_rows = PG_ARGISNULL(0) ? 10000 : PG_GETARG_INT32(0);
+		int n = 0;
+
+		if (max_rows < 0)
+			elog(ERROR, "drain_pending_accesses: max_rows must be non-negative");
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in wrong context")));
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		drained = NULL;
+		if (lookup_stats != NULL && lookup_stats->capacity > 0 && max_rows > 0)
+		{
+			int keep = 0;
+			int i;
+
+			drained = palloc(sizeof(AccessRecord) * Min(max_rows, lookup_stats->capacity));
+
+			/* Take ours from the front, compact everything else down */
+			LWLockAcquire(lookup_stats->lock, LW_EXCLUSIVE);
+			for (i = 0; i < lookup_stats->count; i++)
+			{
+				AccessRecord *rec = &lookup_stats->accesses[i];
+
+				if (rec->dboid == MyDatabaseId && n < max_rows)
+					drained[n++] = *rec;
+				else
+					lookup_stats->accesses[keep++] = *rec;
+			}
+			lookup_stats->count = keep;
+			LWLockRelease(lookup_stats->lock);
+		}
+
+		funcctx->user_fctx = drained;
+		funcctx->max_calls = n;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	drained = (AccessRecord *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		AccessRecord *rec = &drained[funcctx->call_cntr];
+		Datum values[2];
+		bool nulls[2] = {false};
+
+		values[0] = Int64GetDatum(rec->cache_id);
+		values[1] = TimestampTzGetDatum(rec->accessed_at);
+
+		SRF_RETURN_NEXT(funcctx,
+						HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* Add a query hash to the hash filter; used for entries arriving by sync */
+Datum
+hash_filter_add(PG_FUNCTION_ARGS)
+{
+	text *hash = PG_GETARG_TEXT_PP(0);
+
+	hash_filter_set(VARDATA_ANY(hash), VARSIZE_ANY_EXHDR(hash));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Load the hash filter from this database's cache_entries, dropping the bits
+ * of deleted entries.  The new bits are built in local memory and swapped in
+ * at the end; cache_query() is locked out meanwhile so no insert is missed.
+ * Returns the number of entries loaded, or NULL when not preloaded.
+ */
+Datum
+rebuild_hash_filter(PG_FUNCTION_ARGS)
+{
+	uint64 nwords;
+	uint64 *words;
+	uint64 i;
+	int64 loaded = 0;
+	Portal portal;
+
+	if (hash_filter == NULL)
+		PG_RETURN_NULL();
+
+	if (RecoveryInProgress())
+		elog(ERROR, "rebuild_hash_filter: cannot rebuild during recovery");
+
+	nwords = hash_filter->nbits / 64;
+	words = palloc0(nwords * sizeof(uint64));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "rebuild_hash_filter: SPI_connect failed");
+
+	execute_sql("LOCK TABLE semantic_cache.cache_entries IN SHARE MODE");
+
+	/* Not read-only, so the snapshot is taken after the lock */
+	portal = SPI_cursor_open_with_args(NULL,
+		"SELECT query_hash FROM semantic_cache.cache_entries",
+		0, NULL, NULL, NULL, false, 0);
+
+	for (;;)
+	{
+		uint64 row;
+
+		SPI_cursor_fetch(portal, true, 10000);
+		if (SPI_processed == 0)
+			break;
+
+		for (row = 0; row < SPI_processed; row++)
+		{
+			bool isnull;
+			Datum val = SPI_getbinval(SPI_tuptable->vals[row],
+									  SPI_tuptable->tupdesc, 1, &isnull);
+			text *hash;
+			uint64 h1, h2;
+			int k;
+
+			if (isnull)
+				continue;
+
+			hash = DatumGetTextPP(val);
+			hash_filter_hashes(VARDATA_ANY(hash), VARSIZE_ANY_EXHDR(hash), &h1, &h2);
+			for (k = 0; k < HASH_FILTER_K; k++)
+			{
+				uint64 bit = (h1 + k * h2) % hash_filter->nbits;
+
+				words[bit / 64] |= UINT64CONST(1) << (bit % 64);
+			}
+			loaded++;
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	SPI_cursor_close(portal);
+
+	LWLockAcquire(hash_filter->lock, LW_EXCLUSIVE);
+	for (i = 0; i < nwords; i++)
+		pg_atomic_write_u64(&hash_filter->words[i], words[i]);
+	hash_filter->dboid = MyDatabaseId;
+	hash_filter->rebuilt_at = GetCurrentTimestamp();
+	LWLockRelease(hash_filter->lock);
+
+	SPI_finish();
+	pfree(words);
+
+	PG_RETURN_INT64(loaded);
+}
+
+/*
+ * Exact-text lookup.  A definite miss from the hash filter is answered
+ * without touching cache_entries; otherwise the newest live entry with the
+ * query's hash is read.  Nothing is written, so hits and misses are counted
+ * only in hash_filter_stats(), not in cache_metadata.
+ */
+Datum
+get_cached_exact(PG_FUNCTION_ARGS)
+{
+	text *query_text;
+	TupleDesc tupdesc;
+	Datum values[5];
+	bool nulls[5] = {false};
+	text *hash;
+	bool consulted;
+	bool found = false;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	/* Not STRICT because of max_age_seconds; a NULL query is never cached */
+	if (PG_ARGISNULL(0))
+	{
+		values[0] = values[4] = BoolGetDatum(false);
+		nulls[1] = nulls[2] = nulls[3] = true;
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	query_text = PG_GETARG_TEXT_PP(0);
+	hash = DatumGetTextPP(DirectFunctionCall1(md5_text, PointerGetDatum(query_text)));
+
+	if (hash_filter_test(VARDATA_ANY(hash), VARSIZE_ANY_EXHDR(hash), &consulted))
+	{
+		Oid argtypes[2] = { TEXTOID, INT4OID };
+		Datum argvals[2];
+		char argnulls[2] = { ' ', ' ' };
+		int ret;
+
+		argvals[0] = PointerGetDatum(hash);
+		if (PG_ARGISNULL(1))
+		{
+			argvals[1] = (Datum) 0;
+			argnulls[1] = 'n';
+		}
+		else
+			argvals[1] = Int32GetDatum(PG_GETARG_INT32(1));
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "get_cached_exact: SPI_connect failed");
+
+		ret = SPI_execute_with_args(
+			"SELECT id, result_data, "
+			"       EXTRACT(EPOCH FROM (NOW() - created_at))::integer, is_negative "
+			"FROM semantic_cache.cache_entries "
+			"WHERE query_hash = $1 "
+			"  AND (expires_at IS NULL OR expires_at > NOW()) "
+			"  AND NOT semantic_cache.generation_invalidated(generation, tags) "
+			"  AND ($2 IS NULL OR EXTRACT(EPOCH FROM (NOW() - created_at)) <= $2) "
+			"ORDER BY created_at DESC LIMIT 1",
+			2, argtypes, argvals, argnulls, true, 1);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "get_cached_exact: SPI_execute failed: %d", ret);
+
+		if (SPI_processed > 0)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[0];
+			TupleDesc spi_tupdesc = SPI_tuptable->tupdesc;
+			bool isnull;
+			Datum val;
+
+			found = true;
+			values[3] = SPI_getbinval(tuple, spi_tupdesc, 1, &isnull);
+
+			/* The payload must outlive SPI_finish */
+			val = SPI_getbinval(tuple, spi_tupdesc, 2, &nulls[1]);
+			if (!nulls[1])
+			{
+				Jsonb *result = DatumGetJsonbP(val);
+				Jsonb *copy = SPI_palloc(VARSIZE(result));
+
+				memcpy(copy, result, VARSIZE(result));
+				values[1] = PointerGetDatum(copy);
+			}
+
+			values[2] = SPI_getbinval(tuple, spi_tupdesc, 3, &nulls[2]);
+			values[4] = SPI_getbinval(tuple, spi_tupdesc, 4, &isnull);
+		}
+
+		SPI_finish();
+
+		if (consulted)
+			pg_atomic_fetch_add_u64(found ? &hash_filter->hits : &hash_filter->false_positives, 1);
+	}
+	else
+		pg_atomic_fetch_add_u64(&hash_filter->definite_misses, 1);
+
+	if (consulted)
+		pg_atomic_fetch_add_u64(&hash_filter->lookups, 1);
+
+	values[0] = BoolGetDatum(found);
+	if (!found)
+	{
+		nulls[1] = nulls[2] = nulls[3] = true;
+		values[4] = BoolGetDatum(false);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Size, fill and counters of the hash filter.  The false-positive estimate is
+ * fill_ratio ^ hash_functions; false_positives counts lookups the filter let
+ * through that found nothing.  rebuilt_at is that of the last rebuild in any
+ * database; built tells whether it was this one.
+ */
+Datum
+hash_filter_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[12];
+	bool nulls[12] = {false};
+	uint64 nwords;
+	uint64 set = 0;
+	uint64 i;
+	double fill;
+	bool built;
+	bool ever_built;
+	TimestampTz rebuilt_at;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (hash_filter == NULL)
+	{
+		memset(nulls, true, sizeof(nulls));
+		values[0] = BoolGetDatum(false);
+		nulls[0] = false;
+		values[1] = BoolGetDatum(false);
+		nulls[1] = false;
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	nwords = hash_filter->nbits / 64;
+
+	LWLockAcquire(hash_filter->lock, LW_SHARED);
+	for (i = 0; i < nwords; i++)
+		set += pg_popcount64(pg_atomic_read_u64(&hash_filter->words[i]));
+	built = hash_filter->dboid == MyDatabaseId;
+	ever_built = hash_filter->dboid != InvalidOid;
+	rebuilt_at = hash_filter->rebuilt_at;
+	LWLockRelease(hash_filter->lock);
+
+	fill = (double) set / hash_filter->nbits;
+
+	values[0] = BoolGetDatum(true);
+	values[1] = BoolGetDatum(built);
+	values[2] = Int64GetDatum((int64) hash_filter_shmem_size());
+	values[3] = Int64GetDatum((int64) hash_filter->nbits);
+	values[4] = Int32GetDatum(HASH_FILTER_K);
+	values[5] = Float8GetDatum(fill);
+	values[6] = Float8GetDatum(pow(fill, HASH_FILTER_K));
+	values[7] = Int64GetDatum((int64) pg_atomic_read_u64(&hash_filter->lookups));
+	values[8] = Int64GetDatum((int64) pg_atomic_read_u64(&hash_filter->definite_misses));
+	values[9] = Int64GetDatum((int64) pg_atomic_read_u64(&hash_filter->false_positives));
+	values[10] = Int64GetDatum((int64) pg_atomic_read_u64(&hash_filter->hits));
+	values[11] = TimestampTzGetDatum(rebuilt_at);
+	nulls[11] = !ever_built;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Start collecting this transaction's gauge changes, if not already.  Called
+ * before every change, so the first one in a subtransaction saves the changes
+ * it may have to go back to.
+ */
+static void
+gauge_delta_begin(void)
+{
+	SubTransactionId subid = GetCurrentSubTransactionId();
+
+	if (subid != TopSubTransactionId &&
+		(my_ngauge_saved == 0 || my_gauge_saved[my_ngauge_saved - 1].subid < subid))
+	{
+		if (my_ngauge_saved >= my_maxgauge_saved)
+		{
+			int newmax = Max(8, my_maxgauge_saved * 2);
+
+			if (my_gauge_saved == NULL)
+				my_gauge_saved = MemoryContextAlloc(TopMemoryContext, sizeof(SavedGaugeDelta) * newmax);
+			else
+				my_gauge_saved = repalloc(my_gauge_saved, sizeof(SavedGaugeDelta) * newmax);
+			my_maxgauge_saved = newmax;
+		}
+		my_gauge_saved[my_ngauge_saved].subid = subid;
+		my_gauge_saved[my_ngauge_saved].saved = my_gauge_delta;
+		my_ngauge_saved++;
+	}
+
+	if (my_gauge_delta.active)
+		return;
+
+	memset(&my_gauge_delta, 0, sizeof(GaugeDelta));
+	my_gauge_delta.active = true;
+
+	LWLockAcquire(gauges->lock, LW_SHARED);
+	my_gauge_delta.anchor = gauges->reconciled_at;
+	LWLockRelease(gauges->lock);
+}
+
+/* Count the rows of a transition table into this transaction's changes */
+static void
+gauge_count_tuplestore(Tuplestorestate *rows, TupleDesc tupdesc, int sign)
+{
+	int size_att = SPI_fnumber(tupdesc, "result_size_bytes");
+	int accesses_att = SPI_fnumber(tupdesc, "access_count");
+	int negative_att = SPI_fnumber(tupdesc, "is_negative");
+	int expires_att = SPI_fnumber(tupdesc, "expires_at");
+	TupleTableSlot *slot;
+	int readptr;
+
+	if (size_att <= 0 || accesses_att <= 0 || negative_att <= 0 || expires_att <= 0)
+		elog(ERROR, "track_cache_gauges: cache_entries is missing a counted column");
+
+	slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+
+	/* Other triggers read the same transition table, so use our own pointer */
+	readptr = tuplestore_alloc_read_pointer(rows, EXEC_FLAG_REWIND);
+	tuplestore_select_read_pointer(rows, readptr);
+	tuplestore_rescan(rows);
+
+	while (tuplestore_gettupleslot(rows, true, false, slot))
+	{
+		bool size_null, accesses_null, negative_null, expires_null;
+		Datum size = slot_getattr(slot, size_att, &size_null);
+		Datum accesses = slot_getattr(slot, accesses_att, &accesses_null);
+		Datum negative = slot_getattr(slot, negative_att, &negative_null);
+		Datum expires_at = slot_getattr(slot, expires_att, &expires_null);
+
+		gauge_count_row(&my_gauge_delta.delta, my_gauge_delta.anchor, sign,
+						size, size_null, accesses, accesses_null,
+						!negative_null && DatumGetBool(negative),
+						expires_at, expires_null);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+}
+
+/*
+ * Statement trigger on cache_entries, installed by reconcile_cache_gauges():
+ * counts the rows an INSERT, UPDATE or DELETE changed into this
+ * transaction's gauge changes.  TRUNCATE resets the gauges to zero.
+ */
+Datum
+track_cache_gauges(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	TupleDesc tupdesc;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "track_cache_gauges: not called by trigger manager");
+
+	if (gauges == NULL)
+		return PointerGetDatum(NULL);
+
+	gauge_delta_begin();
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+	{
+		my_gauge_delta.reset = true;
+		memset(&my_gauge_delta.base, 0, sizeof(GaugeCounts));
+		memset(&my_gauge_delta.delta, 0, sizeof(GaugeCounts));
+		return PointerGetDatum(NULL);
+	}
+
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+	if (trigdata->tg_oldtable != NULL)
+		gauge_count_tuplestore(trigdata->tg_oldtable, tupdesc, -1);
+	if (trigdata->tg_newtable != NULL)
+		gauge_count_tuplestore(trigdata->tg_newtable, tupdesc, 1);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Reload the gauges from this database's cache_entries, first installing the
+ * triggers that keep them current.  Writers are locked out while the table
+ * is read, and the counts take effect when this transaction commits, so
+ * changes it made itself are not counted twice.  Returns the number of
+ * entries counted, or NULL when not preloaded.
+ */
+Datum
+reconcile_cache_gauges(PG_FUNCTION_ARGS)
+{
+	GaugeCounts counts;
+	TimestampTz anchor;
+	Portal portal;
+	int ret;
+
+	if (gauges == NULL)
+		PG_RETURN_NULL();
+
+	if (RecoveryInProgress())
+		elog(ERROR, "reconcile_cache_gauges: cannot reconcile during recovery");
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "reconcile_cache_gauges: SPI_connect failed");
+
+	/* Changes replicated by cache sync run as replica, hence ENABLE ALWAYS */
+	ret = SPI_execute(
+		"SELECT 1 FROM pg_trigger "
+		"WHERE tgrelid = 'semantic_cache.cache_entries'::regclass "
+		"  AND tgname = 'cache_gauges_insert'",
+		true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "reconcile_cache_gauges: SPI_execute failed: %d", ret);
+	if (SPI_processed == 0)
+		execute_sql(
+			"CREATE TRIGGER cache_gauges_insert"
+			"  AFTER INSERT ON semantic_cache.cache_entries"
+			"  REFERENCING NEW TABLE AS new_entries"
+			"  FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.track_cache_gauges();"
+			"CREATE TRIGGER cache_gauges_update"
+			"  AFTER UPDATE ON semantic_cache.cache_entries"
+			"  REFERENCING OLD TABLE AS old_entries NEW TABLE AS new_entries"
+			"  FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.track_cache_gauges();"
+			"CREATE TRIGGER cache_gauges_delete"
+			"  AFTER DELETE ON semantic_cache.cache_entries"
+			"  REFERENCING OLD TABLE AS old_entries"
+			"  FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.track_cache_gauges();"
+			"CREATE TRIGGER cache_gauges_truncate"
+			"  AFTER TRUNCATE ON semantic_cache.cache_entries"
+			"  FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.track_cache_gauges();"
+			"ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_gauges_insert;"
+			"ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_gauges_update;"
+			"ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_gauges_delete;"
+			"ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_gauges_truncate");
+
+	execute_sql("LOCK TABLE semantic_cache.cache_entries IN SHARE MODE");
+
+	memset(&counts, 0, sizeof(counts));
+	anchor = GetCurrentTimestamp();
+
+	/* Not read-only, so the snapshot is taken after the lock */
+	portal = SPI_cursor_open_with_args(NULL,
+		"SELECT result_size_bytes, access_count, is_negative, expires_at "
+		"FROM semantic_cache.cache_entries",
+		0, NULL, NULL, NULL, false, 0);
+
+	for (;;)
+	{
+		uint64 row;
+
+		SPI_cursor_fetch(portal, true, 10000);
+		if (SPI_processed == 0)
+			break;
+
+		for (row = 0; row < SPI_processed; row++)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[row];
+			TupleDesc tupdesc = SPI_tuptable->tupdesc;
+			bool size_null, accesses_null, negative_null, expires_null;
+			Datum size = SPI_getbinval(tuple, tupdesc, 1, &size_null);
+			Datum accesses = SPI_getbinval(tuple, tupdesc, 2, &accesses_null);
+			Datum negative = SPI_getbinval(tuple, tupdesc, 3, &negative_null);
+			Datum expires_at = SPI_getbinval(tuple, tupdesc, 4, &expires_null);
+
+			gauge_count_row(&counts, anchor, 1,
+							size, size_null, accesses, accesses_null,
+							!negative_null && DatumGetBool(negative),
+							expires_at, expires_null);
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	gauge_delta_begin();
+	my_gauge_delta.reset = true;
+	my_gauge_delta.claim = true;
+	my_gauge_delta.anchor = anchor;
+	my_gauge_delta.base = counts;
+	memset(&my_gauge_delta.delta, 0, sizeof(GaugeCounts));
+
+	PG_RETURN_INT64(counts.entries);
+}
+
+/*
+ * Current gauge values.  reconciled is false and the values NULL when the
+ * gauges serve another database or were never reconciled, and on a standby,
+ * where the triggers do not run; cache_entry_totals() then reads the table.
+ * reconciled_at is that of the last reconciliation in any database.
+ */
+Datum
+cache_gauges(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[8];
+	bool nulls[8] = {false};
+	GaugeCounts counts;
+	TimestampTz reconciled_at;
+	TimestampTz now;
+	bool current;
+	bool ever_reconciled;
+	int64 expired;
+	int k;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+	memset(nulls + 2, true, sizeof(nulls) - 2 * sizeof(bool));
+
+	if (gauges == NULL)
+	{
+		values[0] = BoolGetDatum(false);
+		values[1] = BoolGetDatum(false);
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	LWLockAcquire(gauges->lock, LW_SHARED);
+	current = gauges->dboid == MyDatabaseId && !RecoveryInProgress();
+	ever_reconciled = gauges->dboid != InvalidOid;
+	reconciled_at = gauges->reconciled_at;
+	counts = gauges->counts;
+	LWLockRelease(gauges->lock);
+
+	values[0] = BoolGetDatum(true);
+	values[1] = BoolGetDatum(current);
+	values[2] = TimestampTzGetDatum(reconciled_at);
+	nulls[2] = !ever_reconciled;
+
+	if (current)
+	{
+		/* Whole buckets that ended, plus a share of the one under way */
+		now = GetCurrentTimestamp();
+		expired = counts.expiry[0];
+		for (k = 1; k < GAUGE_EXPIRY_BUCKETS; k++)
+		{
+			TimestampTz start = gauge_bucket_end(reconciled_at, k - 1);
+			TimestampTz end = gauge_bucket_end(reconciled_at, k);
+
+			if (now >= end)
+				expired += counts.expiry[k];
+			else
+			{
+				if (now > start)
+					expired += (int64) (counts.expiry[k] *
+										((double) (now - start) / (end - start)));
+				break;
+			}
+		}
+
+		values[3] = Int64GetDatum(counts.entries);
+		values[4] = Int64GetDatum(Min(expired, counts.entries));
+		values[5] = Int64GetDatum(counts.size_bytes);
+		values[6] = Int64GetDatum(counts.accesses);
+		values[7] = Int64GetDatum(counts.negatives);
+		memset(nulls + 3, false, 5 * sizeof(bool));
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Count a hit of a query in one sketch.  The caller holds the lock exclusive.
+ */
+static void
+top_queries_add(int sketch, uint64 key, const char *hash, int len,
+				double weight, float4 similarity, TimestampTz accessed_at)
+{
+	int nslots = top_queries_sketch->nslots;
+	TopQuerySlot *slots = top_queries_sketch->slots + sketch * nslots;
+	TopQuerySlot *slot = NULL;
+	int i;
+
+	top_queries_sketch->total[sketch] += weight;
+
+	for (i = 0; i < top_queries_sketch->used[sketch]; i++)
+	{
+		if (slots[i].key == key)
+		{
+			slot = &slots[i];
+			break;
+		}
+	}
+
+	if (slot == NULL)
+	{
+		if (top_queries_sketch->used[sketch] < nslots)
+		{
+			slot = &slots[top_queries_sketch->used[sketch]++];
+			slot->count = 0;
+			slot->error = 0;
+		}
+		else
+		{
+			/* Take over the smallest counter, keeping its count as the error */
+			slot = &slots[0];
+			for (i = 1; i < nslots; i++)
+			{
+				if (slots[i].count < slot->count)
+					slot = &slots[i];
+			}
+			slot->error = slot->count;
+		}
+
+		slot->key = key;
+		slot->hits = 0;
+		slot->similarity_sum = 0;
+		len = pg_mbcliplen(hash, len, TOP_QUERY_HASH_LEN);
+		memcpy(slot->query_hash, hash, len);
+		slot->query_hash[len] = '\0';
+	}
+
+	slot->count += weight;
+	slot->hits++;
+	slot->similarity_sum += similarity;
+	slot->last_access = accessed_at;
+}
+
+/* Feed a logged cache hit to both sketches; hits that saved nothing skip the cost one */
+static void
+top_queries_note_hit(const char *hash, float4 similarity, double cost_saved)
+{
+	int len = strlen(hash);
+	uint64 key = hash_bytes_extended((const unsigned char *) hash, len, 0);
+	TimestampTz accessed_at = GetCurrentTransactionStartTimestamp();
+
+	LWLockAcquire(top_queries_sketch->lock, LW_EXCLUSIVE);
+	if (top_queries_sketch->dboid == MyDatabaseId)
+	{
+		top_queries_add(TOP_BY_HITS, key, hash, len, 1.0, similarity, accessed_at);
+		if (cost_saved > 0)
+			top_queries_add(TOP_BY_COST, key, hash, len, cost_saved, similarity, accessed_at);
+	}
+	LWLockRelease(top_queries_sketch->lock);
+}
+
+/*
+ * Load both sketches from this database's cache_access_log: each gets the
+ * exact totals of its top queries, so every estimate starts without error.
+ * The sketches are built in local memory and swapped in at the end, with
+ * log_cache_access() locked out meanwhile so no hit is missed.  Returns the
+ * number of counters filled, or NULL when not preloaded.
+ */
+Datum
+rebuild_top_queries(PG_FUNCTION_ARGS)
+{
+	static const char *const order_by[2] = {"hit_total", "cost_total"};
+	TopQuerySlot *slots;
+	int used[2] = {0, 0};
+	double total[2];
+	int nslots;
+	int sketch;
+	bool isnull;
+	StringInfoData sql;
+
+	if (top_queries_sketch == NULL)
+		PG_RETURN_NULL();
+
+	if (RecoveryInProgress())
+		elog(ERROR, "rebuild_top_queries: cannot rebuild during recovery");
+
+	nslots = top_queries_sketch->nslots;
+	slots = palloc0(sizeof(TopQuerySlot) * 2 * nslots);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "rebuild_top_queries: SPI_connect failed");
+
+	execute_sql("LOCK TABLE semantic_cache.cache_access_log IN SHARE MODE");
+
+	/* Not read-only, so the snapshots are taken after the lock */
+	if (SPI_execute("SELECT COUNT(*)::float8, COALESCE(SUM(cost_saved), 0)::float8 "
+					"FROM semantic_cache.cache_access_log "
+					"WHERE cache_hit AND query_hash IS NOT NULL", false, 1) != SPI_OK_SELECT)
+		elog(ERROR, "rebuild_top_queries: failed to read cache_access_log");
+
+	total[TOP_BY_HITS] = DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[0],
+													  SPI_tuptable->tupdesc, 1, &isnull));
+	total[TOP_BY_COST] = DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[0],
+													  SPI_tuptable->tupdesc, 2, &isnull));
+
+	initStringInfo(&sql);
+	for (sketch = TOP_BY_HITS; sketch <= TOP_BY_COST; sketch++)
+	{
+		uint64 row;
+
+		resetStringInfo(&sql);
+		appendStringInfo(&sql,
+			"SELECT query_hash, COUNT(*)::float8 AS hit_total, "
+			"SUM(cost_saved)::float8 AS cost_total, COUNT(*), "
+			"COALESCE(SUM(similarity_score), 0)::float8, MAX(access_time) "
+			"FROM semantic_cache.cache_access_log "
+			"WHERE cache_hit AND query_hash IS NOT NULL%s "
+			"GROUP BY query_hash ORDER BY %s DESC, query_hash LIMIT %d",
+			sketch == TOP_BY_COST ? " AND cost_saved > 0" : "",
+			order_by[sketch], nslots);
+
+		if (SPI_execute(sql.data, false, 0) != SPI_OK_SELECT)
+			elog(ERROR, "rebuild_top_queries: failed to read cache_access_log");
+
+		for (row = 0; row < SPI_processed; row++)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[row];
+			TupleDesc tupdesc = SPI_tuptable->tupdesc;
+			TopQuerySlot *slot = &slots[sketch * nslots + used[sketch]++];
+			text *hash = DatumGetTextPP(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+			int len = VARSIZE_ANY_EXHDR(hash);
+
+			slot->key = hash_bytes_extended((const unsigned char *) VARDATA_ANY(hash), len, 0);
+			slot->count = DatumGetFloat8(SPI_getbinval(tuple, tupdesc,
+													   sketch == TOP_BY_HITS ? 2 : 3, &isnull));
+			slot->error = 0;
+			slot->hits = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+			slot->similarity_sum = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+			slot->last_access = DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+			len = pg_mbcliplen(VARDATA_ANY(hash), len, TOP_QUERY_HASH_LEN);
+			memcpy(slot->query_hash, VARDATA_ANY(hash), len);
+			slot->query_hash[len] = '\0';
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	LWLockAcquire(top_queries_sketch->lock, LW_EXCLUSIVE);
+	memcpy(top_queries_sketch->slots, slots, sizeof(TopQuerySlot) * 2 * nslots);
+	for (sketch = TOP_BY_HITS; sketch <= TOP_BY_COST; sketch++)
+	{
+		top_queries_sketch->used[sketch] = used[sketch];
+		top_queries_sketch->total[sketch] = total[sketch];
+	}
+	top_queries_sketch->dboid = MyDatabaseId;
+	top_queries_sketch->rebuilt_at = GetCurrentTimestamp();
+	LWLockRelease(top_queries_sketch->lock);
+
+	SPI_finish();
+	pfree(slots);
+	pfree(sql.data);
+
+	PG_RETURN_INT64(used[TOP_BY_HITS] + used[TOP_BY_COST]);
+}
+
+/* Largest estimate first, ties by query hash */
+static int
+top_query_slot_cmp(const void *a, const void *b)
+{
+	const TopQuerySlot *sa = (const TopQuerySlot *) a;
+	const TopQuerySlot *sb = (const TopQuerySlot *) b;
+
+	if (sa->count != sb->count)
+		return sa->count > sb->count ? -1 : 1;
+	return strcmp(sa->query_hash, sb->query_hash);
+}
+
+/*
+ * The max_rows queries of one sketch with the largest estimates, ranked by
+ * 'hits' or 'cost_saved'.  A query's true total lies between estimate -
+ * max_error and estimate; hit_count and avg_similarity cover only the hits
+ * seen since it was last admitted.  No rows unless the sketches serve this
+ * database.
+ */
+Datum
+top_queries(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TopQuerySlot *ranked;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		char *ranking = PG_ARGISNULL(0) ? "cost_saved" : text_to_cstring(PG_GETARG_TEXT_PP(0));
+		int32 max_rows = PG_ARGISNULL(1) ? 100 : PG_GETARG_INT32(1);
+		int sketch;
+		int n = 0;
+
+		if (strcmp(ranking, "hits") == 0)
+			sketch = TOP_BY_HITS;
+		else if (strcmp(ranking, "cost_saved") == 0)
+			sketch = TOP_BY_COST;
+		else
+			elog(ERROR, "top_queries: ranking must be 'hits' or 'cost_saved'");
+
+		if (max_rows < 0)
+			elog(ERROR, "top_queries: max_rows must be non-negative");
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in wrong context")));
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		ranked = NULL;
+		if (top_queries_sketch != NULL && !RecoveryInProgress())
+		{
+			ranked = palloc(sizeof(TopQuerySlot) * top_queries_sketch->nslots);
+
+			LWLockAcquire(top_queries_sketch->lock, LW_SHARED);
+			if (top_queries_sketch->dboid == MyDatabaseId)
+			{
+				n = top_queries_sketch->used[sketch];
+				memcpy(ranked,
+					   top_queries_sketch->slots + sketch * top_queries_sketch->nslots,
+					   sizeof(TopQuerySlot) * n);
+			}
+			LWLockRelease(top_queries_sketch->lock);
+
+			qsort(ranked, n, sizeof(TopQuerySlot), top_query_slot_cmp);
+		}
+
+		funcctx->user_fctx = ranked;
+		funcctx->max_calls = Min(n, max_rows);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ranked = (TopQuerySlot *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		TopQuerySlot *slot = &ranked[funcctx->call_cntr];
+		Datum values[6];
+		bool nulls[6] = {false};
+
+		values[0] = CStringGetTextDatum(slot->query_hash);
+		values[1] = Float8GetDatum(slot->count);
+		values[2] = Float8GetDatum(slot->error);
+		values[3] = Int64GetDatum(slot->hits);
+		values[4] = Float8GetDatum(slot->similarity_sum / slot->hits);
+		values[5] = TimestampTzGetDatum(slot->last_access);
+
+		SRF_RETURN_NEXT(funcctx,
+						HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Size and totals of the top-queries sketches.  Any query not tracked has a
+ * total no larger than the smallest estimate, and no error exceeds
+ * total / slots.  rebuilt_at is that of the last rebuild in any database;
+ * built tells whether it was this one.
+ */
+Datum
+top_queries_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[8];
+	bool nulls[8] = {false};
+	bool built;
+	bool ever_built;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (top_queries_sketch == NULL)
+	{
+		memset(nulls, true, sizeof(nulls));
+		values[0] = BoolGetDatum(false);
+		nulls[0] = false;
+		values[1] = BoolGetDatum(false);
+		nulls[1] = false;
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	LWLockAcquire(top_queries_sketch->lock, LW_SHARED);
+	built = top_queries_sketch->dboid == MyDatabaseId && !RecoveryInProgress();
+	ever_built = top_queries_sketch->dboid != InvalidOid;
+	values[2] = TimestampTzGetDatum(top_queries_sketch->rebuilt_at);
+	values[4] = Int32GetDatum(top_queries_sketch->used[TOP_BY_HITS]);
+	values[5] = Int32GetDatum(top_queries_sketch->used[TOP_BY_COST]);
+	values[6] = Int64GetDatum((int64) top_queries_sketch->total[TOP_BY_HITS]);
+	values[7] = Float8GetDatum(top_queries_sketch->total[TOP_BY_COST]);
+	LWLockRelease(top_queries_sketch->lock);
+
+	values[0] = BoolGetDatum(true);
+	values[1] = BoolGetDatum(built);
+	nulls[2] = !ever_built;
+	values[3] = Int32GetDatum(top_queries_sketch->nslots);
+	if (!built)
+		memset(nulls + 4, true, 4 * sizeof(bool));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* Add a query hash to a sketch: the top HLL_BITS bits pick the register */
+static void
+hll_add(uint8 *registers, const char *hash, int len)
+{
+	uint64 h = hash_bytes_extended((const unsigned char *) hash, len, 2);
+	uint64 rest = h << HLL_BITS;
+	int reg = (int) (h >> (64 - HLL_BITS));
+	uint8 rank;
+
+	/* Position of the first set bit after the register bits */
+	rank = rest == 0 ? 64 - HLL_BITS + 1 : 64 - pg_leftmost_one_pos64(rest);
+	if (registers[reg] < rank)
+		registers[reg] = rank;
+}
+
+/* Estimated number of distinct hashes added to a sketch */
+static double
+hll_count(const uint8 *registers)
+{
+	double m = HLL_REGISTERS;
+	double sum = 0;
+	double estimate;
+	int zeros = 0;
+	int i;
+
+	for (i = 0; i < HLL_REGISTERS; i++)
+	{
+		sum += ldexp(1.0, -registers[i]);
+		if (registers[i] == 0)
+			zeros++;
+	}
+
+	estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+	/* Small counts: linear counting over the empty registers is closer */
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+
+	return estimate;
+}
+
+static const uint8 *
+hll_registers(bytea *sketch, const char *caller)
+{
+	if (VARSIZE_ANY_EXHDR(sketch) != HLL_REGISTERS)
+		elog(ERROR, "%s: not a distinct-query sketch", caller);
+	return (const uint8 *) VARDATA_ANY(sketch);
+}
+
+static bytea *
+hll_to_bytea(const uint8 *registers)
+{
+	bytea *result = palloc(VARHDRSZ + HLL_REGISTERS);
+
+	SET_VARSIZE(result, VARHDRSZ + HLL_REGISTERS);
+	memcpy(VARDATA(result), registers, HLL_REGISTERS);
+	return result;
+}
+
+/*
+ * Union of two sketches.  A NULL argument stands for the empty sketch, so
+ * this is also the transition function of hll_union().
+ */
+Datum
+hll_merge(PG_FUNCTION_ARGS)
+{
+	const uint8 *a;
+	const uint8 *b;
+	uint8 merged[HLL_REGISTERS];
+	int i;
+
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	if (PG_ARGISNULL(0))
+		PG_RETURN_BYTEA_P(hll_to_bytea(hll_registers(PG_GETARG_BYTEA_PP(1), "hll_merge")));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_BYTEA_P(hll_to_bytea(hll_registers(PG_GETARG_BYTEA_PP(0), "hll_merge")));
+
+	a = hll_registers(PG_GETARG_BYTEA_PP(0), "hll_merge");
+	b = hll_registers(PG_GETARG_BYTEA_PP(1), "hll_merge");
+	for (i = 0; i < HLL_REGISTERS; i++)
+		merged[i] = Max(a[i], b[i]);
+
+	PG_RETURN_BYTEA_P(hll_to_bytea(merged));
+}
+
+Datum
+hll_estimate(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64((int64) rint(hll_count(hll_registers(PG_GETARG_BYTEA_PP(0), "hll_estimate"))));
+}
+
+/* Count a logged access in the bucket of the hour its transaction started in */
+static void
+access_sketch_note(const char *hash, bool cache_hit)
+{
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+	TimestampTz bucket_start = now - now % ((int64) ACCESS_SKETCH_BUCKET_SECS * USECS_PER_SEC);
+	AccessSketchBucket *bucket = NULL;
+	AccessSketchBucket *victim = NULL;
+	int len = hash ? strlen(hash) : 0;
+	int i;
+
+	LWLockAcquire(access_sketches->lock, LW_EXCLUSIVE);
+	for (i = 0; i < access_sketches->nbuckets; i++)
+	{
+		AccessSketchBucket *b = &access_sketches->buckets[i];
+
+		if (b->dboid == MyDatabaseId && b->bucket_start == bucket_start)
+		{
+			bucket = b;
+			break;
+		}
+
+		/* A free bucket, or else the oldest one */
+		if (victim == NULL ||
+			(victim->dboid != InvalidOid &&
+			 (b->dboid == InvalidOid || b->bucket_start < victim->bucket_start)))
+			victim = b;
+	}
+
+	if (bucket == NULL)
+	{
+		if (victim->dboid != InvalidOid)
+			pg_atomic_fetch_add_u64(&access_sketches->recycled, 1);
+
+		bucket = victim;
+		bucket->dboid = MyDatabaseId;
+		bucket->bucket_start = bucket_start;
+		bucket->accesses = 0;
+		memset(bucket->queries, 0, HLL_REGISTERS);
+		memset(bucket->missed, 0, HLL_REGISTERS);
+	}
+
+	bucket->accesses++;
+	if (hash != NULL)
+	{
+		hll_add(bucket->queries, hash, len);
+		if (!cache_hit)
+			hll_add(bucket->missed, hash, len);
+	}
+	LWLockRelease(access_sketches->lock);
+}
+
+/*
+ * Merge this database's hourly sketches into cache_access_sketches.  When the
+ * transaction commits, the merged accesses are taken out of the buckets and
+ * those whose hour is over are freed; the current one stays, and only the
+ * accesses logged after this flush are added by the next.  Flushes are
+ * serialized by a lock on the table.  Returns the number of buckets merged,
+ * or NULL when not preloaded.
+ */
+Datum
+flush_access_sketches(PG_FUNCTION_ARGS)
+{
+	Oid argtypes[4] = {TIMESTAMPTZOID, INT8OID, BYTEAOID, BYTEAOID};
+	AccessSketchBucket *flushed;
+	int n = 0;
+	int i, j;
+
+	if (access_sketches == NULL)
+		PG_RETURN_NULL();
+
+	if (RecoveryInProgress())
+		elog(ERROR, "flush_access_sketches: cannot flush during recovery");
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "flush_access_sketches: SPI_connect failed");
+
+	execute_sql("LOCK TABLE semantic_cache.cache_access_sketches IN SHARE ROW EXCLUSIVE MODE");
+
+	flushed = palloc(sizeof(AccessSketchBucket) * access_sketches->nbuckets);
+
+	LWLockAcquire(access_sketches->lock, LW_SHARED);
+	for (i = 0; i < access_sketches->nbuckets; i++)
+	{
+		if (access_sketches->buckets[i].dboid == MyDatabaseId)
+			flushed[n++] = access_sketches->buckets[i];
+	}
+	LWLockRelease(access_sketches->lock);
+
+	/* An earlier flush in this transaction already wrote some accesses */
+	for (j = 0; j < n; j++)
+	{
+		for (i = 0; i < my_nflushed; i++)
+			if (my_flushed[i].bucket_start == flushed[j].bucket_start)
+				flushed[j].accesses -= my_flushed[i].accesses;
+	}
+
+	if (my_nflushed + n > my_maxflushed)
+	{
+		int newmax = Max(my_nflushed + n, my_maxflushed * 2);
+
+		if (my_flushed == NULL)
+			my_flushed = MemoryContextAlloc(TopMemoryContext, sizeof(FlushedAccesses) * newmax);
+		else
+			my_flushed = repalloc(my_flushed, sizeof(FlushedAccesses) * newmax);
+		my_maxflushed = newmax;
+	}
+
+	for (j = 0; j < n; j++)
+	{
+		Datum values[4];
+
+		values[0] = TimestampTzGetDatum(flushed[j].bucket_start);
+		values[1] = Int64GetDatum(flushed[j].accesses);
+		values[2] = PointerGetDatum(hll_to_bytea(flushed[j].queries));
+		values[3] = PointerGetDatum(hll_to_bytea(flushed[j].missed));
+
+		if (SPI_execute_with_args(
+				"INSERT INTO semantic_cache.cache_access_sketches AS s "
+				"(bucket_start, accesses, queries, missed_queries) "
+				"VALUES ($1, $2, $3, $4) "
+				"ON CONFLICT (bucket_start) DO UPDATE SET "
+				"accesses = s.accesses + EXCLUDED.accesses, "
+				"queries = semantic_cache.hll_merge(s.queries, EXCLUDED.queries), "
+				"missed_queries = semantic_cache.hll_merge(s.missed_queries, EXCLUDED.missed_queries)",
+				4, argtypes, values, NULL, false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "flush_access_sketches: failed to write cache_access_sketches");
+	}
+
+	/* Applied to the buckets by semantic_cache_xact_callback() at commit */
+	for (j = 0; j < n; j++)
+	{
+		my_flushed[my_nflushed].bucket_start = flushed[j].bucket_start;
+		my_flushed[my_nflushed].accesses = flushed[j].accesses;
+		my_flushed[my_nflushed].subid = GetCurrentSubTransactionId();
+		my_nflushed++;
+	}
+
+	SPI_finish();
+	pfree(flushed);
+
+	PG_RETURN_INT32(n);
+}
+
+/*
+ * This database's buckets not yet freed by flush_access_sketches(), oldest
+ * first.  accesses counts only those logged since the last flush; the
+ * sketches cover the whole hour, as merging them again changes nothing.
+ */
+Datum
+pending_access_sketches(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	AccessSketchBucket *pending;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		int n = 0;
+		int i, j;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in wrong context")));
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		pending = NULL;
+		if (access_sketches != NULL)
+		{
+			pending = palloc(sizeof(AccessSketchBucket) * access_sketches->nbuckets);
+
+			LWLockAcquire(access_sketches->lock, LW_SHARED);
+			for (i = 0; i < access_sketches->nbuckets; i++)
+			{
+				if (access_sketches->buckets[i].dboid == MyDatabaseId)
+					pending[n++] = access_sketches->buckets[i];
+			}
+			LWLockRelease(access_sketches->lock);
+
+			/* Few buckets: insertion sort by start */
+			for (i = 1; i < n; i++)
+			{
+				AccessSketchBucket tmp = pending[i];
+
+				for (j = i; j > 0 && pending[j - 1].bucket_start > tmp.bucket_start; j--)
+					pending[j] = pending[j - 1];
+				pending[j] = tmp;
+			}
+		}
+
+		funcctx->user_fctx = pending;
+		funcctx->max_calls = n;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	pending = (AccessSketchBucket *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		AccessSketchBucket *b = &pending[funcctx->call_cntr];
+		Datum values[4];
+		bool nulls[4] = {false};
+
+		values[0] = TimestampTzGetDatum(b->bucket_start);
+		values[1] = Int64GetDatum(b->accesses);
+		values[2] = PointerGetDatum(hll_to_bytea(b->queries));
+		values[3] = PointerGetDatum(hll_to_bytea(b->missed));
+
+		SRF_RETURN_NEXT(funcctx,
+						HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Size and use of the hourly sketch buckets.  pending_buckets and
+ * oldest_pending are those of this database; recycled counts buckets, of
+ * any database, taken over before they were flushed.
+ */
+Datum
+access_sketch_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[6];
+	bool nulls[6] = {false};
+	TimestampTz oldest = 0;
+	int pending = 0;
+	int i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in wrong context")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	values[5] = Float8GetDatum(1.04 / sqrt((double) HLL_REGISTERS));
+
+	if (access_sketches == NULL)
+	{
+		memset(nulls, true, 5 * sizeof(bool));
+		values[0] = BoolGetDatum(false);
+		nulls[0] = false;
+		PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+	}
+
+	LWLockAcquire(access_sketches->lock, LW_SHARED);
+	for (i = 0; i < access_sketches->nbuckets; i++)
+	{
+		AccessSketchBucket *b = &access_sketches->buckets[i];
+
+		if (b->dboid != MyDatabaseId)
+			continue;
+		if (pending == 0 || b->bucket_start < oldest)
+			oldest = b->bucket_start;
+		pending++;
+	}
+	LWLockRelease(access_sketches->lock);
+
+	values[0] = BoolGetDatum(true);
+	values[1] = Int32GetDatum(access_sketches->nbuckets);
+	values[2] = Int32GetDatum(pending);
+	values[3] = TimestampTzGetDatum(oldest);
+	nulls[3] = pending == 0;
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&access_sketches->recycled));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Train the PQ codebook from a random sample of cache_entries and replace
+ * cache_pq_codebook with it.  subspaces defaults to one per 16 dimensions.
+ * Internal to enable_pq_lookup(), which also encodes the entries.
+ */
+Datum
+train_pq_codebook(PG_FUNCTION_ARGS)
+{
+	int32 subspaces = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT32(0);
+	int32 sample_size = PG_ARGISNULL(1) ? 10000 : PG_GETARG_INT32(1);
+	int32 iterations = PG_ARGISNULL(2) ? 10 : PG_GETARG_INT32(2);
+	Oid argtypes[5] = { INT4OID, INT4OID, INT4OID, FLOAT4ARRAYOID, INT8OID };
+	Datum argvals[5];
+	float4 *samples = NULL;
+	int64 version;
+	bool isnull;
+	int nsamples;
+	int dim = 0;
+	int ncodes;
+	int ret;
+	int i, s;
+
+	if (sample_size < 1)
+		elog(ERROR, "train_pq_codebook: sample_size must be positive");
+	if (iterations < 0)
+		elog(ERROR, "train_pq_codebook: iterations must be non-negative");
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "train_pq_codebook: SPI_connect failed");
+
+	argvals[0] = Int32GetDatum(sample_size);
+	ret = SPI_execute_with_args(
+		"SELECT query_embedding::text FROM semantic_cache.cache_entries "
+		"WHERE query_embedding IS NOT NULL ORDER BY random() LIMIT $1",
+		1, argtypes, argvals, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "train_pq_codebook: SPI_execute failed: %d", ret);
+	if (SPI_processed == 0)
+		elog(ERROR, "train_pq_codebook: no cached embeddings to train on");
+
+	nsamples = (int) SPI_processed;
+	for (i = 0; i < nsamples; i++)
+	{
+		char *text = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+		int vdim;
+		float4 *vec = parse_embedding(text, &vdim);
+
+		if (samples == NULL)
+		{
+			dim = vdim;
+			samples = palloc(sizeof(float4) * (Size) nsamples * dim);
+		}
+		else if (vdim != dim)
+			elog(ERROR, "train_pq_codebook: embeddings have mixed dimensions (%d and %d)",
+				 dim, vdim);
+
+		normalize_embedding(vec, dim);
+		memcpy(samples + (Size) i * dim, vec, sizeof(float4) * dim);
+		pfree(vec);
+		pfree(text);
+	}
+
+	if (subspaces == 0)
+		subspaces = Max(1, dim / 16);
+	if (subspaces < 1 || subspaces > dim)
+		elog(ERROR, "train_pq_codebook: subspaces must be between 1 and the vector dimension (%d)",
+			 dim);
+
+	ncodes = Min(nsamples, PQ_MAX_CODES);
+
+	/* Codes of the previous codebook no longer match any stored version */
+	ret = SPI_execute("SELECT nextval('semantic_cache.cache_pq_codebook_version')", false, 0);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "train_pq_codebook: could not take a codebook version");
+	version = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+	execute_sql("TRUNCATE semantic_cache.cache_pq_codebook");
+
+	for (s = 0; s < subspaces; s++)
+	{
+		int start = (int) ((int64) s * dim / subspaces);
+		int count = (int) ((int64) (s + 1) * dim / subspaces) - start;
+		float4 *centroids = palloc(sizeof(float4) * ncodes * count);
+		Datum *datums = palloc(sizeof(Datum) * ncodes * count);
+
+		pq_kmeans(samples, nsamples, dim, start, count, ncodes, iterations, centroids);
+
+		for (i = 0; i < ncodes * count; i++)
+			datums[i] = Float4GetDatum(centroids[i]);
+
+		argvals[0] = Int32GetDatum(s);
+		argvals[1] = Int32GetDatum(start);
+		argvals[2] = Int32GetDatum(count);
+		argvals[3] = PointerGetDatum(construct_array(datums, ncodes * count, FLOAT4OID,
+													 sizeof(float4), true, TYPALIGN_INT));
+		argvals[4] = Int64GetDatum(version);
+		ret = SPI_execute_with_args(
+			"INSERT INTO semantic_cache.cache_pq_codebook "
+			"  (subspace, dim_start, dim_count, centroids, version) "
+			"VALUES ($1, $2, $3, $4, $5)",
+			5, argtypes, argvals, NULL, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "train_pq_codebook: SPI_execute failed: %d", ret);
+
+		pfree(centroids);
+		pfree(datums);
+	}
+
+	SPI_finish();
+
+	PG_RETURN_INT32(subspaces);
+}
+
+/* PQ codes of an embedding, or NULL when PQ lookups are off */
+Datum
+pq_encode(PG_FUNCTION_ARGS)
+{
+	float4 *vec;
+	int dim;
+
+	if (!pq.valid)
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "pq_encode: SPI_connect failed");
+		load_pq_codebook("pq_encode");
+		SPI_finish();
+	}
+
+	if (pq.nsub == 0)
+		PG_RETURN_NULL();
+
+	vec = parse_embedding(text_to_cstring(PG_GETARG_TEXT_PP(0)), &dim);
+
+	PG_RETURN_BYTEA_P(pq_encode_embedding("pq_encode", vec, dim));
+}
+
+typedef struct PQCandidate
+{
+	int64		cache_id;
+	float4		score;
+} PQCandidate;
 
-	qesc = pg_escape_string(qstr);
-	eesc = pg_escape_string(estr);
-	/* For JSONB, use dollar quoting to avoid escaping issues */
+/* Best score first, ties by id */
+static int
+pq_candidate_cmp(const void *a, const void *b)
+{
+	const PQCandidate *ca = (const PQCandidate *) a;
+	const PQCandidate *cb = (const PQCandidate *) b;
 
-	initStringInfo(&buf);
+	if (ca->score != cb->score)
+		return ca->score > cb->score ? -1 : 1;
+	if (ca->cache_id != cb->cache_id)
+		return ca->cache_id < cb->cache_id ? -1 : 1;
+	return 0;
+}
 
-	/* Use dollar-quoted strings for JSONB to avoid escaping issues */
-	if (has_tags)
+/* Restore the min-heap property (lowest score at the root) below slot i */
+static void
+pq_heap_sift_down(PQCandidate *heap, int size, int i)
+{
+	for (;;)
 	{
-		appendStringInfo(&buf,
-			"INSERT INTO semantic_cache.cache_entries "
-			"(query_hash, query_text, query_embedding, result_data, "
-			" result_size_bytes, ttl_seconds, expires_at, tags) "
-			"VALUES (md5(%s), %s, %s::vector, $$%s$$::jsonb, %d, %d, "
-			"NOW() + interval '%d seconds', $1) "
-			"ON CONFLICT (query_hash) DO UPDATE SET "
-			"  last_accessed_at = NOW(), "
-			"  access_count = semantic_cache.cache_entries.access_count + 1 "
-			"RETURNING id",
-			qesc, qesc, eesc, rstr, (int)strlen(rstr), ttl, ttl);
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		PQCandidate tmp;
 
-		/* Only tags parameter needed */
-		argtypes[0] = TEXTARRAYOID;
-		values[0] = PG_GETARG_DATUM(4);
-		nulls[0] = ' ';
-		nargs = 1;
+		if (left < size && heap[left].score < heap[smallest].score)
+			smallest = left;
+		if (right < size && heap[right].score < heap[smallest].score)
+			smallest = right;
+		if (smallest == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
 	}
-	else
+}
+
+/*
+ * Ids of the n entries whose PQ codes score highest against an embedding,
+ * best first, by asymmetric distance: the query stays exact, and its inner
+ * product with every centroid is tabulated once so scoring an entry is one
+ * table lookup per subspace.  The scores are approximate; callers re-rank the
+ * candidates against the full vectors.  Only codes in the given partitions
+ * are scored, and codes of entries that are expired (past grace_seconds, or
+ * at all for negative entries) or older than min_generation are skipped
+ * before ranking, so they cannot crowd live entries out of the n.  Codes of
+ * an older codebook are skipped too; pq_encode_pending() re-encodes them.
+ * NULL when PQ lookups are off.
+ */
+Datum
+pq_candidates(PG_FUNCTION_ARGS)
+{
+	int32 n = PG_GETARG_INT32(1);
+	ArrayType *clusters = PG_GETARG_ARRAYTYPE_P(2);
+	Oid argtypes[3] = { INT4OID, INT8OID, INT8OID };
+	Datum values[3];
+	Datum *cluster_datums;
+	bool *cluster_nulls;
+	int ncluster_datums;
+	StringInfoData sql;
+	float4 *query;
+	float4 *table;
+	PQCandidate *heap;
+	Datum *ids;
+	int size = 0;
+	int dim;
+	int s, c, i;
+	Portal portal;
+
+	if (n < 1 || n > 100000)
+		elog(ERROR, "pq_candidates: n must be between 1 and 100000");
+
+	/* The partitions go into the query as constants so the index can skip the rest */
+	deconstruct_array(clusters, INT4OID, sizeof(int32), true, TYPALIGN_INT,
+					  &cluster_datums, &cluster_nulls, &ncluster_datums);
+	initStringInfo(&sql);
+	for (i = 0; i < ncluster_datums; i++)
 	{
-		appendStringInfo(&buf,
-			"INSERT INTO semantic_cache.cache_entries "
-			"(query_hash, query_text, query_embedding, result_data, "
-			" result_size_bytes, ttl_seconds, expires_at) "
-			"VALUES (md5(%s), %s, %s::vector, $$%s$$::jsonb, %d, %d, "
-			"NOW() + interval '%d seconds') "
-			"ON CONFLICT (query_hash) DO UPDATE SET "
-			"  last_accessed_at = NOW(), "
-			"  access_count = semantic_cache.cache_entries.access_count + 1 "
-			"RETURNING id",
-			qesc, qesc, eesc, rstr, (int)strlen(rstr), ttl, ttl);
-
-		nargs = 0;
+		if (cluster_nulls[i])
+			continue;
+		appendStringInfo(&sql, "%s%d", sql.len > 0 ? ", " : "",
+						 DatumGetInt32(cluster_datums[i]));
 	}
-	
+
 	if (SPI_connect() != SPI_OK_CONNECT)
-		elog(ERROR, "cache_query: SPI_connect failed");
-	
-	if (nargs > 0)
+		elog(ERROR, "pq_candidates: SPI_connect failed");
+
+	load_pq_codebook("pq_candidates");
+	if (pq.nsub == 0)
 	{
-		ret = SPI_execute_with_args(buf.data, nargs, argtypes, values, nulls, false, 0);
+		SPI_finish();
+		PG_RETURN_NULL();
 	}
-	else
+	if (sql.len == 0)
 	{
-		ret = SPI_execute(buf.data, false, 0);
+		SPI_finish();
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT8OID));
 	}
-	
-	if (ret < 0)
-		elog(ERROR, "cache_query: SPI_execute failed: %d", ret);
-	
-	if ((ret == SPI_OK_INSERT_RETURNING || ret == SPI_OK_UPDATE_RETURNING) && 
-	    SPI_processed > 0)
+
+	/* Results must outlive SPI_finish */
+	heap = SPI_palloc(sizeof(PQCandidate) * n);
+
+	query = parse_embedding(text_to_cstring(PG_GETARG_TEXT_PP(0)), &dim);
+	if (dim != pq.dimension)
+		elog(ERROR, "pq_candidates: embedding has %d dimensions, the PQ codebook has %d",
+			 dim, pq.dimension);
+	normalize_embedding(query, dim);
+
+	/* Subspace s, code c scores table[s * PQ_MAX_CODES + c] */
+	table = palloc0(sizeof(float4) * pq.nsub * PQ_MAX_CODES);
+	for (s = 0; s < pq.nsub; s++)
 	{
-		bool isnull;
-		Datum val = SPI_getbinval(SPI_tuptable->vals[0], 
-		                          SPI_tuptable->tupdesc, 1, &isnull);
-		if (!isnull)
-			cache_id = DatumGetInt64(val);
+		const float4 *q = query + pq.starts[s];
+
+		for (c = 0; c < pq.ncodes[s]; c++)
+		{
+			const float4 *centroid = pq.centroids + pq.offsets[s] + c * pq.counts[s];
+			float4 dot = 0.0f;
+			int d;
+
+			for (d = 0; d < pq.counts[s]; d++)
+				dot += q[d] * centroid[d];
+			table[s * PQ_MAX_CODES + c] = dot;
+		}
 	}
-	
+
+	values[0] = PG_GETARG_DATUM(3);
+	values[1] = PG_GETARG_DATUM(4);
+	values[2] = Int64GetDatum(pq.version);
+	portal = SPI_cursor_open_with_args(NULL,
+		psprintf("SELECT cache_id, codes FROM semantic_cache.cache_pq_codes "
+				 "WHERE cluster_id IN (%s) "
+				 "  AND (expires_at IS NULL "
+				 "       OR expires_at > NOW() - make_interval(secs => CASE WHEN is_negative THEN 0 ELSE $1 END)) "
+				 "  AND generation >= $2 "
+				 "  AND codebook_version = $3",
+				 sql.data),
+		3, argtypes, values, NULL, true, 0);
+
+	for (;;)
+	{
+		uint64 row;
+
+		CHECK_FOR_INTERRUPTS();
+
+		SPI_cursor_fetch(portal, true, 10000);
+		if (SPI_processed == 0)
+			break;
+
+		for (row = 0; row < SPI_processed; row++)
+		{
+			HeapTuple tuple = SPI_tuptable->vals[row];
+			bool isnull;
+			bytea *codes;
+			const uint8 *code;
+			float4 score = 0.0f;
+
+			codes = DatumGetByteaPP(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull));
+			if (isnull || VARSIZE_ANY_EXHDR(codes) != (Size) pq.nsub)
+				continue;	/* malformed */
+
+			code = (const uint8 *) VARDATA_ANY(codes);
+			for (s = 0; s < pq.nsub; s++)
+				score += table[s * PQ_MAX_CODES + code[s]];
+
+			if (size < n)
+			{
+				/* Sift the new candidate up */
+				i = size++;
+				while (i > 0 && heap[(i - 1) / 2].score > score)
+				{
+					heap[i] = heap[(i - 1) / 2];
+					i = (i - 1) / 2;
+				}
+				heap[i].score = score;
+				heap[i].cache_id = DatumGetInt64(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+			}
+			else if (score > heap[0].score)
+			{
+				heap[0].score = score;
+				heap[0].cache_id = DatumGetInt64(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+				pq_heap_sift_down(heap, size, 0);
+			}
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	SPI_cursor_close(portal);
 	SPI_finish();
-	
-	pfree(qstr);
-	pfree(estr);
-	pfree(rstr);
-	pfree(qesc);
-	pfree(eesc);
-	pfree(buf.data);
-	
-	if (cache_id == 0)
-		elog(ERROR, "cache_query: Failed to get cache ID");
-	
-	PG_RETURN_INT64(cache_id);
-}
 
-/*
- * get_cached_result - REPLACED WITH SQL IMPLEMENTATION
- *
- * This function is now implemented in SQL (see sql/pg_semantic_cache--0.1.0-beta3.sql)
- * for better memory management and simpler maintenance.
- *
- * Benefits of SQL implementation:
- * - Avoids complex SPI memory context issues with pass-by-reference types (JSONB)
- * - Provides identical functionality
- * - Better performance (no C/SQL boundary overhead)
- * - Easier to maintain and debug
- * - No memory corruption issues
- *
- * This stub is kept only for the PG_FUNCTION_INFO_V1 declaration but is never called.
- */
-Datum
-get_cached_result(PG_FUNCTION_ARGS)
-{
-	elog(ERROR, "get_cached_result C stub should not be called - using SQL implementation");
-	PG_RETURN_NULL();
+	qsort(heap, size, sizeof(PQCandidate), pq_candidate_cmp);
+
+	ids = palloc(sizeof(Datum) * Max(size, 1));
+	for (i = 0; i < size; i++)
+		ids[i] = Int64GetDatum(heap[i].cache_id);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(ids, size, INT8OID, sizeof(int64),
+										  FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
 }
 
 /* Get cache statistics */
@@ -377,54 +4367,89 @@ cache_stats(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
 }
 
+/*
+ * Delete the entries carrying any of tags or whose query_text matches any of
+ * patterns, in one statement so each matching entry is counted once.  Either
+ * array may be NULL.  With idx_cache_tags and idx_cache_query_text_trgm (see
+ * init_schema) both conditions are answered from a bitmap OR of the indexes.
+ */
+static int64
+delete_invalidated(const char *fname, Datum patterns, bool patterns_null,
+				   Datum tags, bool tags_null)
+{
+	Oid argtypes[2] = { TEXTARRAYOID, TEXTARRAYOID };
+	Datum argvals[2];
+	char nulls[2];
+	int64 deleted;
+	int ret;
+
+	argvals[0] = tags;
+	nulls[0] = tags_null ? 'n' : ' ';
+	argvals[1] = patterns;
+	nulls[1] = patterns_null ? 'n' : ' ';
+
+	SPI_connect();
+
+	/* Deletes made here are invalidations, which cache sync replicates */
+	execute_sql("SELECT set_config('semantic_cache.sync_invalidation', 'on', true)");
+
+	ret = SPI_execute_with_args(
+		"DELETE FROM semantic_cache.cache_entries "
+		"WHERE tags && $1 OR query_text LIKE ANY ($2)",
+		2, argtypes, argvals, nulls, false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "%s: SPI_execute failed: %d", fname, ret);
+	deleted = SPI_processed;
+
+	execute_sql("SELECT set_config('semantic_cache.sync_invalidation', 'off', true)");
+
+	SPI_finish();
+
+	return deleted;
+}
+
 /* Invalidate cache entries by pattern (on query_text) or tag */
 Datum
 invalidate_cache(PG_FUNCTION_ARGS)
 {
-	text *pattern_text = PG_ARGISNULL(0) ? NULL : PG_GETARG_TEXT_PP(0);
-	text *tag_text = PG_ARGISNULL(1) ? NULL : PG_GETARG_TEXT_PP(1);
-	int64 deleted = 0;
+	Datum patterns = (Datum) 0;
+	Datum tags = (Datum) 0;
 
-	if (pattern_text == NULL && tag_text == NULL)
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
 		PG_RETURN_INT64(0);
 
-	SPI_connect();
-
-	if (tag_text != NULL)
+	if (!PG_ARGISNULL(0))
 	{
-		Oid argtypes[1] = { TEXTOID };
-		Datum argvals[1];
-		StringInfoData buf;
+		Datum pattern = PG_GETARG_DATUM(0);
 
-		argvals[0] = PointerGetDatum(tag_text);
-
-		initStringInfo(&buf);
-		appendStringInfoString(&buf,
-			"DELETE FROM semantic_cache.cache_entries WHERE tags @> ARRAY[$1::text]");
-		SPI_execute_with_args(buf.data, 1, argtypes, argvals, NULL, false, 0);
-		deleted += SPI_processed;
-		pfree(buf.data);
+		patterns = PointerGetDatum(construct_array(&pattern, 1, TEXTOID,
+												   -1, false, TYPALIGN_INT));
 	}
 
-	if (pattern_text != NULL)
+	if (!PG_ARGISNULL(1))
 	{
-		Oid argtypes[1] = { TEXTOID };
-		Datum argvals[1];
-		StringInfoData buf;
-
-		argvals[0] = PointerGetDatum(pattern_text);
+		Datum tag = PG_GETARG_DATUM(1);
 
-		initStringInfo(&buf);
-		appendStringInfoString(&buf,
-			"DELETE FROM semantic_cache.cache_entries WHERE query_text LIKE $1");
-		SPI_execute_with_args(buf.data, 1, argtypes, argvals, NULL, false, 0);
-		deleted += SPI_processed;
-		pfree(buf.data);
+		tags = PointerGetDatum(construct_array(&tag, 1, TEXTOID,
+											   -1, false, TYPALIGN_INT));
 	}
 
-	SPI_finish();
+	PG_RETURN_INT64(delete_invalidated("invalidate_cache", patterns, PG_ARGISNULL(0),
+									   tags, PG_ARGISNULL(1)));
+}
 
-	PG_RETURN_INT64(deleted);
+/* Invalidate cache entries matching any of several patterns or tags */
+Datum
+invalidate_cache_multi(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_INT64(0);
+
+	PG_RETURN_INT64(delete_invalidated("invalidate_cache_multi",
+									   PG_ARGISNULL(0) ? (Datum) 0 : PG_GETARG_DATUM(0),
+									   PG_ARGISNULL(0),
+									   PG_ARGISNULL(1) ? (Datum) 0 : PG_GETARG_DATUM(1),
+									   PG_ARGISNULL(1)));
 }
 
 Datum cache_hit_rate(PG_FUNCTION_ARGS) { PG_RETURN_FLOAT4(0.0); }
@@ -433,19 +4458,117 @@ Datum cache_hit_rate(PG_FUNCTION_ARGS) { PG_RETURN_FLOAT4(0.0); }
 Datum
 evict_expired(PG_FUNCTION_ARGS)
 {
+	StringInfoData buf;
+	int32 grace;
+
 	SPI_connect();
-	execute_sql("DELETE FROM semantic_cache.cache_entries WHERE expires_at <= NOW()");
+
+	/*
+	 * Entries inside the stale-while-revalidate window are still being
+	 * served; negative entries are never served stale.
+	 */
+	grace = get_config_int("stale_grace_seconds", 0);
+	if (grace < 0)
+		grace = 0;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"DELETE FROM semantic_cache.cache_entries "
+		"WHERE expires_at <= NOW() - interval '%d seconds' "
+		"   OR (is_negative AND expires_at <= NOW())",
+		grace);
+	execute_sql(buf.data);
 	int64 d = SPI_processed;
+
+	/* Sync events for expired entries and old invalidations are no use to new subscribers */
+	execute_sql("DELETE FROM semantic_cache.cache_sync_events "
+				"WHERE expires_at <= NOW() OR event_time <= NOW() - interval '1 day'");
+
 	SPI_finish();
+	pfree(buf.data);
 	PG_RETURN_INT64(d);
 }
 
+/*
+ * Delete every entry that sorts after the first keep_count entries in
+ * descending order of sort_exprs.  The cutoff row comes from a read-only
+ * query that the planner can run as a parallel sort; the DELETE is then a
+ * plain scan with a row comparison instead of a NOT IN over the whole table.
+ * The expressions must not be NULL and must end in id so the order is total.
+ * With cluster_id >= 0 only that partition is considered; the id is written
+ * into the query as a constant so the planner prunes the other partitions.
+ */
+static int64
+evict_beyond(const char *const *sort_exprs, int nexprs, int32 keep_count,
+			 int32 cluster_id)
+{
+	StringInfoData buf;
+	char filter[64] = "";
+	int ret;
+	int i;
+	int64 deleted = 0;
+
+	if (cluster_id >= 0)
+		snprintf(filter, sizeof(filter), " WHERE cluster_id = %d", cluster_id);
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "SELECT ");
+	for (i = 0; i < nexprs; i++)
+		appendStringInfo(&buf, "%s%s", i > 0 ? ", " : "", sort_exprs[i]);
+	appendStringInfo(&buf, " FROM semantic_cache.cache_entries%s ORDER BY ", filter);
+	for (i = 0; i < nexprs; i++)
+		appendStringInfo(&buf, "%s%s DESC", i > 0 ? ", " : "", sort_exprs[i]);
+	appendStringInfo(&buf, " OFFSET %d LIMIT 1", keep_count);
+
+	SPI_connect();
+
+	ret = SPI_execute(buf.data, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: %d", ret);
+
+	if (SPI_processed > 0)
+	{
+		Oid *argtypes = palloc(sizeof(Oid) * nexprs);
+		Datum *values = palloc(sizeof(Datum) * nexprs);
+		bool isnull;
+
+		resetStringInfo(&buf);
+		appendStringInfo(&buf, "DELETE FROM semantic_cache.cache_entries%s%s (",
+						 filter, cluster_id >= 0 ? " AND" : " WHERE");
+		for (i = 0; i < nexprs; i++)
+			appendStringInfo(&buf, "%s%s", i > 0 ? ", " : "", sort_exprs[i]);
+		appendStringInfoString(&buf, ") <= (");
+		for (i = 0; i < nexprs; i++)
+		{
+			appendStringInfo(&buf, "%s$%d", i > 0 ? ", " : "", i + 1);
+			argtypes[i] = SPI_gettypeid(SPI_tuptable->tupdesc, i + 1);
+			values[i] = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+									  i + 1, &isnull);
+		}
+		appendStringInfoChar(&buf, ')');
+
+		ret = SPI_execute_with_args(buf.data, nexprs, argtypes, values, NULL, false, 0);
+		if (ret < 0)
+			elog(ERROR, "SPI_execute failed: %d", ret);
+		deleted = SPI_processed;
+	}
+
+	SPI_finish();
+
+	pfree(buf.data);
+	return deleted;
+}
+
 /* Evict Least Recently Used entries */
 Datum
 evict_lru(PG_FUNCTION_ARGS)
 {
+	/* NULLs sort first in descending order, so they count as newest */
+	static const char *const lru_order[] = {
+		"COALESCE(last_accessed_at, 'infinity')", "id"
+	};
 	int32 keep_count;
-	StringInfoData buf;
+	int32 cluster_id = -1;
 	int64 deleted = 0;
 
 	if (PG_ARGISNULL(0))
@@ -459,22 +4582,16 @@ evict_lru(PG_FUNCTION_ARGS)
 	if (keep_count > 10000000)  /* 10 million max for safety */
 		elog(ERROR, "evict_lru: keep_count exceeds maximum (10,000,000)");
 
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-		"DELETE FROM semantic_cache.cache_entries "
-		"WHERE id NOT IN ("
-		"  SELECT id FROM semantic_cache.cache_entries "
-		"  ORDER BY last_accessed_at DESC "
-		"  LIMIT %d"
-		")",
-		keep_count);
+	/* The two-argument form keeps keep_count entries in one partition */
+	if (PG_NARGS() > 1 && !PG_ARGISNULL(1))
+	{
+		cluster_id = PG_GETARG_INT32(1);
+		if (cluster_id < 0)
+			elog(ERROR, "evict_lru: cluster_id must be non-negative");
+	}
 
-	SPI_connect();
-	execute_sql(buf.data);
-	deleted = SPI_processed;
-	SPI_finish();
+	deleted = evict_beyond(lru_order, lengthof(lru_order), keep_count, cluster_id);
 
-	pfree(buf.data);
 	PG_RETURN_INT64(deleted);
 }
 
@@ -482,8 +4599,11 @@ evict_lru(PG_FUNCTION_ARGS)
 Datum
 evict_lfu(PG_FUNCTION_ARGS)
 {
+	static const char *const lfu_order[] = {
+		"COALESCE(access_count, 2147483647)", "COALESCE(last_accessed_at, 'infinity')", "id"
+	};
 	int32 keep_count;
-	StringInfoData buf;
+	int32 cluster_id = -1;
 	int64 deleted = 0;
 
 	if (PG_ARGISNULL(0))
@@ -497,22 +4617,16 @@ evict_lfu(PG_FUNCTION_ARGS)
 	if (keep_count > 10000000)  /* 10 million max for safety */
 		elog(ERROR, "evict_lfu: keep_count exceeds maximum (10,000,000)");
 
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-		"DELETE FROM semantic_cache.cache_entries "
-		"WHERE id NOT IN ("
-		"  SELECT id FROM semantic_cache.cache_entries "
-		"  ORDER BY access_count DESC, last_accessed_at DESC "
-		"  LIMIT %d"
-		")",
-		keep_count);
+	/* The two-argument form keeps keep_count entries in one partition */
+	if (PG_NARGS() > 1 && !PG_ARGISNULL(1))
+	{
+		cluster_id = PG_GETARG_INT32(1);
+		if (cluster_id < 0)
+			elog(ERROR, "evict_lfu: cluster_id must be non-negative");
+	}
 
-	SPI_connect();
-	execute_sql(buf.data);
-	deleted = SPI_processed;
-	SPI_finish();
+	deleted = evict_beyond(lfu_order, lengthof(lfu_order), keep_count, cluster_id);
 
-	pfree(buf.data);
 	PG_RETURN_INT64(deleted);
 }
 
@@ -595,6 +4709,32 @@ log_cache_access(PG_FUNCTION_ARGS)
 	}
 
 	SPI_finish();
+
+	/*
+	 * Feed the top-queries sketches (see rebuild_top_queries()) and the
+	 * distinct-query sketches (see flush_access_sketches()) at commit
+	 */
+	if ((cache_hit && query_hash && top_queries_sketch != NULL) || access_sketches != NULL)
+	{
+		if (my_nlogged >= my_maxlogged)
+		{
+			int newmax = Max(16, my_maxlogged * 2);
+
+			if (my_logged == NULL)
+				my_logged = MemoryContextAlloc(TopMemoryContext, sizeof(LoggedAccess) * newmax);
+			else
+				my_logged = repalloc(my_logged, sizeof(LoggedAccess) * newmax);
+			my_maxlogged = newmax;
+		}
+		my_logged[my_nlogged].query_hash =
+			query_hash ? MemoryContextStrdup(TopTransactionContext, query_hash) : NULL;
+		my_logged[my_nlogged].cache_hit = cache_hit;
+		my_logged[my_nlogged].similarity = similarity;
+		my_logged[my_nlogged].cost_saved = cost_saved;
+		my_logged[my_nlogged].subid = GetCurrentSubTransactionId();
+		my_nlogged++;
+	}
+
 	pfree(buf.data);
 	if (query_hash)
 		pfree(query_hash);
@@ -829,9 +4969,11 @@ rebuild_index(PG_FUNCTION_ARGS)
 {
 	int32 dimension = 1536;
 	char *index_type = "ivfflat";
+	char *metric;
 	int ret;
 	bool isnull;
 	int64 entry_count = 0;
+	int lists = 100;
 	StringInfoData buf;
 
 	SPI_connect();
@@ -873,54 +5015,132 @@ rebuild_index(PG_FUNCTION_ARGS)
 		}
 	}
 
-	/* Drop existing index */
+	metric = get_config_text("distance_metric", "cosine");
+
+	/*
+	 * The partitioned layout's centroids only fit the dimension they were
+	 * trained at.  The index is built per partition, so size it per partition.
+	 */
+	ret = SPI_execute(
+		"SELECT COUNT(*), MIN(vector_dims(centroid)) FROM semantic_cache.cache_centroids",
+		true, 0);
+	if (ret == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		int64 nclusters = DatumGetInt64(
+			SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+		if (nclusters > 0)
+		{
+			int32 centroid_dim = DatumGetInt32(
+				SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+
+			if (centroid_dim != dimension)
+				elog(ERROR, "rebuild_index: centroids have dimension %d; "
+					 "call disable_partitioned_layout() before changing vector_dimension",
+					 centroid_dim);
+			entry_count /= nclusters;
+		}
+	}
+
+	/* Likewise the PQ codebook */
+	ret = SPI_execute(
+		"SELECT MAX(dim_start + dim_count) FROM semantic_cache.cache_pq_codebook",
+		true, 0);
+	if (ret == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		Datum val = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+		if (!isnull && DatumGetInt32(val) != dimension)
+			elog(ERROR, "rebuild_index: the PQ codebook has dimension %d; "
+				 "call disable_pq_lookup() before changing vector_dimension",
+				 DatumGetInt32(val));
+	}
+
+	/* Drop existing indexes */
 	execute_sql("DROP INDEX IF EXISTS semantic_cache.idx_cache_embedding");
+	execute_sql("DROP INDEX IF EXISTS semantic_cache.idx_alias_embedding");
 
 	/* Clear all entries and alter column to new dimension */
-	execute_sql("TRUNCATE semantic_cache.cache_entries");
+	execute_sql("TRUNCATE semantic_cache.cache_entries, semantic_cache.cache_entry_aliases");
 
 	initStringInfo(&buf);
 	appendStringInfo(&buf,
 		"ALTER TABLE semantic_cache.cache_entries "
-		"  ALTER COLUMN query_embedding TYPE vector(%d)",
-		dimension);
+		"  ALTER COLUMN query_embedding TYPE vector(%d);"
+		"ALTER TABLE semantic_cache.cache_entry_aliases "
+		"  ALTER COLUMN query_embedding TYPE vector(%d);",
+		dimension, dimension);
 
 	execute_sql(buf.data);
 	pfree(buf.data);
 
-	/* Create index with configured type */
-	initStringInfo(&buf);
+	/* Calculate optimal lists based on expected cache size */
+	if (entry_count > 100000)
+		lists = 1000;
+	else if (entry_count > 10000)
+		lists = 200;
+	else if (entry_count < 1000)
+		lists = 10;
 
-	if (strcmp(index_type, "hnsw") == 0)
-	{
-		appendStringInfo(&buf,
-			"CREATE INDEX idx_cache_embedding "
-			"  ON semantic_cache.cache_entries "
-			"  USING hnsw (query_embedding vector_cosine_ops)");
-	}
-	else
-	{
-		/* Calculate optimal lists based on expected cache size */
-		int lists = 100;
-		if (entry_count > 100000)
-			lists = 1000;
-		else if (entry_count > 10000)
-			lists = 200;
-		else if (entry_count < 1000)
-			lists = 10;
+	/* Create indexes with configured type */
+	create_embedding_index("idx_cache_embedding", "cache_entries", index_type, metric, dimension, lists);
+	create_embedding_index("idx_alias_embedding", "cache_entry_aliases", index_type, metric, dimension, lists);
 
-		appendStringInfo(&buf,
-			"CREATE INDEX idx_cache_embedding "
-			"  ON semantic_cache.cache_entries "
-			"  USING ivfflat (query_embedding vector_cosine_ops) WITH (lists = %d)",
-			lists);
-	}
+	SPI_finish();
+
+	elog(NOTICE, "Index rebuilt successfully with dimension=%d, type=%s", dimension, index_type);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Set the distance metric embeddings are compared with.  Stored embeddings
+ * (normalized only for cosine) and idx_cache_embedding's operator class both
+ * depend on it, so the index is rebuilt and the cache cleared right away.
+ */
+Datum
+set_distance_metric(PG_FUNCTION_ARGS)
+{
+	char *metric = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	StringInfoData buf;
+
+	if (strcmp(metric, "cosine") != 0 && strcmp(metric, "inner_product") != 0 &&
+		strcmp(metric, "l2") != 0 && strcmp(metric, "hamming") != 0)
+		elog(ERROR, "set_distance_metric: metric must be 'cosine', 'inner_product', 'l2' or 'hamming'");
+
+	SPI_connect();
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"INSERT INTO semantic_cache.cache_config (key, value) "
+		"VALUES ('distance_metric', '%s') "
+		"ON CONFLICT (key) DO UPDATE SET value = '%s'",
+		metric, metric);
 
 	execute_sql(buf.data);
 	pfree(buf.data);
 
+	execute_sql("SELECT semantic_cache.rebuild_index()");
+
 	SPI_finish();
 
-	elog(NOTICE, "Index rebuilt successfully with dimension=%d, type=%s", dimension, index_type);
 	PG_RETURN_VOID();
 }
+
+/* Get configured distance metric */
+Datum
+get_distance_metric(PG_FUNCTION_ARGS)
+{
+	char *metric;
+	text *result;
+
+	SPI_connect();
+	metric = get_config_text("distance_metric", "cosine");
+
+	/* Copy out of the SPI context before it is released */
+	result = (text *) SPI_palloc(VARHDRSZ + strlen(metric));
+	SET_VARSIZE(result, VARHDRSZ + strlen(metric));
+	memcpy(VARDATA(result), metric, strlen(metric));
+
+	SPI_finish();
+	PG_RETURN_TEXT_P(result);
+}
@@ -0,0 +1,3363 @@
+-- pg_semantic_cache--0.1.0-beta5.sql
+-- This is a direct installation of version 0.1.0-beta5
+-- (includes all features from 0.1.0-beta4; see CHANGELOG.md for the additions)
+
+-- Tables are still created by init_schema(); this file only declares the
+-- functions and views that sit on top of them
+
+\echo Use "CREATE EXTENSION pg_semantic_cache" to load this file. \quit
+
+-- Require pgvector extension
+CREATE EXTENSION IF NOT EXISTS vector;
+
+-- ============================================================================
+-- FUNCTION DECLARATIONS
+-- Note: Schema prefix not needed - functions auto-placed in semantic_cache
+-- Note: Read-only functions are PARALLEL SAFE; those tied to session advisory
+--       locks or backend-local state are RESTRICTED; anything that writes is UNSAFE
+-- ============================================================================
+
+CREATE FUNCTION init_schema()
+RETURNS void
+AS 'MODULE_PATHNAME', 'init_schema'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION cache_query(
+    query_text text,
+    query_embedding text,
+    result_data jsonb,
+    ttl_seconds integer DEFAULT 3600,
+    tags text[] DEFAULT NULL
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'cache_query'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Records that a query has no usable answer; ttl_seconds defaults to the
+-- negative_ttl_seconds setting (300)
+CREATE FUNCTION cache_negative(
+    query_text text,
+    query_embedding text,
+    ttl_seconds integer DEFAULT NULL,
+    tags text[] DEFAULT NULL
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'cache_negative'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- With the default cosine distance_metric embeddings are stored at unit length, so
+-- lookups compare them by inner product (vector_ip_ops, <#>), which equals cosine
+-- similarity without computing norms
+CREATE FUNCTION unit_vector(embedding vector)
+RETURNS vector
+AS 'MODULE_PATHNAME', 'unit_vector'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Internal: distance under a distance_metric between an embedding column
+-- (by default that of the cache entry aliased ce) and the query embedding $1,
+-- spelled exactly as the vector indexes index it so that ordering by it is
+-- answered by the index
+CREATE FUNCTION metric_distance_sql(metric text, dimension integer,
+                                    embedding_column text DEFAULT 'ce.query_embedding')
+RETURNS text
+LANGUAGE sql IMMUTABLE PARALLEL SAFE
+AS $$
+    SELECT CASE metric
+        WHEN 'l2' THEN embedding_column || ' <-> $1'
+        WHEN 'hamming' THEN format('binary_quantize(%s)::bit(%s) <~> binary_quantize($1)::bit(%s)',
+                                   embedding_column, dimension, dimension)
+        ELSE embedding_column || ' <#> $1'
+    END
+$$;
+
+-- Internal: similarity reported for a distance, compared with the thresholds.
+-- cosine and inner_product: the inner product (<#> is its negation); l2:
+-- 1 / (1 + distance); hamming: the share of matching bits
+CREATE FUNCTION metric_similarity(distance float8, metric text, dimension integer)
+RETURNS float8
+LANGUAGE sql IMMUTABLE PARALLEL SAFE
+AS $$
+    SELECT CASE metric
+        WHEN 'l2' THEN 1 / (1 + distance)
+        WHEN 'hamming' THEN 1 - distance / dimension
+        ELSE -distance
+    END
+$$;
+
+-- Internal: largest distance whose similarity reaches the threshold
+CREATE FUNCTION metric_max_distance(threshold float8, metric text, dimension integer)
+RETURNS float8
+LANGUAGE sql IMMUTABLE PARALLEL SAFE
+AS $$
+    SELECT CASE metric
+        WHEN 'l2' THEN CASE WHEN threshold > 0 THEN 1 / threshold - 1 ELSE 'Infinity'::float8 END
+        WHEN 'hamming' THEN (1 - threshold) * dimension
+        ELSE -threshold
+    END
+$$;
+
+-- Internal: similarity of two embeddings under a metric, for comparisons the
+-- vector index does not answer.  PL/pgSQL so that binary_quantize() is only
+-- resolved when hamming is used (pgvector 0.7+)
+CREATE FUNCTION embedding_similarity(a vector, b vector, metric text)
+RETURNS float8
+LANGUAGE plpgsql IMMUTABLE PARALLEL SAFE
+AS $$
+BEGIN
+    IF metric = 'l2' THEN
+        RETURN semantic_cache.metric_similarity(a <-> b, metric, vector_dims(a));
+    ELSIF metric = 'hamming' THEN
+        RETURN semantic_cache.metric_similarity(binary_quantize(a) <~> binary_quantize(b),
+                                                metric, vector_dims(a));
+    END IF;
+    RETURN semantic_cache.metric_similarity(a <#> b, metric, vector_dims(a));
+END;
+$$;
+
+-- Note: Implemented in SQL for better memory management and performance with automatic stats tracking
+--       When stale_grace_seconds is set in cache_config, expired entries keep being served for that
+--       long with stale = true, and one session at a time is granted refresh_lease = true
+--       When coalesce_timeout_ms is set, a miss first waits for a concurrent miss on a near-identical
+--       query to be cached (requires shared_preload_libraries)
+--       A match on a negative entry (see cache_negative()) returns found = true, negative = true
+--       and no result_data, and is counted in total_negative_hits instead of total_hits
+--       On a hot standby, in a read-only transaction or with lookup_mode = 'read_only' nothing is
+--       written: stats go to shared memory (see readonly_lookup_stats()) and no lease is granted
+--       With the partitioned layout only the partitions of the partition_probes nearest centroids
+--       are searched (see enable_partitioned_layout())
+--       Entries invalidated by invalidate_cache_lazy() are skipped
+--       With PQ lookups enabled (see enable_pq_lookup()) the pq_rerank live entries whose codes
+--       score best in the probed partitions are compared exactly, instead of using the vector index
+--       Embeddings are compared under distance_metric (see set_distance_metric()); with
+--       cosine the query embedding is normalized with unit_vector() like the stored ones
+--       When no entry matches, paraphrase embeddings added by attach_embedding() are searched
+CREATE FUNCTION get_cached_result(
+    query_embedding text,
+    similarity_threshold float4 DEFAULT 0.95,
+    max_age_seconds integer DEFAULT NULL
+)
+RETURNS TABLE(
+    found boolean,
+    result_data jsonb,
+    similarity_score float4,
+    age_seconds integer,
+    cache_id bigint,
+    stale boolean,
+    refresh_lease boolean,
+    negative boolean
+)
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    result_record RECORD;
+    closest_match RECORD;
+    query_vec vector := query_embedding::vector;
+    metric text;
+    grace_seconds integer;
+    coalesce_ms integer;
+    coalesced_id bigint;
+    lease boolean := false;
+    read_only boolean;
+    record_access boolean;
+    probes integer;
+    probe_clusters integer[];
+    probe_filter text;
+    live_generation bigint;
+    cutoff_tags text[];
+    cutoff_generations bigint[];
+    rerank integer;
+    candidate_ids bigint[];
+    -- Best match ordered by distance %1$s, from %2$s, with partition filter %3$s
+    match_sql text :=
+        'SELECT '
+        '    true::boolean as found, '
+        '    ce.id, '
+        '    ce.result_data, '
+        '    semantic_cache.metric_similarity(%1$s, $2, $3)::float4 as similarity_score, '
+        '    EXTRACT(EPOCH FROM (NOW() - ce.created_at))::integer as age_seconds, '
+        '    (ce.expires_at IS NOT NULL AND ce.expires_at <= NOW()) as is_stale, '
+        '    ce.is_negative '
+        'FROM %2$s '
+        'WHERE (ce.expires_at IS NULL '
+        '       OR ce.expires_at > NOW() - make_interval(secs => CASE WHEN ce.is_negative THEN 0 ELSE $4 END)) '
+        '  %3$s '
+        '  AND ce.generation >= $6 '
+        '  AND ($7::text[] IS NULL OR NOT EXISTS ( '
+        '          SELECT 1 FROM unnest($7::text[], $8::bigint[]) cut(tag, generation) '
+        '          WHERE cut.tag = ANY(ce.tags) AND ce.generation < cut.generation)) '
+        '  AND %1$s <= $9 '
+        '  AND ($10::integer IS NULL OR EXTRACT(EPOCH FROM (NOW() - ce.created_at)) <= $10) '
+        'ORDER BY %1$s '
+        'LIMIT 1';
+BEGIN
+    -- Stale-while-revalidate window, miss coalescing timeout (0 = off), lookup mode,
+    -- number of partitions searched, oldest generation not invalidated, PQ candidates
+    -- and distance metric
+    SELECT
+        COALESCE(MAX(CASE WHEN key = 'stale_grace_seconds' THEN GREATEST(value::integer, 0) END), 0),
+        COALESCE(MAX(CASE WHEN key = 'coalesce_timeout_ms' THEN GREATEST(value::integer, 0) END), 0),
+        COALESCE(MAX(CASE WHEN key = 'lookup_mode' THEN value END), 'auto') = 'read_only',
+        COALESCE(bool_or(CASE WHEN key = 'record_replica_access' THEN value::boolean END), false),
+        COALESCE(MAX(CASE WHEN key = 'partition_probes' THEN GREATEST(value::integer, 1) END), 2),
+        COALESCE(MAX(CASE WHEN key = 'invalidated_generation' THEN value::bigint END), 0),
+        COALESCE(MAX(CASE WHEN key = 'pq_rerank' THEN GREATEST(value::integer, 1) END), 100),
+        COALESCE(MAX(CASE WHEN key = 'distance_metric' THEN value END), 'cosine')
+    INTO grace_seconds, coalesce_ms, read_only, record_access, probes, live_generation, rerank, metric
+    FROM semantic_cache.cache_config
+    WHERE key IN ('stale_grace_seconds', 'coalesce_timeout_ms', 'lookup_mode', 'record_replica_access',
+                  'partition_probes', 'invalidated_generation', 'pq_rerank', 'distance_metric');
+
+    IF metric = 'cosine' THEN
+        query_vec := semantic_cache.unit_vector(query_vec);
+    END IF;
+
+    -- Per-tag cutoffs of invalidate_cache_lazy(); kept few by collect_invalidated()
+    SELECT array_agg(c.tag), array_agg(c.generation)
+    INTO cutoff_tags, cutoff_generations
+    FROM semantic_cache.cache_invalidation_cutoffs c;
+
+    -- Standbys and read-only transactions cannot write the stats or take part in refreshes
+    read_only := read_only OR pg_is_in_recovery() OR current_setting('transaction_read_only')::boolean;
+
+    -- Partitions to search; the monolithic layout keeps every entry in cluster 0.
+    -- Written into the queries as constants so the planner prunes the others
+    probe_clusters := COALESCE(semantic_cache.nearest_clusters(query_vec, probes), ARRAY[0]);
+    probe_filter := format('AND ce.cluster_id IN (%s)', array_to_string(probe_clusters, ', '));
+
+    -- NULL unless PQ lookups are enabled.  Expired and invalidated entries are
+    -- left out before the codes are ranked
+    candidate_ids := semantic_cache.pq_candidates(query_embedding, rerank, probe_clusters,
+                                                  grace_seconds, live_generation);
+
+    -- Re-rank the PQ candidates exactly.  Ordering by similarity rather than
+    -- distance keeps the planner from answering this from the vector index
+    IF candidate_ids IS NOT NULL THEN
+        SELECT
+            true::boolean as found,
+            ce.id,
+            ce.result_data,
+            semantic_cache.embedding_similarity(ce.query_embedding, query_vec, metric)::float4 as similarity_score,
+            EXTRACT(EPOCH FROM (NOW() - ce.created_at))::integer as age_seconds,
+            (ce.expires_at IS NOT NULL AND ce.expires_at <= NOW()) as is_stale,
+            ce.is_negative
+        INTO result_record
+        FROM semantic_cache.cache_entries ce
+        WHERE ce.id = ANY(candidate_ids)
+          AND (ce.expires_at IS NULL
+               OR ce.expires_at > NOW() - make_interval(secs => CASE WHEN ce.is_negative THEN 0 ELSE grace_seconds END))
+          AND ce.generation >= live_generation
+          AND (cutoff_tags IS NULL OR NOT EXISTS (
+                  SELECT 1 FROM unnest(cutoff_tags, cutoff_generations) cut(tag, generation)
+                  WHERE cut.tag = ANY(ce.tags) AND ce.generation < cut.generation))
+          AND semantic_cache.embedding_similarity(ce.query_embedding, query_vec, metric) >= similarity_threshold
+          AND (max_age_seconds IS NULL OR EXTRACT(EPOCH FROM (NOW() - ce.created_at)) <= max_age_seconds)
+        ORDER BY semantic_cache.embedding_similarity(ce.query_embedding, query_vec, metric) DESC
+        LIMIT 1;
+    ELSE
+        -- Try to find a cached result that meets the threshold.  The operator
+        -- depends on distance_metric, so the query is built to match the index
+        EXECUTE format(match_sql, semantic_cache.metric_distance_sql(metric, vector_dims(query_vec)),
+                       'semantic_cache.cache_entries ce', probe_filter)
+        INTO result_record
+        USING query_vec, metric, vector_dims(query_vec), grace_seconds, probe_clusters, live_generation,
+              cutoff_tags, cutoff_generations,
+              semantic_cache.metric_max_distance(similarity_threshold, metric, vector_dims(query_vec)),
+              max_age_seconds;
+    END IF;
+
+    -- Paraphrase embeddings added by attach_embedding() share their entry's
+    -- payload and expiry; their index is only searched when the entries missed
+    IF result_record.found IS NULL THEN
+        EXECUTE format(match_sql,
+                       semantic_cache.metric_distance_sql(metric, vector_dims(query_vec), 'a.query_embedding'),
+                       'semantic_cache.cache_entry_aliases a JOIN semantic_cache.cache_entries ce ON ce.id = a.cache_id',
+                       '')
+        INTO result_record
+        USING query_vec, metric, vector_dims(query_vec), grace_seconds, probe_clusters, live_generation,
+              cutoff_tags, cutoff_generations,
+              semantic_cache.metric_max_distance(similarity_threshold, metric, vector_dims(query_vec)),
+              max_age_seconds;
+    END IF;
+
+    -- On a miss, piggy-back on a concurrent miss for a near-identical query:
+    -- either wait for its cache_query() or register as the one computing it
+    IF result_record.found IS NULL AND coalesce_ms > 0 AND NOT read_only THEN
+        coalesced_id := semantic_cache.coalesce_inflight(query_embedding, similarity_threshold, coalesce_ms);
+
+        IF coalesced_id IS NOT NULL THEN
+            SELECT
+                true::boolean as found,
+                ce.id,
+                ce.result_data,
+                semantic_cache.embedding_similarity(ce.query_embedding, query_vec, metric)::float4 as similarity_score,
+                EXTRACT(EPOCH FROM (NOW() - ce.created_at))::integer as age_seconds,
+                false as is_stale,
+                ce.is_negative
+            INTO result_record
+            FROM semantic_cache.cache_entries ce
+            WHERE ce.id = coalesced_id
+              AND (ce.expires_at IS NULL OR ce.expires_at > NOW())
+              -- The leader's entry still has to clear this caller's threshold
+              -- under the configured metric; otherwise it is a plain miss
+              AND semantic_cache.embedding_similarity(ce.query_embedding, query_vec, metric) >= similarity_threshold;
+        END IF;
+    END IF;
+
+    -- A negative entry means the query is known to have no usable answer
+    IF result_record.found IS NOT NULL AND result_record.is_negative THEN
+        IF read_only THEN
+            PERFORM semantic_cache.note_readonly_lookup(true, true,
+                                                        CASE WHEN record_access THEN result_record.id END);
+        ELSE
+            UPDATE semantic_cache.cache_metadata
+            SET total_negative_hits = total_negative_hits + 1
+            WHERE id = 1;
+        END IF;
+
+        RETURN QUERY SELECT true, NULL::jsonb,
+                           result_record.similarity_score, result_record.age_seconds,
+                           result_record.id, false, false, true;
+    -- Check if we found a result
+    ELSIF result_record.found IS NOT NULL THEN
+        -- Update cache stats for HIT
+        IF read_only THEN
+            PERFORM semantic_cache.note_readonly_lookup(true, false,
+                                                        CASE WHEN record_access THEN result_record.id END);
+        ELSE
+            UPDATE semantic_cache.cache_metadata
+            SET total_hits = total_hits + 1
+            WHERE id = 1;
+        END IF;
+
+        -- Every caller gets the stale copy; only the session holding the
+        -- lease should refresh it (released once its cache_query commits)
+        IF result_record.is_stale AND NOT read_only THEN
+            lease := semantic_cache.take_refresh_lease(result_record.id);
+        END IF;
+
+        -- Return the cached result
+        RETURN QUERY SELECT result_record.found, result_record.result_data,
+                           result_record.similarity_score, result_record.age_seconds,
+                           result_record.id, result_record.is_stale, lease, false;
+    ELSE
+        -- Update cache stats for MISS
+        IF read_only THEN
+            PERFORM semantic_cache.note_readonly_lookup(false, false, NULL);
+        ELSE
+            UPDATE semantic_cache.cache_metadata
+            SET total_misses = total_misses + 1
+            WHERE id = 1;
+        END IF;
+
+        -- Find the closest match (even if below threshold) to show similarity.
+        -- An aggregate is never answered from the approximate vector index, so
+        -- this is an exact scan that the planner can run with parallel workers
+        EXECUTE format(
+            'SELECT MAX(semantic_cache.metric_similarity(%s, $2, %s))::float4 as similarity_score '
+            'FROM semantic_cache.cache_entries ce '
+            'WHERE (ce.expires_at IS NULL OR ce.expires_at > NOW()) '
+            '  %s '
+            '  AND ce.generation >= $3 '
+            '  AND ($4::text[] IS NULL OR NOT EXISTS ( '
+            '          SELECT 1 FROM unnest($4::text[], $5::bigint[]) cut(tag, generation) '
+            '          WHERE cut.tag = ANY(ce.tags) AND ce.generation < cut.generation)) '
+            '  AND ($6::integer IS NULL OR EXTRACT(EPOCH FROM (NOW() - ce.created_at)) <= $6)',
+            semantic_cache.metric_distance_sql(metric, vector_dims(query_vec)), vector_dims(query_vec),
+            CASE WHEN candidate_ids IS NULL THEN probe_filter ELSE 'AND ce.id = ANY($7)' END)
+        INTO closest_match
+        USING query_vec, metric, live_generation, cutoff_tags, cutoff_generations,
+              max_age_seconds, candidate_ids;
+
+        -- Return miss result with closest match similarity (or 0.0 if no entries)
+        RETURN QUERY SELECT
+            false::boolean as found,
+            NULL::jsonb as result_data,
+            COALESCE(closest_match.similarity_score, 0.0)::float4 as similarity_score,
+            NULL::integer as age_seconds,
+            NULL::bigint as cache_id,
+            false::boolean as stale,
+            false::boolean as refresh_lease,
+            false::boolean as negative;
+    END IF;
+END;
+$$;
+
+-- Used by get_cached_result() when it serves a stale entry; true if this session
+-- now holds (or already held) the entry's stale-while-revalidate lease
+CREATE FUNCTION take_refresh_lease(cache_id bigint)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'take_refresh_lease'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- Releases the stale-while-revalidate lease this session holds on an entry.
+-- Leases are released when a transaction that stores an entry commits, or when
+-- any transaction aborts; call this directly if the refresh is abandoned so
+-- another session can pick the lease up.
+CREATE FUNCTION release_refresh_lease(cache_id bigint)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'release_refresh_lease'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- Used by get_cached_result() on a miss; returns the id of a concurrent miss's entry
+-- once it is cached, or NULL after registering this session as the one computing it
+CREATE FUNCTION coalesce_inflight(
+    query_embedding text,
+    similarity_threshold float4 DEFAULT 0.95,
+    timeout_ms integer DEFAULT 1000
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'coalesce_inflight'
+LANGUAGE C PARALLEL RESTRICTED;
+
+-- Used by get_cached_result() in read-only mode; counts the lookup in shared memory
+-- and, when cache_id is given, queues it for drain_pending_accesses()
+CREATE FUNCTION note_readonly_lookup(
+    hit boolean,
+    negative boolean DEFAULT false,
+    cache_id bigint DEFAULT NULL
+)
+RETURNS void
+AS 'MODULE_PATHNAME', 'note_readonly_lookup'
+LANGUAGE C PARALLEL SAFE;
+
+-- Note: Implemented in PL/pgSQL; the k nearest live entries come from a single
+--       ordered index scan and result_data is only fetched when include_payload is set
+--       Negative entries have no payload and are never returned as candidates
+--       With the partitioned layout only the partition_probes nearest partitions are searched
+--       Entries invalidated by invalidate_cache_lazy() are skipped
+CREATE FUNCTION get_cached_candidates(
+    query_embedding text,
+    k integer DEFAULT 5,
+    min_similarity float4 DEFAULT 0.0,
+    include_payload boolean DEFAULT false
+)
+RETURNS TABLE(
+    id bigint,
+    similarity_score float4,
+    age_seconds integer,
+    result_size_bytes integer,
+    result_data jsonb
+)
+LANGUAGE plpgsql STABLE PARALLEL SAFE
+AS $$
+DECLARE
+    query_vec vector := query_embedding::vector;
+    metric text;
+    probe_clusters integer[];
+    live_generation bigint;
+    cutoff_tags text[];
+    cutoff_generations bigint[];
+BEGIN
+    IF k IS NULL OR k < 1 OR k > 1000 THEN
+        RAISE EXCEPTION 'get_cached_candidates: k must be between 1 and 1000';
+    END IF;
+
+    SELECT COALESCE(semantic_cache.nearest_clusters(query_vec,
+                        COALESCE(MAX(CASE WHEN key = 'partition_probes' THEN GREATEST(value::integer, 1) END), 2)),
+                    ARRAY[0]),
+           COALESCE(MAX(CASE WHEN key = 'invalidated_generation' THEN value::bigint END), 0),
+           COALESCE(MAX(CASE WHEN key = 'distance_metric' THEN value END), 'cosine')
+    INTO probe_clusters, live_generation, metric
+    FROM semantic_cache.cache_config
+    WHERE key IN ('partition_probes', 'invalidated_generation', 'distance_metric');
+
+    IF metric = 'cosine' THEN
+        query_vec := semantic_cache.unit_vector(query_vec);
+    END IF;
+
+    SELECT array_agg(c.tag), array_agg(c.generation)
+    INTO cutoff_tags, cutoff_generations
+    FROM semantic_cache.cache_invalidation_cutoffs c;
+
+    -- The inner query only touches the narrow columns so the index scan never
+    -- detoasts result_data; payloads are looked up by id for the survivors.  It is
+    -- built for distance_metric so the vector index orders it
+    RETURN QUERY EXECUTE format(
+        'SELECT '
+        '    c.id, '
+        '    c.similarity_score, '
+        '    c.age_seconds, '
+        '    c.result_size_bytes, '
+        '    CASE WHEN $8 THEN '
+        '        (SELECT p.result_data FROM semantic_cache.cache_entries p WHERE p.id = c.id) '
+        '    END '
+        'FROM ( '
+        '    SELECT '
+        '        ce.id, '
+        '        semantic_cache.metric_similarity(%1$s, $2, $3)::float4 as similarity_score, '
+        '        EXTRACT(EPOCH FROM (NOW() - ce.created_at))::integer as age_seconds, '
+        '        ce.result_size_bytes '
+        '    FROM semantic_cache.cache_entries ce '
+        '    WHERE (ce.expires_at IS NULL OR ce.expires_at > NOW()) '
+        '      AND NOT ce.is_negative '
+        '      %2$s '
+        '      AND ce.generation >= $5 '
+        '      AND ($6::text[] IS NULL OR NOT EXISTS ( '
+        '              SELECT 1 FROM unnest($6::text[], $7::bigint[]) cut(tag, generation) '
+        '              WHERE cut.tag = ANY(ce.tags) AND ce.generation < cut.generation)) '
+        '    ORDER BY %1$s '
+        '    LIMIT $9 '
+        ') c '
+        'WHERE c.similarity_score >= $10 '
+        'ORDER BY c.similarity_score DESC',
+        semantic_cache.metric_distance_sql(metric, vector_dims(query_vec)),
+        format('AND ce.cluster_id IN (%s)', array_to_string(probe_clusters, ', ')))
+    USING query_vec, metric, vector_dims(query_vec), probe_clusters, live_generation,
+          cutoff_tags, cutoff_generations, include_payload, k, min_similarity;
+END;
+$$;
+
+CREATE FUNCTION invalidate_cache(
+    pattern text DEFAULT NULL,
+    tag text DEFAULT NULL
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'invalidate_cache'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Same as invalidate_cache(pattern, tag) for several patterns and tags at once;
+-- entries matching any of them are deleted in one statement
+CREATE FUNCTION invalidate_cache(
+    patterns text[],
+    tags text[] DEFAULT NULL
+)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'invalidate_cache_multi'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Note: Implemented in PL/pgSQL; walks the vector index outward from the embedding,
+--       deleting up to batch_size entries per step until the nearest remaining entry
+--       falls below the threshold.  Like lookups, it finds what the index finds
+--       (ivfflat.probes / hnsw.ef_search).  All partitions are searched.
+--       The threshold is a similarity under distance_metric, as for lookups.
+--       Entries with a paraphrase embedding (see attach_embedding()) within the
+--       threshold are deleted too
+CREATE FUNCTION invalidate_cache_similar(
+    query_embedding text,
+    threshold float4,
+    batch_size integer DEFAULT 1000
+)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    query_vec vector := query_embedding::vector;
+    metric text;
+    max_distance float8;
+    distance_sql text;
+    batch_ids bigint[];
+    reached_edge boolean;
+    deleted bigint := 0;
+    n bigint;
+BEGIN
+    SELECT COALESCE(MAX(value), 'cosine') INTO metric
+    FROM semantic_cache.cache_config
+    WHERE key = 'distance_metric';
+
+    -- Inner products are not bounded by 1
+    IF threshold IS NULL OR threshold <= 0 OR (threshold > 1 AND metric <> 'inner_product') THEN
+        RAISE EXCEPTION 'invalidate_cache_similar: threshold must be greater than 0 and at most 1';
+    END IF;
+
+    IF metric = 'cosine' THEN
+        query_vec := semantic_cache.unit_vector(query_vec);
+    END IF;
+    max_distance := semantic_cache.metric_max_distance(threshold, metric, vector_dims(query_vec));
+
+    IF batch_size IS NULL OR batch_size < 1 THEN
+        RAISE EXCEPTION 'invalidate_cache_similar: batch_size must be at least 1';
+    END IF;
+
+    -- These deletes are invalidations, which cache sync replicates
+    PERFORM set_config('semantic_cache.sync_invalidation', 'on', true);
+
+    -- The second walk covers the paraphrase embeddings added by attach_embedding(),
+    -- which go with their entry
+    FOR pass IN 1 .. 2 LOOP
+        IF pass = 1 THEN
+            distance_sql := format('SELECT ce.id, %1$s AS distance '
+                                   'FROM semantic_cache.cache_entries ce ORDER BY %1$s LIMIT $3',
+                                   semantic_cache.metric_distance_sql(metric, vector_dims(query_vec)));
+        ELSE
+            distance_sql := format('SELECT a.cache_id, %1$s AS distance '
+                                   'FROM semantic_cache.cache_entry_aliases a ORDER BY %1$s LIMIT $3',
+                                   semantic_cache.metric_distance_sql(metric, vector_dims(query_vec),
+                                                                      'a.query_embedding'));
+        END IF;
+
+        LOOP
+            -- Entries already deleted drop out, so each step continues further out.
+            -- An HNSW scan may return fewer rows than asked for, so only a row past
+            -- the threshold (or none at all) ends the walk.
+            EXECUTE 'SELECT array_agg(c.id) FILTER (WHERE c.distance <= $2), '
+                    '       bool_or(c.distance > $2) '
+                    'FROM (' || distance_sql || ') c(id, distance)'
+            INTO batch_ids, reached_edge
+            USING query_vec, max_distance, batch_size;
+
+            EXIT WHEN batch_ids IS NULL;
+
+            DELETE FROM semantic_cache.cache_entries
+            WHERE id = ANY(batch_ids);
+            GET DIAGNOSTICS n = ROW_COUNT;
+            deleted := deleted + n;
+
+            -- A paraphrase whose entry is already gone would be found again
+            EXIT WHEN reached_edge OR (pass = 2 AND n = 0);
+        END LOOP;
+    END LOOP;
+
+    PERFORM set_config('semantic_cache.sync_invalidation', 'off', true);
+
+    RETURN deleted;
+END;
+$$;
+
+-- Note: Implemented in SQL to properly read from cache_metadata table
+--       Negative entries and hits are reported separately and are not part of hit_rate_percent
+CREATE FUNCTION cache_stats()
+RETURNS TABLE(
+    total_entries bigint,
+    total_hits bigint,
+    total_misses bigint,
+    hit_rate_percent float4,
+    negative_entries bigint,
+    negative_hits bigint
+)
+LANGUAGE sql STABLE PARALLEL SAFE
+AS $$
+    SELECT
+        e.total_entries,
+        m.total_hits,
+        m.total_misses,
+        CASE
+            WHEN (m.total_hits + m.total_misses) > 0
+            THEN (m.total_hits::numeric / (m.total_hits + m.total_misses)::numeric * 100)::float4
+            ELSE 0::float4
+        END as hit_rate_percent,
+        e.negative_entries,
+        m.total_negative_hits as negative_hits
+    FROM semantic_cache.cache_metadata m,
+         (SELECT COUNT(*)::bigint as total_entries,
+                 COUNT(*) FILTER (WHERE is_negative)::bigint as negative_entries
+          FROM semantic_cache.cache_entries) e
+    WHERE m.id = 1;
+$$;
+
+-- Note: Implemented in SQL as a convenience wrapper over cache_stats()
+CREATE FUNCTION cache_hit_rate()
+RETURNS float4
+LANGUAGE sql STABLE PARALLEL SAFE
+AS $$
+    SELECT hit_rate_percent FROM semantic_cache.cache_stats();
+$$;
+
+CREATE FUNCTION evict_expired()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'evict_expired'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION evict_lru(keep_count integer)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'evict_lru'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION evict_lfu(keep_count integer)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'evict_lfu'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+-- Same, keeping keep_count entries in the partition cluster_id only
+-- (see enable_partitioned_layout()); auto_evict() uses these per partition
+CREATE FUNCTION evict_lru(keep_count integer, cluster_id integer)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'evict_lru'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION evict_lfu(keep_count integer, cluster_id integer)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'evict_lfu'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION clear_cache()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'clear_cache'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+-- Note: Implemented in SQL; reads eviction_policy from cache_config and delegates
+--       to evict_expired() (ttl), evict_lru() (lru), or evict_lfu() (lfu),
+--       partition by partition with the partitioned layout
+--       Rebuilds the hash filter (see rebuild_hash_filter()), reloads the
+--       health gauges (see reconcile_cache_gauges()) and reseeds the
+--       top-queries sketches (see rebuild_top_queries()) when they are due,
+--       flushes the distinct-query sketches (see flush_access_sketches()),
+--       encodes a batch of entries for PQ lookups (see pq_encode_pending())
+--       and discards queued accesses of dropped databases (see discard_pending_accesses())
+CREATE FUNCTION auto_evict()
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    policy      TEXT;
+    total_count BIGINT;
+    keep_count  INTEGER;
+    evicted     BIGINT := 0;
+    partition   RECORD;
+    rebuild_secs INTEGER;
+    retention_days INTEGER;
+BEGIN
+    -- Always evict TTL-expired entries first, then a batch of lazily invalidated ones
+    evicted := evicted + semantic_cache.evict_expired();
+    evicted := evicted + semantic_cache.collect_invalidated();
+
+    -- Entries that arrived without PQ codes (cache sync) get them here
+    PERFORM semantic_cache.pq_encode_pending();
+
+    -- The embedding memo has its own TTL and size budget
+    PERFORM semantic_cache.evict_embedding_memo();
+
+    -- Read eviction policy from config (default: 'ttl')
+    SELECT value INTO policy
+    FROM semantic_cache.cache_config
+    WHERE key = 'eviction_policy';
+
+    IF policy IS NULL THEN
+        policy := 'ttl';
+    END IF;
+
+    -- For LRU or LFU policies, also evict by usage pattern (keep 80% of remaining).
+    -- With the partitioned layout each partition keeps 80% of its own entries
+    IF policy IN ('lru', 'lfu') AND NOT EXISTS (SELECT 1 FROM semantic_cache.cache_centroids) THEN
+        SELECT COUNT(*)::BIGINT INTO total_count
+        FROM semantic_cache.cache_entries;
+
+        keep_count := GREATEST((total_count * 0.8)::INTEGER, 0);
+
+        IF policy = 'lru' THEN
+            evicted := evicted + semantic_cache.evict_lru(keep_count);
+        ELSE
+            evicted := evicted + semantic_cache.evict_lfu(keep_count);
+        END IF;
+    ELSIF policy IN ('lru', 'lfu') THEN
+        FOR partition IN
+            SELECT ce.cluster_id, COUNT(*)::BIGINT AS entries
+            FROM semantic_cache.cache_entries ce
+            GROUP BY ce.cluster_id
+            ORDER BY ce.cluster_id
+        LOOP
+            keep_count := GREATEST((partition.entries * 0.8)::INTEGER, 0);
+
+            IF policy = 'lru' THEN
+                evicted := evicted + semantic_cache.evict_lru(keep_count, partition.cluster_id);
+            ELSE
+                evicted := evicted + semantic_cache.evict_lfu(keep_count, partition.cluster_id);
+            END IF;
+        END LOOP;
+    END IF;
+
+    -- Drop the deleted entries from the hash filter once it is old enough.
+    -- A filter built for another database is left to that database
+    SELECT COALESCE(MAX(value::integer), 3600) INTO rebuild_secs
+    FROM semantic_cache.cache_config
+    WHERE key = 'hash_filter_rebuild_seconds';
+
+    IF rebuild_secs > 0 AND EXISTS (
+        SELECT 1 FROM semantic_cache.hash_filter_stats() f
+        WHERE f.enabled
+          AND (f.rebuilt_at IS NULL
+               OR (f.built AND f.rebuilt_at < NOW() - make_interval(secs => rebuild_secs)))
+    ) THEN
+        PERFORM semantic_cache.rebuild_hash_filter();
+    END IF;
+
+    -- Reload the health gauges when they are due (see reconcile_cache_gauges())
+    SELECT COALESCE(MAX(value::integer), 600) INTO rebuild_secs
+    FROM semantic_cache.cache_config
+    WHERE key = 'gauge_reconcile_seconds';
+
+    IF rebuild_secs > 0 AND EXISTS (
+        SELECT 1 FROM semantic_cache.cache_gauges() g
+        WHERE g.enabled
+          AND (g.reconciled_at IS NULL
+               OR (g.reconciled AND g.reconciled_at < NOW() - make_interval(secs => rebuild_secs)))
+    ) THEN
+        PERFORM semantic_cache.reconcile_cache_gauges();
+    END IF;
+
+    -- Reseed the top-queries sketches from the access log when they are due
+    SELECT COALESCE(MAX(value::integer), 86400) INTO rebuild_secs
+    FROM semantic_cache.cache_config
+    WHERE key = 'top_queries_rebuild_seconds';
+
+    IF rebuild_secs > 0 AND EXISTS (
+        SELECT 1 FROM semantic_cache.top_queries_stats() s
+        WHERE s.enabled
+          AND (s.rebuilt_at IS NULL
+               OR (s.built AND s.rebuilt_at < NOW() - make_interval(secs => rebuild_secs)))
+    ) THEN
+        PERFORM semantic_cache.rebuild_top_queries();
+    END IF;
+
+    -- Merge the hourly distinct-query sketches and drop those past retention
+    PERFORM semantic_cache.flush_access_sketches();
+
+    SELECT COALESCE(MAX(value::integer), 90) INTO retention_days
+    FROM semantic_cache.cache_config
+    WHERE key = 'access_sketch_retention_days';
+
+    IF retention_days > 0 THEN
+        DELETE FROM semantic_cache.cache_access_sketches
+        WHERE bucket_start < NOW() - make_interval(days => retention_days);
+    END IF;
+
+    -- Read-only lookups of dropped databases would hold their access queue slots
+    PERFORM semantic_cache.discard_pending_accesses();
+
+    RETURN evicted;
+END;
+$$;
+
+CREATE FUNCTION log_cache_access(
+    query_hash text DEFAULT NULL,
+    cache_hit boolean DEFAULT false,
+    similarity_score float4 DEFAULT NULL,
+    query_cost numeric DEFAULT NULL
+)
+RETURNS void
+AS 'MODULE_PATHNAME', 'log_cache_access'
+LANGUAGE C PARALLEL UNSAFE;
+
+CREATE FUNCTION get_cost_savings(
+    days integer DEFAULT 30
+)
+RETURNS TABLE(
+    total_queries bigint,
+    cache_hits bigint,
+    cache_misses bigint,
+    hit_rate float4,
+    total_cost_saved float8,
+    avg_cost_per_hit float8,
+    total_cost_if_no_cache float8
+)
+AS 'MODULE_PATHNAME', 'get_cost_savings'
+LANGUAGE C PARALLEL SAFE;
+
+-- ============================================================================
+-- CONFIGURATION FUNCTIONS
+-- ============================================================================
+
+CREATE FUNCTION set_vector_dimension(dimension integer)
+RETURNS void
+AS 'MODULE_PATHNAME', 'set_vector_dimension'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION get_vector_dimension()
+RETURNS integer
+AS 'MODULE_PATHNAME', 'get_vector_dimension'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION set_index_type(index_type text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'set_index_type'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION get_index_type()
+RETURNS text
+AS 'MODULE_PATHNAME', 'get_index_type'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION rebuild_index()
+RETURNS void
+AS 'MODULE_PATHNAME', 'rebuild_index'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+-- Rebuilds the index for the metric's operator class, clearing the cache
+CREATE FUNCTION set_distance_metric(metric text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'set_distance_metric'
+LANGUAGE C STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION get_distance_metric()
+RETURNS text
+AS 'MODULE_PATHNAME', 'get_distance_metric'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- ============================================================================
+-- READ-ONLY LOOKUP FUNCTIONS
+-- Note: Counters and the access queue live in shared memory and are per server;
+--       without shared_preload_libraries they are not kept
+-- ============================================================================
+
+CREATE FUNCTION readonly_lookup_stats(
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT negative_hits bigint,
+    OUT pending_accesses integer,
+    OUT dropped_accesses bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'readonly_lookup_stats'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION drain_pending_accesses(max_rows integer DEFAULT 10000)
+RETURNS TABLE(
+    cache_id bigint,
+    accessed_at timestamptz
+)
+AS 'MODULE_PATHNAME', 'drain_pending_accesses'
+LANGUAGE C PARALLEL RESTRICTED;
+
+-- The access queue is shared by every database on the server; this drops the
+-- accesses of another database, or with NULL those of dropped databases.
+-- auto_evict() runs the latter
+CREATE FUNCTION discard_pending_accesses(database oid DEFAULT NULL)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'discard_pending_accesses'
+LANGUAGE C PARALLEL RESTRICTED;
+
+-- Note: Implemented in SQL; run on the primary with a batch drained from a standby.
+--       Bumps access_count and last_accessed_at so LRU/LFU eviction sees replica reads
+CREATE FUNCTION apply_access_batch(
+    cache_ids bigint[],
+    accessed_at timestamptz[]
+)
+RETURNS bigint
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    WITH batch AS (
+        SELECT b.id, COUNT(*)::integer AS n, MAX(b.at) AS last_at
+        FROM unnest(cache_ids, accessed_at) AS b(id, at)
+        GROUP BY b.id
+    ),
+    applied AS (
+        UPDATE semantic_cache.cache_entries ce
+        SET access_count = ce.access_count + batch.n,
+            last_accessed_at = GREATEST(ce.last_accessed_at, batch.last_at)
+        FROM batch
+        WHERE ce.id = batch.id
+        RETURNING 1
+    )
+    SELECT COUNT(*)::bigint FROM applied;
+$$;
+
+-- ============================================================================
+-- CROSS-REGION SYNC FUNCTIONS
+-- Note: Entries and invalidations are shipped as rows of cache_sync_events, an
+--       insert-only table published over logical replication; subscribers merge
+--       them into their own cache_entries from a trigger
+-- ============================================================================
+
+-- Row trigger on cache_entries (installed by create_sync_publication()): records
+-- new and refreshed entries that have not expired yet
+CREATE FUNCTION capture_sync_entry()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF NEW.expires_at IS NULL OR NEW.expires_at > NOW() THEN
+        INSERT INTO semantic_cache.cache_sync_events (
+            kind, query_hash, query_text, query_embedding, result_data,
+            result_size_bytes, is_negative, ttl_seconds, created_at, expires_at, tags
+        ) VALUES (
+            'I', NEW.query_hash, NEW.query_text, NEW.query_embedding, NEW.result_data,
+            NEW.result_size_bytes, NEW.is_negative, NEW.ttl_seconds, NEW.created_at,
+            NEW.expires_at, NEW.tags
+        );
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Statement trigger on cache_entries (installed by create_sync_publication()):
+-- records deletes made by invalidate_cache(); eviction stays local
+CREATE FUNCTION capture_sync_invalidation()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF current_setting('semantic_cache.sync_invalidation', true) = 'on' THEN
+        INSERT INTO semantic_cache.cache_sync_events (kind, query_hash)
+        SELECT 'D', d.query_hash FROM deleted_entries d;
+
+        -- Keep the initial copy for new subscribers from resurrecting them
+        DELETE FROM semantic_cache.cache_sync_events e
+        USING deleted_entries d
+        WHERE e.kind = 'I' AND e.query_hash = d.query_hash;
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Trigger on cache_sync_events (ENABLE ALWAYS): when a row arrives through a
+-- subscription, merge it into cache_entries and drop it.  Locally captured
+-- events are stored for publishing as usual.  Apply workers run with an empty
+-- search_path, so the one from CREATE EXTENSION (which finds pgvector) is kept.
+CREATE FUNCTION apply_sync_event()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+SET search_path FROM CURRENT
+AS $$
+DECLARE
+    local_dimension integer;
+    cluster integer;
+BEGIN
+    IF current_setting('session_replication_role') <> 'replica' THEN
+        RETURN NEW;
+    END IF;
+
+    IF NEW.kind = 'D' THEN
+        -- Entries cached here after the invalidation are newer and stay
+        DELETE FROM semantic_cache.cache_entries
+        WHERE query_hash = NEW.query_hash
+          AND created_at <= NEW.event_time;
+        RETURN NULL;
+    END IF;
+
+    -- Expired on arrival (subscriber lagging or initial copy) - nothing to warm
+    IF NEW.expires_at IS NOT NULL AND NEW.expires_at <= NOW() THEN
+        RETURN NULL;
+    END IF;
+
+    -- Regions configured with another vector dimension cannot share entries
+    SELECT atttypmod INTO local_dimension
+    FROM pg_attribute
+    WHERE attrelid = 'semantic_cache.cache_entries'::regclass
+      AND attname = 'query_embedding';
+
+    IF vector_dims(NEW.query_embedding) <> local_dimension THEN
+        RETURN NULL;
+    END IF;
+
+    -- With cosine, lookups compare unit vectors by inner product; older publishers
+    -- send raw ones
+    IF COALESCE((SELECT value FROM semantic_cache.cache_config WHERE key = 'distance_metric'),
+                'cosine') = 'cosine' THEN
+        NEW.query_embedding := semantic_cache.unit_vector(NEW.query_embedding);
+    END IF;
+
+    -- Written without ON CONFLICT (query_hash) so it works with either layout.
+    -- With the partitioned layout an entry keeps the partition it is cached in
+    cluster := (semantic_cache.nearest_clusters(NEW.query_embedding, 1))[1];
+    cluster := CASE WHEN cluster IS NULL THEN 0
+                    ELSE semantic_cache.entry_cluster(NEW.query_hash, cluster) END;
+
+    -- Last writer (by created_at) wins on query_hash conflicts
+    UPDATE semantic_cache.cache_entries SET
+        query_embedding = NEW.query_embedding,
+        result_data = NEW.result_data,
+        result_size_bytes = NEW.result_size_bytes,
+        is_negative = NEW.is_negative,
+        ttl_seconds = NEW.ttl_seconds,
+        created_at = NEW.created_at,
+        expires_at = NEW.expires_at,
+        tags = NEW.tags,
+        generation = semantic_cache.cache_generation()
+    WHERE query_hash = NEW.query_hash
+      AND cluster_id = cluster
+      AND created_at < NEW.created_at;
+
+    IF NOT FOUND THEN
+        INSERT INTO semantic_cache.cache_entries (
+            query_hash, query_text, query_embedding, result_data, result_size_bytes,
+            is_negative, ttl_seconds, created_at, expires_at, tags, cluster_id
+        ) VALUES (
+            NEW.query_hash, NEW.query_text, NEW.query_embedding, NEW.result_data,
+            NEW.result_size_bytes, NEW.is_negative, NEW.ttl_seconds, NEW.created_at,
+            NEW.expires_at, NEW.tags, cluster
+        )
+        ON CONFLICT DO NOTHING;
+    END IF;
+
+    -- The embedding may have changed; stale PQ codes would rank the entry wrongly
+    INSERT INTO semantic_cache.cache_pq_codes (cache_id, cluster_id, expires_at, is_negative, generation,
+                                               codebook_version, codes)
+    SELECT ce.id, ce.cluster_id, ce.expires_at, ce.is_negative, ce.generation, cb.version,
+           semantic_cache.pq_encode(ce.query_embedding::text)
+    FROM semantic_cache.cache_entries ce,
+         (SELECT MAX(version) AS version FROM semantic_cache.cache_pq_codebook) cb
+    WHERE ce.query_hash = NEW.query_hash
+      AND cb.version IS NOT NULL
+    ON CONFLICT (cache_id) DO UPDATE SET
+        cluster_id = EXCLUDED.cluster_id,
+        expires_at = EXCLUDED.expires_at,
+        is_negative = EXCLUDED.is_negative,
+        generation = EXCLUDED.generation,
+        codebook_version = EXCLUDED.codebook_version,
+        codes = EXCLUDED.codes;
+
+    PERFORM semantic_cache.hash_filter_add(NEW.query_hash);
+
+    RETURN NULL;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; needs wal_level = logical to be useful
+CREATE FUNCTION create_sync_publication(publication_name text DEFAULT 'semantic_cache_sync')
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    DROP TRIGGER IF EXISTS cache_sync_capture_insert ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_sync_capture_refresh ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_sync_capture_invalidation ON semantic_cache.cache_entries;
+
+    CREATE TRIGGER cache_sync_capture_insert
+        AFTER INSERT ON semantic_cache.cache_entries
+        FOR EACH ROW EXECUTE FUNCTION semantic_cache.capture_sync_entry();
+
+    -- Only refreshes (cache_query() over an expired entry) change created_at
+    CREATE TRIGGER cache_sync_capture_refresh
+        AFTER UPDATE ON semantic_cache.cache_entries
+        FOR EACH ROW
+        WHEN (NEW.created_at IS DISTINCT FROM OLD.created_at)
+        EXECUTE FUNCTION semantic_cache.capture_sync_entry();
+
+    CREATE TRIGGER cache_sync_capture_invalidation
+        AFTER DELETE ON semantic_cache.cache_entries
+        REFERENCING OLD TABLE AS deleted_entries
+        FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.capture_sync_invalidation();
+
+    IF NOT EXISTS (SELECT 1 FROM pg_publication WHERE pubname = publication_name) THEN
+        EXECUTE format('CREATE PUBLICATION %I FOR TABLE semantic_cache.cache_sync_events '
+                       'WITH (publish = ''insert'')', publication_name);
+    END IF;
+END;
+$$;
+
+CREATE FUNCTION drop_sync_publication(publication_name text DEFAULT 'semantic_cache_sync')
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    EXECUTE format('DROP PUBLICATION IF EXISTS %I', publication_name);
+
+    DROP TRIGGER IF EXISTS cache_sync_capture_insert ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_sync_capture_refresh ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_sync_capture_invalidation ON semantic_cache.cache_entries;
+
+    TRUNCATE semantic_cache.cache_sync_events;
+END;
+$$;
+
+-- CREATE SUBSCRIPTION cannot run inside a function, so this returns the command;
+-- run it with psql's \gexec
+CREATE FUNCTION sync_subscription_command(
+    conninfo text,
+    subscription_name text,
+    publication_name text DEFAULT 'semantic_cache_sync'
+)
+RETURNS text
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE
+AS $$
+    SELECT format('CREATE SUBSCRIPTION %I CONNECTION %L PUBLICATION %I '
+                  'WITH (copy_data = true)',
+                  subscription_name, conninfo, publication_name);
+$$;
+
+-- ============================================================================
+-- PARTITIONED LAYOUT FUNCTIONS
+-- Note: With the partitioned layout cache_entries is list-partitioned by
+--       cluster_id, one partition per centroid in cache_centroids, so lookups,
+--       eviction scans, VACUUM and REINDEX each work on a fraction of the cache
+-- ============================================================================
+
+-- Clusters of the n centroids nearest to an embedding, nearest first;
+-- NULL unless the partitioned layout is enabled
+CREATE FUNCTION nearest_clusters(query_embedding vector, n integer DEFAULT 1)
+RETURNS integer[]
+LANGUAGE sql STABLE STRICT PARALLEL SAFE
+AS $$
+    SELECT array_agg(c.cluster_id ORDER BY c.distance)
+    FROM (
+        SELECT cluster_id, centroid <=> query_embedding AS distance
+        FROM semantic_cache.cache_centroids
+        ORDER BY 2
+        LIMIT n
+    ) c
+$$;
+
+-- Internal: partition for an entry being cached with the partitioned layout.
+-- A query_hash already cached keeps its partition, so it stays unique across
+-- partitions; a new one goes to nearest.  Writers of one query_hash are
+-- serialized until commit
+CREATE FUNCTION entry_cluster(query_hash text, nearest integer)
+RETURNS integer
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    existing integer;
+BEGIN
+    PERFORM pg_advisory_xact_lock(1363689811, hashtext(query_hash));
+
+    SELECT ce.cluster_id INTO existing
+    FROM semantic_cache.cache_entries ce
+    WHERE ce.query_hash = entry_cluster.query_hash
+    LIMIT 1;
+
+    RETURN COALESCE(existing, nearest);
+END;
+$$;
+
+-- Trigger on the partitioned cache_entries, whose unique constraint has to
+-- include cluster_id: rejects a query_hash already cached in another partition
+CREATE FUNCTION check_entry_hash()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    PERFORM pg_advisory_xact_lock(1363689811, hashtext(NEW.query_hash));
+
+    IF EXISTS (
+        SELECT 1 FROM semantic_cache.cache_entries ce
+        WHERE ce.query_hash = NEW.query_hash
+          AND ce.cluster_id <> NEW.cluster_id
+          AND ce.id <> NEW.id
+    ) THEN
+        RAISE EXCEPTION 'duplicate key value violates unique query_hash of cache_entries'
+            USING ERRCODE = 'unique_violation',
+                  DETAIL = format('Key (query_hash)=(%s) is cached in another partition.', NEW.query_hash);
+    END IF;
+
+    RETURN NEW;
+END;
+$$;
+
+-- Internal: rebuilds cache_entries as a plain table (num_partitions = 0) or
+-- list-partitioned by cluster_id, moving every entry across.  Secondary indexes,
+-- triggers, dependent views, the id sequence and extension membership carry over,
+-- and the split storage settings (see enable_split_storage()) are applied.
+CREATE FUNCTION rebuild_cache_layout(num_partitions integer)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    old_rel oid := to_regclass('semantic_cache.cache_entries');
+    new_table text := CASE WHEN num_partitions > 0 THEN 'cache_entries_partitioned'
+                           ELSE 'cache_entries_monolithic' END;
+    new_rel oid;
+    cols text;
+    moved bigint;
+    idx_type text;
+    index_key text;
+    per_partition bigint;
+    obj record;
+BEGIN
+    SELECT string_agg(quote_ident(attname), ', ' ORDER BY attnum) INTO cols
+    FROM pg_attribute
+    WHERE attrelid = old_rel
+      AND attnum > 0
+      AND NOT attisdropped
+      AND attgenerated = ''
+      AND attname <> 'cluster_id';
+
+    IF num_partitions > 0 THEN
+        -- Unique constraints on a partitioned table must include the partition key;
+        -- check_entry_hash() keeps query_hash unique across partitions
+        CREATE TABLE semantic_cache.cache_entries_partitioned (
+            LIKE semantic_cache.cache_entries INCLUDING DEFAULTS INCLUDING GENERATED INCLUDING STORAGE,
+            PRIMARY KEY (id, cluster_id),
+            UNIQUE (query_hash, cluster_id)
+        ) PARTITION BY LIST (cluster_id);
+
+        FOR i IN 0 .. num_partitions - 1 LOOP
+            EXECUTE format('CREATE TABLE semantic_cache.%I PARTITION OF semantic_cache.cache_entries_partitioned '
+                           'FOR VALUES IN (%s)', 'cache_entries_p' || i, i);
+        END LOOP;
+        PERFORM semantic_cache.apply_storage_options('semantic_cache.cache_entries_partitioned');
+
+        EXECUTE format('INSERT INTO semantic_cache.cache_entries_partitioned (%s, cluster_id) '
+                       'SELECT %s, COALESCE((semantic_cache.nearest_clusters(query_embedding, 1))[1], 0) '
+                       'FROM semantic_cache.cache_entries', cols, cols);
+        GET DIAGNOSTICS moved = ROW_COUNT;
+    ELSE
+        CREATE TABLE semantic_cache.cache_entries_monolithic (
+            LIKE semantic_cache.cache_entries INCLUDING DEFAULTS INCLUDING GENERATED INCLUDING STORAGE,
+            PRIMARY KEY (id),
+            UNIQUE (query_hash)
+        );
+        PERFORM semantic_cache.apply_storage_options('semantic_cache.cache_entries_monolithic');
+
+        -- A query cached in several partitions keeps its newest entry
+        EXECUTE format('INSERT INTO semantic_cache.cache_entries_monolithic (%s) '
+                       'SELECT %s FROM semantic_cache.cache_entries ORDER BY created_at DESC '
+                       'ON CONFLICT (query_hash) DO NOTHING', cols, cols);
+        GET DIAGNOSTICS moved = ROW_COUNT;
+    END IF;
+
+    new_rel := to_regclass('semantic_cache.' || new_table);
+
+    -- Secondary indexes are recreated under their names once the old ones are out of the way
+    FOR obj IN
+        SELECT c.relname, pg_get_indexdef(i.indexrelid) AS def
+        FROM pg_index i
+        JOIN pg_class c ON c.oid = i.indexrelid
+        WHERE i.indrelid = old_rel
+          AND NOT EXISTS (SELECT 1 FROM pg_constraint k WHERE k.conindid = i.indexrelid)
+        ORDER BY c.relname
+    LOOP
+        EXECUTE format('ALTER INDEX semantic_cache.%I RENAME TO %I',
+                       obj.relname, left(obj.relname, 50) || '_retired');
+        IF obj.relname <> 'idx_cache_embedding' THEN
+            EXECUTE regexp_replace(obj.def, ' ON (ONLY )?(semantic_cache\.)?cache_entries ',
+                                   format(' ON semantic_cache.%I ', new_table));
+        END IF;
+    END LOOP;
+
+    -- The vector index is sized by rows per partition, as rebuild_index() does,
+    -- and keyed by the operator class of the configured distance_metric
+    SELECT value INTO idx_type FROM semantic_cache.cache_config WHERE key = 'index_type';
+    SELECT CASE value
+               WHEN 'l2' THEN 'query_embedding vector_l2_ops'
+               WHEN 'hamming' THEN format('(binary_quantize(query_embedding)::bit(%s)) bit_hamming_ops',
+                                          (SELECT atttypmod FROM pg_attribute
+                                           WHERE attrelid = old_rel AND attname = 'query_embedding'))
+               ELSE 'query_embedding vector_ip_ops' END
+    INTO index_key
+    FROM (SELECT COALESCE(MAX(CASE WHEN key = 'distance_metric' THEN value END), 'cosine') AS value
+          FROM semantic_cache.cache_config) cfg;
+    per_partition := moved / GREATEST(num_partitions, 1);
+
+    IF idx_type = 'hnsw' THEN
+        EXECUTE format('CREATE INDEX idx_cache_embedding ON semantic_cache.%I '
+                       'USING hnsw (%s)', new_table, index_key);
+    ELSE
+        EXECUTE format('CREATE INDEX idx_cache_embedding ON semantic_cache.%I '
+                       'USING ivfflat (%s) WITH (lists = %s)',
+                       new_table, index_key,
+                       CASE WHEN per_partition > 100000 THEN 1000
+                            WHEN per_partition > 10000 THEN 200
+                            WHEN per_partition < 1000 THEN 10
+                            ELSE 100 END);
+    END IF;
+
+    ALTER TABLE semantic_cache.cache_entries RENAME TO cache_entries_retired;
+    EXECUTE format('ALTER TABLE semantic_cache.%I RENAME TO cache_entries', new_table);
+
+    FOR obj IN
+        SELECT t.tgname, t.tgenabled, pg_get_triggerdef(t.oid) AS def
+        FROM pg_trigger t
+        WHERE t.tgrelid = old_rel
+          AND NOT t.tgisinternal
+          AND t.tgname <> 'cache_entries_hash_unique'
+        ORDER BY t.tgname
+    LOOP
+        EXECUTE format('DROP TRIGGER %I ON semantic_cache.cache_entries_retired', obj.tgname);
+        EXECUTE replace(obj.def, 'cache_entries_retired', 'cache_entries');
+        IF obj.tgenabled <> 'O' THEN
+            EXECUTE format('ALTER TABLE semantic_cache.cache_entries %s TRIGGER %I',
+                           CASE obj.tgenabled
+                               WHEN 'D' THEN 'DISABLE'
+                               WHEN 'A' THEN 'ENABLE ALWAYS'
+                               ELSE 'ENABLE REPLICA'
+                           END,
+                           obj.tgname);
+        END IF;
+    END LOOP;
+
+    -- Also checked for rows written by cache sync
+    IF num_partitions > 0 THEN
+        CREATE TRIGGER cache_entries_hash_unique
+            BEFORE INSERT OR UPDATE OF query_hash, cluster_id ON semantic_cache.cache_entries
+            FOR EACH ROW EXECUTE FUNCTION semantic_cache.check_entry_hash();
+        ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_entries_hash_unique;
+    END IF;
+
+    -- Views are repointed in place, keeping their grants, comments and membership
+    FOR obj IN
+        SELECT DISTINCT r.ev_class::regclass AS view_name
+        FROM pg_depend d
+        JOIN pg_rewrite r ON r.oid = d.objid
+        WHERE d.classid = 'pg_rewrite'::regclass
+          AND d.refclassid = 'pg_class'::regclass
+          AND d.refobjid = old_rel
+          AND r.ev_class <> old_rel
+    LOOP
+        EXECUTE format('CREATE OR REPLACE VIEW %s AS %s', obj.view_name,
+                       replace(rtrim(pg_get_viewdef(obj.view_name), ';'),
+                               'cache_entries_retired', 'cache_entries'));
+    END LOOP;
+
+    ALTER SEQUENCE semantic_cache.cache_entries_id_seq OWNED BY semantic_cache.cache_entries.id;
+    EXECUTE format('COMMENT ON TABLE semantic_cache.cache_entries IS %L',
+                   obj_description(old_rel, 'pg_class'));
+
+    -- DROP EXTENSION must keep removing the cache, whichever table holds it
+    FOR obj IN
+        SELECT d.objid::regclass AS rel
+        FROM pg_depend d
+        WHERE d.classid = 'pg_class'::regclass
+          AND d.deptype = 'e'
+          AND (d.objid = old_rel
+               OR d.objid IN (SELECT inhrelid FROM pg_inherits WHERE inhparent = old_rel))
+        ORDER BY d.objid
+    LOOP
+        EXECUTE format('ALTER EXTENSION pg_semantic_cache DROP TABLE %s', obj.rel);
+    END LOOP;
+
+    DROP TABLE semantic_cache.cache_entries_retired;
+
+    FOR obj IN
+        SELECT c.oid::regclass AS rel
+        FROM pg_class c
+        WHERE c.oid = new_rel
+           OR c.oid IN (SELECT inhrelid FROM pg_inherits WHERE inhparent = new_rel)
+        ORDER BY c.oid
+    LOOP
+        EXECUTE format('ALTER EXTENSION pg_semantic_cache ADD TABLE %s', obj.rel);
+    END LOOP;
+
+    FOR obj IN
+        SELECT conname
+        FROM pg_constraint
+        WHERE conrelid = new_rel
+          AND conname LIKE new_table || '%'
+        ORDER BY conname
+    LOOP
+        EXECUTE format('ALTER TABLE semantic_cache.cache_entries RENAME CONSTRAINT %I TO %I',
+                       obj.conname, 'cache_entries' || substr(obj.conname, length(new_table) + 1));
+    END LOOP;
+
+    -- PQ codes follow their entries into the new partitions; those of entries
+    -- not carried over go
+    DELETE FROM semantic_cache.cache_pq_codes c
+    WHERE NOT EXISTS (SELECT 1 FROM semantic_cache.cache_entries ce WHERE ce.id = c.cache_id);
+    UPDATE semantic_cache.cache_pq_codes c
+    SET cluster_id = ce.cluster_id
+    FROM semantic_cache.cache_entries ce
+    WHERE ce.id = c.cache_id
+      AND c.cluster_id <> ce.cluster_id;
+
+    RETURN moved;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; centroids come from k-means over a sample of the
+--       cached embeddings, so enable it once the cache holds a representative set
+CREATE FUNCTION enable_partitioned_layout(
+    num_clusters integer DEFAULT 16,
+    sample_size integer DEFAULT 10000,
+    iterations integer DEFAULT 10
+)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    seeded integer;
+BEGIN
+    IF num_clusters IS NULL OR num_clusters < 2 OR num_clusters > 1024 THEN
+        RAISE EXCEPTION 'enable_partitioned_layout: num_clusters must be between 2 and 1024';
+    END IF;
+
+    IF sample_size IS NULL OR sample_size < num_clusters THEN
+        RAISE EXCEPTION 'enable_partitioned_layout: sample_size must be at least num_clusters';
+    END IF;
+
+    IF (SELECT relkind FROM pg_class WHERE oid = to_regclass('semantic_cache.cache_entries')) = 'p' THEN
+        RAISE EXCEPTION 'enable_partitioned_layout: the partitioned layout is already enabled';
+    END IF;
+
+    IF to_regclass('pg_temp.centroid_sample') IS NOT NULL THEN
+        DROP TABLE pg_temp.centroid_sample;
+    END IF;
+
+    CREATE TEMP TABLE centroid_sample ON COMMIT DROP AS
+    SELECT query_embedding
+    FROM semantic_cache.cache_entries
+    WHERE query_embedding IS NOT NULL
+    ORDER BY random()
+    LIMIT sample_size;
+
+    -- Seed with distinct sampled embeddings, then refine with Lloyd iterations
+    TRUNCATE semantic_cache.cache_centroids;
+
+    INSERT INTO semantic_cache.cache_centroids (cluster_id, centroid)
+    SELECT (row_number() OVER ()) - 1, s.query_embedding
+    FROM (SELECT DISTINCT query_embedding FROM centroid_sample LIMIT num_clusters) s;
+    GET DIAGNOSTICS seeded = ROW_COUNT;
+
+    IF seeded < num_clusters THEN
+        RAISE EXCEPTION 'enable_partitioned_layout: found % distinct cached embeddings, need at least %',
+            seeded, num_clusters;
+    END IF;
+
+    FOR i IN 1 .. COALESCE(iterations, 0) LOOP
+        UPDATE semantic_cache.cache_centroids c
+        SET centroid = a.centroid
+        FROM (
+            SELECT (semantic_cache.nearest_clusters(s.query_embedding, 1))[1] AS cluster_id,
+                   avg(s.query_embedding) AS centroid
+            FROM centroid_sample s
+            GROUP BY 1
+        ) a
+        WHERE c.cluster_id = a.cluster_id;
+    END LOOP;
+
+    RETURN semantic_cache.rebuild_cache_layout(num_clusters);
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; moves every entry back into a single table
+CREATE FUNCTION disable_partitioned_layout()
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    moved bigint;
+BEGIN
+    IF (SELECT relkind FROM pg_class WHERE oid = to_regclass('semantic_cache.cache_entries')) <> 'p' THEN
+        RAISE EXCEPTION 'disable_partitioned_layout: the partitioned layout is not enabled';
+    END IF;
+
+    moved := semantic_cache.rebuild_cache_layout(0);
+    TRUNCATE semantic_cache.cache_centroids;
+
+    RETURN moved;
+END;
+$$;
+
+-- ============================================================================
+-- INVALIDATION NOTIFY FUNCTIONS
+-- Note: Deleted entries are announced with pg_notify() when the deleting
+--       transaction commits, so application-side caches can drop their copies.
+--       Every announcing statement takes a number from cache_generation.
+-- ============================================================================
+
+-- Current invalidation generation (0 before the first announcement).  Taken
+-- from the sequence, so it only increases but skips the numbers of rolled-back
+-- transactions; compare generations with >= and <, never by exact value
+CREATE FUNCTION cache_generation()
+RETURNS bigint
+LANGUAGE sql STABLE PARALLEL SAFE
+AS $$
+    SELECT CASE WHEN is_called THEN last_value ELSE 0 END
+    FROM semantic_cache.cache_generation;
+$$;
+
+-- Trigger on cache_entries (installed by enable_invalidation_notify()).
+-- Payloads are JSON: {"generation": g, "ids": [...], "hashes": [...]} in
+-- batches of 100 entries, or {"generation": g, "flush": true} when a statement
+-- deletes more than notify_max_ids entries or truncates the table.
+CREATE FUNCTION notify_invalidation()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    channel text;
+    max_ids integer;
+    generation bigint;
+    ids bigint[];
+    hashes text[];
+    n integer;
+BEGIN
+    SELECT
+        MAX(CASE WHEN key = 'notify_channel' THEN value END),
+        COALESCE(MAX(CASE WHEN key = 'notify_max_ids' THEN value::integer END), 1000)
+    INTO channel, max_ids
+    FROM semantic_cache.cache_config
+    WHERE key IN ('notify_channel', 'notify_max_ids');
+
+    -- collect_invalidated() removes entries invalidate_cache_lazy() already announced
+    IF channel IS NULL OR current_setting('semantic_cache.collecting', true) = 'on' THEN
+        RETURN NULL;
+    END IF;
+
+    IF TG_OP = 'UPDATE' THEN
+        -- Row trigger, fires only when an entry is replaced in place
+        ids := ARRAY[NEW.id];
+        hashes := ARRAY[NEW.query_hash];
+    ELSIF TG_OP = 'DELETE' THEN
+        -- One entry past the limit is enough to know a flush is needed
+        SELECT array_agg(d.id ORDER BY d.id), array_agg(d.query_hash ORDER BY d.id)
+        INTO ids, hashes
+        FROM (
+            SELECT id, query_hash FROM deleted_entries
+            ORDER BY id
+            LIMIT max_ids + 1
+        ) d;
+    END IF;
+
+    n := COALESCE(array_length(ids, 1), 0);
+    IF TG_OP <> 'TRUNCATE' AND n = 0 THEN
+        RETURN NULL;
+    END IF;
+
+    generation := nextval('semantic_cache.cache_generation');
+
+    IF TG_OP = 'TRUNCATE' OR n > max_ids THEN
+        PERFORM pg_notify(channel, json_build_object('generation', generation,
+                                                     'flush', true)::text);
+        RETURN NULL;
+    END IF;
+
+    -- 100 md5 hashes and ids stay well below the 8000 byte payload limit
+    FOR i IN 0 .. (n - 1) / 100 LOOP
+        PERFORM pg_notify(channel, json_build_object(
+            'generation', generation,
+            'ids', ids[i * 100 + 1 : i * 100 + 100],
+            'hashes', hashes[i * 100 + 1 : i * 100 + 100])::text);
+    END LOOP;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL
+CREATE FUNCTION enable_invalidation_notify(
+    channel text DEFAULT 'semantic_cache_invalidation',
+    max_ids integer DEFAULT 1000
+)
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF channel IS NULL OR channel = '' THEN
+        RAISE EXCEPTION 'enable_invalidation_notify: channel must not be empty';
+    END IF;
+
+    IF max_ids IS NULL OR max_ids < 0 THEN
+        RAISE EXCEPTION 'enable_invalidation_notify: max_ids must be zero or more';
+    END IF;
+
+    INSERT INTO semantic_cache.cache_config (key, value)
+    VALUES ('notify_channel', channel), ('notify_max_ids', max_ids::text)
+    ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;
+
+    DROP TRIGGER IF EXISTS cache_notify_delete ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_notify_refresh ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_notify_truncate ON semantic_cache.cache_entries;
+
+    CREATE TRIGGER cache_notify_delete
+        AFTER DELETE ON semantic_cache.cache_entries
+        REFERENCING OLD TABLE AS deleted_entries
+        FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.notify_invalidation();
+
+    -- cache_query() over an expired or negative entry replaces it in place
+    CREATE TRIGGER cache_notify_refresh
+        AFTER UPDATE ON semantic_cache.cache_entries
+        FOR EACH ROW
+        WHEN (NEW.created_at IS DISTINCT FROM OLD.created_at)
+        EXECUTE FUNCTION semantic_cache.notify_invalidation();
+
+    CREATE TRIGGER cache_notify_truncate
+        AFTER TRUNCATE ON semantic_cache.cache_entries
+        FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.notify_invalidation();
+
+    -- Invalidations applied from other regions are announced as well
+    ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_notify_delete;
+    ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_notify_refresh;
+    ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_notify_truncate;
+END;
+$$;
+
+CREATE FUNCTION disable_invalidation_notify()
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    DROP TRIGGER IF EXISTS cache_notify_delete ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_notify_refresh ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_notify_truncate ON semantic_cache.cache_entries;
+
+    DELETE FROM semantic_cache.cache_config
+    WHERE key IN ('notify_channel', 'notify_max_ids');
+END;
+$$;
+
+-- ============================================================================
+-- DEPENDENCY INVALIDATION FUNCTIONS
+-- Note: Statement triggers on registered source tables queue the tags whose
+--       entries a change affects; process_pending_invalidations() deletes the
+--       entries later, in batches, so writes to source tables stay cheap
+-- ============================================================================
+
+-- Statement trigger on source tables (installed by register_cache_dependency()).
+-- A dependency without key_column queues its tag on any change.  With
+-- key_column, each changed row queues tag || ':' || key, and TRUNCATE queues
+-- every key of the tag at once.  A tag already queued is updated rather than
+-- skipped: the row lock makes process_pending_invalidations() wait for this
+-- transaction, so a change that commits after the tag was taken queues it
+-- again instead of being lost.
+CREATE FUNCTION capture_source_change()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    dep record;
+    changed_keys text;
+BEGIN
+    FOR dep IN
+        SELECT tag, key_column
+        FROM semantic_cache.cache_dependencies
+        WHERE source_table = format('%I.%I', TG_TABLE_SCHEMA, TG_TABLE_NAME)
+    LOOP
+        IF dep.key_column IS NULL OR TG_OP = 'TRUNCATE' THEN
+            INSERT INTO semantic_cache.cache_pending_invalidations AS p (tag, all_keys)
+            VALUES (dep.tag, dep.key_column IS NOT NULL)
+            ON CONFLICT (tag, all_keys) DO UPDATE SET changes = p.changes + 1;
+            CONTINUE;
+        END IF;
+
+        changed_keys := CASE TG_OP
+            WHEN 'INSERT' THEN format('SELECT %I::text FROM new_rows', dep.key_column)
+            WHEN 'DELETE' THEN format('SELECT %I::text FROM old_rows', dep.key_column)
+            ELSE format('SELECT %1$I::text FROM old_rows UNION SELECT %1$I::text FROM new_rows',
+                        dep.key_column)
+        END;
+
+        EXECUTE format(
+            'INSERT INTO semantic_cache.cache_pending_invalidations AS p (tag, all_keys) '
+            'SELECT DISTINCT %L || '':'' || c.k, false FROM (%s) c(k) '
+            'WHERE c.k IS NOT NULL '
+            'ON CONFLICT (tag, all_keys) DO UPDATE SET changes = p.changes + 1',
+            dep.tag, changed_keys);
+    END LOOP;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL
+CREATE FUNCTION register_cache_dependency(
+    source_table regclass,
+    tag text,
+    key_column text DEFAULT NULL
+)
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    source_name text;
+BEGIN
+    IF tag IS NULL OR tag = '' THEN
+        RAISE EXCEPTION 'register_cache_dependency: tag must not be empty';
+    END IF;
+
+    IF key_column IS NOT NULL AND NOT EXISTS (
+        SELECT 1 FROM pg_attribute
+        WHERE attrelid = source_table
+          AND attname = key_column
+          AND attnum > 0
+          AND NOT attisdropped
+    ) THEN
+        RAISE EXCEPTION 'register_cache_dependency: % has no column "%"', source_table, key_column;
+    END IF;
+
+    -- Stored by name, which survives dump and restore
+    SELECT format('%I.%I', n.nspname, c.relname) INTO source_name
+    FROM pg_class c
+    JOIN pg_namespace n ON n.oid = c.relnamespace
+    WHERE c.oid = source_table;
+
+    INSERT INTO semantic_cache.cache_dependencies (source_table, tag, key_column)
+    VALUES (source_name, tag, key_column)
+    ON CONFLICT ON CONSTRAINT cache_dependencies_pkey
+    DO UPDATE SET key_column = EXCLUDED.key_column;
+
+    -- One set of triggers per source table serves all of its dependencies
+    IF NOT EXISTS (
+        SELECT 1 FROM pg_trigger
+        WHERE tgrelid = source_table AND tgname = 'cache_dependency_insert'
+    ) THEN
+        EXECUTE format('CREATE TRIGGER cache_dependency_insert AFTER INSERT ON %s '
+                       'REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION semantic_cache.capture_source_change()', source_table);
+        EXECUTE format('CREATE TRIGGER cache_dependency_update AFTER UPDATE ON %s '
+                       'REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION semantic_cache.capture_source_change()', source_table);
+        EXECUTE format('CREATE TRIGGER cache_dependency_delete AFTER DELETE ON %s '
+                       'REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION semantic_cache.capture_source_change()', source_table);
+        EXECUTE format('CREATE TRIGGER cache_dependency_truncate AFTER TRUNCATE ON %s '
+                       'FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION semantic_cache.capture_source_change()', source_table);
+    END IF;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; a NULL tag removes every dependency of the table
+CREATE FUNCTION unregister_cache_dependency(
+    source_table regclass,
+    tag text DEFAULT NULL
+)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    source_name text;
+    removed bigint;
+BEGIN
+    SELECT format('%I.%I', n.nspname, c.relname) INTO source_name
+    FROM pg_class c
+    JOIN pg_namespace n ON n.oid = c.relnamespace
+    WHERE c.oid = source_table;
+
+    DELETE FROM semantic_cache.cache_dependencies d
+    WHERE d.source_table = source_name
+      AND (unregister_cache_dependency.tag IS NULL OR d.tag = unregister_cache_dependency.tag);
+    GET DIAGNOSTICS removed = ROW_COUNT;
+
+    IF NOT EXISTS (
+        SELECT 1 FROM semantic_cache.cache_dependencies d
+        WHERE d.source_table = source_name
+    ) THEN
+        EXECUTE format('DROP TRIGGER IF EXISTS cache_dependency_insert ON %s', source_table);
+        EXECUTE format('DROP TRIGGER IF EXISTS cache_dependency_update ON %s', source_table);
+        EXECUTE format('DROP TRIGGER IF EXISTS cache_dependency_delete ON %s', source_table);
+        EXECUTE format('DROP TRIGGER IF EXISTS cache_dependency_truncate ON %s', source_table);
+    END IF;
+
+    RETURN removed;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; run it from a scheduler (e.g. every few
+-- seconds with pg_cron).  Concurrent callers take disjoint batches.
+CREATE FUNCTION process_pending_invalidations(max_tags integer DEFAULT 1000)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    exact_tags text[];
+    prefixes text[];
+    deleted bigint := 0;
+    n bigint;
+BEGIN
+    WITH batch AS (
+        SELECT p.tag, p.all_keys
+        FROM semantic_cache.cache_pending_invalidations p
+        ORDER BY p.queued_at
+        LIMIT max_tags
+        FOR UPDATE SKIP LOCKED
+    ), taken AS (
+        DELETE FROM semantic_cache.cache_pending_invalidations p
+        USING batch b
+        WHERE p.tag = b.tag AND p.all_keys = b.all_keys
+        RETURNING p.tag, p.all_keys
+    )
+    SELECT array_agg(t.tag) FILTER (WHERE NOT t.all_keys),
+           array_agg(t.tag || ':') FILTER (WHERE t.all_keys)
+    INTO exact_tags, prefixes
+    FROM taken t;
+
+    IF exact_tags IS NULL AND prefixes IS NULL THEN
+        RETURN 0;
+    END IF;
+
+    -- These deletes are invalidations, which cache sync replicates
+    PERFORM set_config('semantic_cache.sync_invalidation', 'on', true);
+
+    IF exact_tags IS NOT NULL THEN
+        DELETE FROM semantic_cache.cache_entries ce
+        WHERE ce.tags && exact_tags;
+        GET DIAGNOSTICS deleted = ROW_COUNT;
+    END IF;
+
+    -- Source tables truncated: every key of the tag, which needs a full scan
+    IF prefixes IS NOT NULL THEN
+        DELETE FROM semantic_cache.cache_entries ce
+        WHERE EXISTS (
+            SELECT 1 FROM unnest(ce.tags) t(tag), unnest(prefixes) p(prefix)
+            WHERE starts_with(t.tag, p.prefix)
+        );
+        GET DIAGNOSTICS n = ROW_COUNT;
+        deleted := deleted + n;
+    END IF;
+
+    PERFORM set_config('semantic_cache.sync_invalidation', 'off', true);
+
+    RETURN deleted;
+END;
+$$;
+
+-- ============================================================================
+-- LAZY INVALIDATION FUNCTIONS
+-- Note: Entries are stamped with the cache_generation() current when they are
+--       written.  invalidate_cache_lazy() only takes a new generation and
+--       records it as a cutoff, for all entries or for one tag; lookups skip
+--       entries older than their cutoff, and collect_invalidated() deletes
+--       them later in batches
+-- ============================================================================
+
+-- Internal: whether invalidate_cache_lazy() has invalidated an entry
+CREATE FUNCTION generation_invalidated(entry_generation bigint, entry_tags text[])
+RETURNS boolean
+LANGUAGE sql STABLE PARALLEL SAFE
+AS $$
+    SELECT entry_generation < COALESCE((SELECT value::bigint
+                                        FROM semantic_cache.cache_config
+                                        WHERE key = 'invalidated_generation'), 0)
+        OR EXISTS (SELECT 1 FROM semantic_cache.cache_invalidation_cutoffs c
+                   WHERE c.tag = ANY(entry_tags) AND entry_generation < c.generation);
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns the new generation.  Invalidates
+--       every entry when tag is NULL.  Local only: not replicated by cache sync.
+--       A rollback leaves the generation unused, so cutoffs are not dense
+CREATE FUNCTION invalidate_cache_lazy(tag text DEFAULT NULL)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    new_generation bigint := nextval('semantic_cache.cache_generation');
+    channel text;
+BEGIN
+    -- GREATEST keeps the newer cutoff when two invalidations commit out of order
+    IF tag IS NULL THEN
+        INSERT INTO semantic_cache.cache_config (key, value)
+        VALUES ('invalidated_generation', new_generation::text)
+        ON CONFLICT ON CONSTRAINT cache_config_pkey DO UPDATE
+        SET value = GREATEST(semantic_cache.cache_config.value::bigint,
+                             EXCLUDED.value::bigint)::text;
+    ELSE
+        INSERT INTO semantic_cache.cache_invalidation_cutoffs (tag, generation)
+        VALUES (tag, new_generation)
+        ON CONFLICT ON CONSTRAINT cache_invalidation_cutoffs_pkey DO UPDATE
+        SET generation = GREATEST(semantic_cache.cache_invalidation_cutoffs.generation,
+                                  EXCLUDED.generation),
+            invalidated_at = NOW();
+    END IF;
+
+    -- Application-side caches (see enable_invalidation_notify()) hear about it now
+    SELECT value INTO channel
+    FROM semantic_cache.cache_config
+    WHERE key = 'notify_channel';
+
+    IF channel IS NOT NULL THEN
+        PERFORM pg_notify(channel, CASE
+            WHEN tag IS NULL THEN json_build_object('generation', new_generation, 'flush', true)
+            ELSE json_build_object('generation', new_generation, 'tags', ARRAY[tag])
+        END::text);
+    END IF;
+
+    RETURN new_generation;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; auto_evict() runs one batch too
+CREATE FUNCTION collect_invalidated(batch_size integer DEFAULT 10000)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    live_generation bigint;
+    cutoff_tags text[];
+    deleted bigint;
+BEGIN
+    SELECT COALESCE(MAX(value::bigint), 0) INTO live_generation
+    FROM semantic_cache.cache_config
+    WHERE key = 'invalidated_generation';
+
+    SELECT array_agg(c.tag) INTO cutoff_tags
+    FROM semantic_cache.cache_invalidation_cutoffs c;
+
+    PERFORM set_config('semantic_cache.collecting', 'on', true);
+
+    -- Candidates come from idx_cache_generation and idx_cache_tags
+    DELETE FROM semantic_cache.cache_entries
+    WHERE id IN (
+        SELECT ce.id
+        FROM semantic_cache.cache_entries ce
+        WHERE (ce.generation < live_generation OR ce.tags && cutoff_tags)
+          AND semantic_cache.generation_invalidated(ce.generation, ce.tags)
+        LIMIT batch_size
+        FOR UPDATE SKIP LOCKED
+    );
+    GET DIAGNOSTICS deleted = ROW_COUNT;
+
+    PERFORM set_config('semantic_cache.collecting', 'off', true);
+
+    -- A tag cutoff is no longer needed once nothing it covers is left.  Entries
+    -- written later get newer generations; the hour leaves room for writes that
+    -- took their generation before the cutoff but had not committed yet.
+    IF deleted < batch_size THEN
+        DELETE FROM semantic_cache.cache_invalidation_cutoffs c
+        WHERE c.invalidated_at < NOW() - interval '1 hour'
+          AND NOT EXISTS (
+              SELECT 1 FROM semantic_cache.cache_entries ce
+              WHERE ce.tags @> ARRAY[c.tag] AND ce.generation < c.generation
+          );
+    END IF;
+
+    RETURN deleted;
+END;
+$$;
+
+-- ============================================================================
+-- EXACT LOOKUP FUNCTIONS
+-- Note: The hash filter is a bloom filter over cache_entries.query_hash in
+--       shared memory (pg_semantic_cache.hash_filter_kb, needs
+--       shared_preload_libraries).  It only gains bits, so deleted entries
+--       linger until rebuild_hash_filter(); it serves one database at a time
+--       and is bypassed elsewhere and on standbys
+-- ============================================================================
+
+-- Internal: adds an entry arriving by cache sync to the hash filter
+CREATE FUNCTION hash_filter_add(query_hash text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'hash_filter_add'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- Note: Implemented in C; locks out cache_query() while it scans cache_entries.
+--       auto_evict() runs it every hash_filter_rebuild_seconds
+CREATE FUNCTION rebuild_hash_filter()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'rebuild_hash_filter'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Note: Implemented in C; a definite miss from the hash filter skips the table.
+--       Writes nothing, so lookups are not counted in cache_metadata
+CREATE FUNCTION get_cached_exact(
+    query_text text,
+    max_age_seconds integer DEFAULT NULL,
+    OUT found boolean,
+    OUT result_data jsonb,
+    OUT age_seconds integer,
+    OUT cache_id bigint,
+    OUT negative boolean
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'get_cached_exact'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION hash_filter_stats(
+    OUT enabled boolean,
+    OUT built boolean,
+    OUT memory_bytes bigint,
+    OUT bits bigint,
+    OUT hash_functions integer,
+    OUT fill_ratio float8,
+    OUT estimated_false_positive_rate float8,
+    OUT lookups bigint,
+    OUT definite_misses bigint,
+    OUT false_positives bigint,
+    OUT hits bigint,
+    OUT rebuilt_at timestamptz
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'hash_filter_stats'
+LANGUAGE C PARALLEL SAFE;
+
+-- ============================================================================
+-- PQ LOOKUP FUNCTIONS
+-- Note: With a codebook in cache_pq_codebook, every entry also has a few bytes
+--       of product-quantization codes in cache_pq_codes.  get_cached_result()
+--       scans those instead of the vector index and re-ranks the best
+--       pq_rerank candidates against the full embeddings
+-- ============================================================================
+
+-- Internal: trains cache_pq_codebook from a sample of cache_entries
+CREATE FUNCTION train_pq_codebook(
+    subspaces integer,
+    sample_size integer,
+    iterations integer
+)
+RETURNS integer
+AS 'MODULE_PATHNAME', 'train_pq_codebook'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Internal: PQ codes of an embedding, NULL without a codebook
+CREATE FUNCTION pq_encode(query_embedding text)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pq_encode'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- Internal: ids of the n live entries in the given partitions whose codes score
+-- best, NULL without a codebook
+CREATE FUNCTION pq_candidates(
+    query_embedding text,
+    n integer,
+    probe_clusters integer[],
+    grace_seconds integer DEFAULT 0,
+    min_generation bigint DEFAULT 0
+)
+RETURNS bigint[]
+AS 'MODULE_PATHNAME', 'pq_candidates'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- Trigger on cache_entries (installed by enable_pq_lookup()): drops the codes
+-- of deleted entries
+CREATE FUNCTION pq_forget_entries()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF TG_OP = 'TRUNCATE' THEN
+        TRUNCATE semantic_cache.cache_pq_codes;
+    ELSE
+        DELETE FROM semantic_cache.cache_pq_codes
+        WHERE cache_id IN (SELECT id FROM deleted_entries);
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns the number of entries encoded.
+--       Call it again to retrain once the cached embeddings have drifted
+CREATE FUNCTION enable_pq_lookup(
+    subspaces integer DEFAULT NULL,
+    sample_size integer DEFAULT 10000,
+    iterations integer DEFAULT 10
+)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    encoded bigint;
+BEGIN
+    PERFORM semantic_cache.train_pq_codebook(subspaces, sample_size, iterations);
+
+    TRUNCATE semantic_cache.cache_pq_codes;
+
+    INSERT INTO semantic_cache.cache_pq_codes (cache_id, cluster_id, expires_at, is_negative, generation,
+                                               codebook_version, codes)
+    SELECT ce.id, ce.cluster_id, ce.expires_at, ce.is_negative, ce.generation,
+           (SELECT MAX(version) FROM semantic_cache.cache_pq_codebook),
+           semantic_cache.pq_encode(ce.query_embedding::text)
+    FROM semantic_cache.cache_entries ce;
+    GET DIAGNOSTICS encoded = ROW_COUNT;
+
+    -- Deletes replicated by cache sync run as replica, hence ENABLE ALWAYS
+    IF NOT EXISTS (SELECT 1 FROM pg_trigger
+                   WHERE tgrelid = 'semantic_cache.cache_entries'::regclass
+                     AND tgname = 'cache_pq_delete') THEN
+        CREATE TRIGGER cache_pq_delete
+            AFTER DELETE ON semantic_cache.cache_entries
+            REFERENCING OLD TABLE AS deleted_entries
+            FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.pq_forget_entries();
+        CREATE TRIGGER cache_pq_truncate
+            AFTER TRUNCATE ON semantic_cache.cache_entries
+            FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.pq_forget_entries();
+
+        ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_pq_delete;
+        ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_pq_truncate;
+    END IF;
+
+    RETURN encoded;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL
+CREATE FUNCTION disable_pq_lookup()
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    DROP TRIGGER IF EXISTS cache_pq_delete ON semantic_cache.cache_entries;
+    DROP TRIGGER IF EXISTS cache_pq_truncate ON semantic_cache.cache_entries;
+
+    TRUNCATE semantic_cache.cache_pq_codebook, semantic_cache.cache_pq_codes;
+END;
+$$;
+
+-- Note: Implemented in SQL; encodes entries neither cache_query() nor cache sync
+--       did, such as ones inserted directly, and re-encodes codes left from an
+--       older codebook by writers that raced a retraining.  auto_evict() runs
+--       one batch
+CREATE FUNCTION pq_encode_pending(batch_size integer DEFAULT 10000)
+RETURNS bigint
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    WITH encoded AS (
+        INSERT INTO semantic_cache.cache_pq_codes (cache_id, cluster_id, expires_at, is_negative, generation,
+                                                   codebook_version, codes)
+        SELECT ce.id, ce.cluster_id, ce.expires_at, ce.is_negative, ce.generation, cb.version,
+               semantic_cache.pq_encode(ce.query_embedding::text)
+        FROM semantic_cache.cache_entries ce,
+             (SELECT MAX(version) AS version FROM semantic_cache.cache_pq_codebook) cb
+        WHERE cb.version IS NOT NULL
+          AND NOT EXISTS (SELECT 1 FROM semantic_cache.cache_pq_codes c
+                          WHERE c.cache_id = ce.id AND c.codebook_version = cb.version)
+        LIMIT batch_size
+        ON CONFLICT (cache_id) DO UPDATE SET
+            codebook_version = EXCLUDED.codebook_version,
+            codes = EXCLUDED.codes
+        RETURNING 1
+    )
+    SELECT COUNT(*)::bigint FROM encoded;
+$$;
+
+-- ============================================================================
+-- SPLIT STORAGE FUNCTIONS
+-- Note: With storage_fillfactor set in cache_config, a cache_entries row that
+--       outgrows 2 KB has query_text, result_data and query_embedding
+--       moved to TOAST storage while query_hash, tags and the expiry and
+--       access columns stay in the heap row.  Every page keeps room for HOT
+--       updates of access_count and last_accessed_at; the embedding has to go
+--       too, as a row carrying a full-size vector inline leaves no room for a
+--       second version on its page
+-- ============================================================================
+
+-- Internal: applies the storage_fillfactor setting to a cache_entries table
+-- and its partitions.  Without it, columns and tables return to the defaults
+CREATE FUNCTION apply_storage_options(rel regclass)
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    fill integer;
+    col record;
+    leaf regclass;
+BEGIN
+    SELECT value::integer INTO fill
+    FROM semantic_cache.cache_config
+    WHERE key = 'storage_fillfactor';
+
+    -- PLAIN and MAIN keep a column in the heap row.  The embedding is stored
+    -- EXTERNAL (out of line, uncompressed, as vectors hardly compress) and
+    -- the payload columns keep their EXTENDED default
+    FOR col IN
+        SELECT a.attname, t.typstorage
+        FROM pg_attribute a
+        JOIN pg_type t ON t.oid = a.atttypid
+        WHERE a.attrelid = rel
+          AND a.attname IN ('query_hash', 'query_embedding', 'tags')
+        ORDER BY a.attnum
+    LOOP
+        EXECUTE format('ALTER TABLE %s ALTER COLUMN %I SET STORAGE %s', rel, col.attname,
+                       CASE WHEN fill IS NOT NULL AND col.attname = 'query_hash' THEN 'PLAIN'
+                            WHEN fill IS NOT NULL AND col.attname = 'query_embedding' THEN 'EXTERNAL'
+                            WHEN fill IS NOT NULL THEN 'MAIN'
+                            WHEN col.typstorage = 'p' THEN 'PLAIN'
+                            WHEN col.typstorage = 'm' THEN 'MAIN'
+                            WHEN col.typstorage = 'e' THEN 'EXTERNAL'
+                            ELSE 'EXTENDED' END);
+    END LOOP;
+
+    -- Partitioned tables take no storage parameters, their partitions do
+    FOR leaf IN
+        SELECT relid FROM pg_partition_tree(rel) WHERE isleaf
+    LOOP
+        IF fill IS NULL THEN
+            EXECUTE format('ALTER TABLE %s RESET (fillfactor, toast_tuple_target)', leaf);
+        ELSE
+            EXECUTE format('ALTER TABLE %s SET (fillfactor = %s, toast_tuple_target = 128)', leaf, fill);
+        END IF;
+    END LOOP;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns the number of entries moved.  Rows keep
+--       the layout they were written with, so the table is rebuilt
+CREATE FUNCTION enable_split_storage(fillfactor integer DEFAULT 80)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF fillfactor IS NULL OR fillfactor < 10 OR fillfactor > 100 THEN
+        RAISE EXCEPTION 'enable_split_storage: fillfactor must be between 10 and 100';
+    END IF;
+
+    INSERT INTO semantic_cache.cache_config (key, value)
+    VALUES ('storage_fillfactor', fillfactor::text)
+    ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;
+
+    RETURN semantic_cache.rebuild_cache_layout(
+        (SELECT COUNT(*)::integer FROM semantic_cache.cache_centroids));
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns the number of entries moved
+CREATE FUNCTION disable_split_storage()
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    DELETE FROM semantic_cache.cache_config WHERE key = 'storage_fillfactor';
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'disable_split_storage: split storage is not enabled';
+    END IF;
+
+    RETURN semantic_cache.rebuild_cache_layout(
+        (SELECT COUNT(*)::integer FROM semantic_cache.cache_centroids));
+END;
+$$;
+
+-- ============================================================================
+-- HYBRID LOOKUP FUNCTIONS
+-- Note: enable_lexical_lookup() adds cache_entries.query_tsv, a stored
+--       tsvector generated from query_text, with a GIN index.  Hybrid lookups
+--       take candidates from both indexes and score them on vector similarity
+--       and lexical overlap together
+-- ============================================================================
+
+-- Internal: share of the query's lexemes that occur in an entry's query_tsv
+CREATE FUNCTION lexical_overlap(entry tsvector, query_lexemes text[])
+RETURNS float8
+LANGUAGE sql IMMUTABLE PARALLEL SAFE
+AS $$
+    SELECT COUNT(*)::float8 / NULLIF(cardinality(query_lexemes), 0)
+    FROM unnest(query_lexemes) l
+    WHERE l = ANY(tsvector_to_array(entry))
+$$;
+
+-- Note: Implemented in PL/pgSQL; rewrites cache_entries once to fill the column.
+--       Calling it again switches the text search configuration
+CREATE FUNCTION enable_lexical_lookup(config regconfig DEFAULT 'simple')
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF config IS NULL THEN
+        RAISE EXCEPTION 'enable_lexical_lookup: config must not be NULL';
+    END IF;
+
+    ALTER TABLE semantic_cache.cache_entries DROP COLUMN IF EXISTS query_tsv;
+    EXECUTE format('ALTER TABLE semantic_cache.cache_entries '
+                   'ADD COLUMN query_tsv tsvector GENERATED ALWAYS AS (to_tsvector(%L::regconfig, query_text)) STORED',
+                   config::text);
+    CREATE INDEX idx_cache_query_tsv ON semantic_cache.cache_entries USING gin (query_tsv);
+
+    INSERT INTO semantic_cache.cache_config (key, value)
+    VALUES ('lexical_config', config::text)
+    ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;
+END;
+$$;
+
+CREATE FUNCTION disable_lexical_lookup()
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    DELETE FROM semantic_cache.cache_config WHERE key = 'lexical_config';
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'disable_lexical_lookup: lexical lookup is not enabled';
+    END IF;
+
+    ALTER TABLE semantic_cache.cache_entries DROP COLUMN IF EXISTS query_tsv;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; the candidates are the hybrid_candidates nearest
+--       entries from the vector index together with the hybrid_candidates entries
+--       that rank best on the query's lexemes in the GIN index.  Each is scored as
+--       (1 - lexical_weight) * similarity + lexical_weight * lexical overlap.
+--       The best one is a hit when its score reaches similarity_threshold; on a
+--       miss its scores are still returned.  Expired entries are never served
+--       stale, and hits and misses are counted like get_cached_result()'s
+CREATE FUNCTION get_cached_hybrid(
+    query_text text,
+    query_embedding text,
+    similarity_threshold float4 DEFAULT 0.9,
+    lexical_weight float4 DEFAULT 0.5,
+    max_age_seconds integer DEFAULT NULL
+)
+RETURNS TABLE(
+    found boolean,
+    result_data jsonb,
+    similarity_score float4,
+    lexical_score float4,
+    hybrid_score float4,
+    age_seconds integer,
+    cache_id bigint,
+    negative boolean
+)
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    query_vec vector := query_embedding::vector;
+    metric text;
+    lexical_config regconfig;
+    read_only boolean;
+    live_generation bigint;
+    candidates integer;
+    cutoff_tags text[];
+    cutoff_generations bigint[];
+    query_lexemes text[];
+    prefilter tsquery;
+    best_id bigint;
+    best_result jsonb;
+    best_similarity float8;
+    best_overlap float8;
+    best_score float8;
+    best_age integer;
+    best_negative boolean;
+    hit boolean;
+    -- Entries that may be served
+    live_filter text :=
+        '(ce.expires_at IS NULL OR ce.expires_at > NOW()) '
+        'AND ce.generation >= $6 '
+        'AND ($7::text[] IS NULL OR NOT EXISTS ( '
+        '        SELECT 1 FROM unnest($7::text[], $8::bigint[]) cut(tag, generation) '
+        '        WHERE cut.tag = ANY(ce.tags) AND ce.generation < cut.generation)) '
+        'AND ($9::integer IS NULL OR EXTRACT(EPOCH FROM (NOW() - ce.created_at)) <= $9)';
+    -- Best candidate by hybrid score, with distance %1$s and filter %2$s.  The
+    -- distance is written out so the vector index answers the nearest entries
+    hybrid_sql text :=
+        'WITH semantic AS ( '
+        '    SELECT ce.id FROM semantic_cache.cache_entries ce '
+        '    WHERE %2$s '
+        '    ORDER BY %1$s '
+        '    LIMIT $10 '
+        '), lexical AS ( '
+        '    SELECT ce.id FROM semantic_cache.cache_entries ce '
+        '    WHERE ce.query_tsv @@ $4 AND %2$s '
+        '    ORDER BY ts_rank(ce.query_tsv, $4) DESC '
+        '    LIMIT $10 '
+        ') '
+        'SELECT scored.id, scored.result_data, scored.similarity, scored.overlap, '
+        '       (1 - $11) * scored.similarity + $11 * scored.overlap AS score, '
+        '       scored.age_seconds, scored.is_negative '
+        'FROM ( '
+        '    SELECT ce.id, ce.result_data, '
+        '           semantic_cache.metric_similarity(%1$s, $2, $3) AS similarity, '
+        '           COALESCE(semantic_cache.lexical_overlap(ce.query_tsv, $5), 0) AS overlap, '
+        '           EXTRACT(EPOCH FROM (NOW() - ce.created_at))::integer AS age_seconds, '
+        '           ce.is_negative '
+        '    FROM semantic_cache.cache_entries ce '
+        '    WHERE ce.id IN (SELECT id FROM semantic UNION SELECT id FROM lexical) '
+        ') scored '
+        'ORDER BY score DESC, scored.id '
+        'LIMIT 1';
+BEGIN
+    IF lexical_weight IS NULL OR lexical_weight < 0 OR lexical_weight > 1 THEN
+        RAISE EXCEPTION 'get_cached_hybrid: lexical_weight must be between 0 and 1';
+    END IF;
+
+    SELECT
+        COALESCE(MAX(CASE WHEN key = 'distance_metric' THEN value END), 'cosine'),
+        MAX(CASE WHEN key = 'lexical_config' THEN value END)::regconfig,
+        COALESCE(MAX(CASE WHEN key = 'lookup_mode' THEN value END), 'auto') = 'read_only',
+        COALESCE(MAX(CASE WHEN key = 'invalidated_generation' THEN value::bigint END), 0),
+        COALESCE(MAX(CASE WHEN key = 'hybrid_candidates' THEN GREATEST(value::integer, 1) END), 50)
+    INTO metric, lexical_config, read_only, live_generation, candidates
+    FROM semantic_cache.cache_config
+    WHERE key IN ('distance_metric', 'lexical_config', 'lookup_mode', 'invalidated_generation',
+                  'hybrid_candidates');
+
+    IF lexical_config IS NULL THEN
+        RAISE EXCEPTION 'get_cached_hybrid: lexical lookup is not enabled, call enable_lexical_lookup() first';
+    END IF;
+
+    IF metric = 'cosine' THEN
+        query_vec := semantic_cache.unit_vector(query_vec);
+    END IF;
+
+    SELECT array_agg(c.tag), array_agg(c.generation)
+    INTO cutoff_tags, cutoff_generations
+    FROM semantic_cache.cache_invalidation_cutoffs c;
+
+    read_only := read_only OR pg_is_in_recovery() OR current_setting('transaction_read_only')::boolean;
+
+    -- Entries sharing a lexeme are ranked with ts_rank() and cut to
+    -- hybrid_candidates, so a lexeme most entries contain (a stopword under
+    -- 'simple') cannot flood the set.  Semantic neighbours come from the
+    -- vector index whether or not they share a word
+    query_lexemes := tsvector_to_array(to_tsvector(lexical_config, query_text));
+    SELECT string_agg(format('''%s''', replace(replace(l, '\', '\\'), '''', '''''')), ' | ')::tsquery
+    INTO prefilter
+    FROM unnest(query_lexemes) l;
+
+    EXECUTE format(hybrid_sql, semantic_cache.metric_distance_sql(metric, vector_dims(query_vec)),
+                   live_filter)
+    INTO best_id, best_result, best_similarity, best_overlap, best_score, best_age, best_negative
+    USING query_vec, metric, vector_dims(query_vec), prefilter, query_lexemes,
+          live_generation, cutoff_tags, cutoff_generations, max_age_seconds,
+          candidates, lexical_weight::float8;
+
+    hit := COALESCE(best_score >= similarity_threshold, false);
+
+    IF read_only THEN
+        PERFORM semantic_cache.note_readonly_lookup(hit, hit AND best_negative, NULL);
+    ELSIF hit AND best_negative THEN
+        UPDATE semantic_cache.cache_metadata
+        SET total_negative_hits = total_negative_hits + 1
+        WHERE id = 1;
+    ELSIF hit THEN
+        UPDATE semantic_cache.cache_metadata
+        SET total_hits = total_hits + 1
+        WHERE id = 1;
+    ELSE
+        UPDATE semantic_cache.cache_metadata
+        SET total_misses = total_misses + 1
+        WHERE id = 1;
+    END IF;
+
+    RETURN QUERY SELECT
+        hit,
+        CASE WHEN hit AND NOT best_negative THEN best_result END,
+        best_similarity::float4,
+        best_overlap::float4,
+        best_score::float4,
+        CASE WHEN hit THEN best_age END,
+        CASE WHEN hit THEN best_id END,
+        hit AND best_negative;
+END;
+$$;
+
+-- ============================================================================
+-- PARAPHRASE EMBEDDINGS
+-- Note: cache_entry_aliases holds extra embeddings of cache entries, such as
+--       those of paraphrases confirmed to have the same answer.  They share
+--       their entry's payload, expiry and tags, are deleted with it, and are
+--       searched by get_cached_result() when no entry matches
+-- ============================================================================
+
+-- Trigger on cache_entries (installed by attach_embedding()): drops the
+-- paraphrase embeddings of deleted entries
+CREATE FUNCTION forget_entry_aliases()
+RETURNS trigger
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+BEGIN
+    IF TG_OP = 'TRUNCATE' THEN
+        TRUNCATE semantic_cache.cache_entry_aliases;
+    ELSE
+        DELETE FROM semantic_cache.cache_entry_aliases
+        WHERE cache_id IN (SELECT id FROM deleted_entries);
+    END IF;
+
+    RETURN NULL;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns the id of the attached embedding, or of
+--       an identical one already attached to the entry.  Embeddings are
+--       normalized like the entries' under the cosine distance_metric
+CREATE FUNCTION attach_embedding(cache_id bigint, query_embedding text)
+RETURNS bigint
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    vec vector := query_embedding::vector;
+    alias_id bigint;
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM semantic_cache.cache_entries ce
+                   WHERE ce.id = attach_embedding.cache_id) THEN
+        RAISE EXCEPTION 'attach_embedding: cache entry % does not exist', attach_embedding.cache_id;
+    END IF;
+
+    IF COALESCE((SELECT value FROM semantic_cache.cache_config WHERE key = 'distance_metric'),
+                'cosine') = 'cosine' THEN
+        vec := semantic_cache.unit_vector(vec);
+    END IF;
+
+    -- Deletes replicated by cache sync run as replica, hence ENABLE ALWAYS
+    IF NOT EXISTS (SELECT 1 FROM pg_trigger
+                   WHERE tgrelid = 'semantic_cache.cache_entries'::regclass
+                     AND tgname = 'cache_alias_delete') THEN
+        CREATE TRIGGER cache_alias_delete
+            AFTER DELETE ON semantic_cache.cache_entries
+            REFERENCING OLD TABLE AS deleted_entries
+            FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.forget_entry_aliases();
+        CREATE TRIGGER cache_alias_truncate
+            AFTER TRUNCATE ON semantic_cache.cache_entries
+            FOR EACH STATEMENT EXECUTE FUNCTION semantic_cache.forget_entry_aliases();
+
+        ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_alias_delete;
+        ALTER TABLE semantic_cache.cache_entries ENABLE ALWAYS TRIGGER cache_alias_truncate;
+    END IF;
+
+    SELECT a.id INTO alias_id
+    FROM semantic_cache.cache_entry_aliases a
+    WHERE a.cache_id = attach_embedding.cache_id
+      AND a.query_embedding = vec;
+
+    IF alias_id IS NULL THEN
+        INSERT INTO semantic_cache.cache_entry_aliases (cache_id, query_embedding)
+        VALUES (attach_embedding.cache_id, vec)
+        RETURNING id INTO alias_id;
+    END IF;
+
+    RETURN alias_id;
+END;
+$$;
+
+-- ============================================================================
+-- EMBEDDING MEMO FUNCTIONS
+-- Note: cache_embedding_memo maps (model, hash of the normalized query text) to
+--       the embedding the model produced, so clients can skip the model call for
+--       texts seen before.  cache_query() and cache_negative() fill it under
+--       embedding_model; entries last for memo_ttl_seconds and at most
+--       memo_max_entries are kept, least recently used first out
+-- ============================================================================
+
+-- Internal: memo key of a query text; case and runs of whitespace are ignored
+CREATE FUNCTION memo_key(query_text text)
+RETURNS text
+LANGUAGE sql IMMUTABLE STRICT PARALLEL SAFE
+AS $$
+    SELECT md5(lower(regexp_replace(btrim(query_text), '\s+', ' ', 'g')))
+$$;
+
+-- Note: Implemented in PL/pgSQL; returns false when the memo is disabled
+--       (memo_max_entries = 0).  model defaults to embedding_model
+CREATE FUNCTION remember_embedding(
+    query_text text,
+    embedding text,
+    model text DEFAULT NULL
+)
+RETURNS boolean
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    memo_model text;
+    ttl integer;
+    max_entries bigint;
+BEGIN
+    SELECT
+        COALESCE(MAX(CASE WHEN key = 'embedding_model' THEN value END), 'default'),
+        COALESCE(MAX(CASE WHEN key = 'memo_ttl_seconds' THEN GREATEST(value::integer, 0) END), 86400),
+        COALESCE(MAX(CASE WHEN key = 'memo_max_entries' THEN GREATEST(value::bigint, 0) END), 100000)
+    INTO memo_model, ttl, max_entries
+    FROM semantic_cache.cache_config
+    WHERE key IN ('embedding_model', 'memo_ttl_seconds', 'memo_max_entries');
+
+    IF max_entries = 0 OR query_text IS NULL OR embedding IS NULL THEN
+        RETURN false;
+    END IF;
+
+    INSERT INTO semantic_cache.cache_embedding_memo AS m
+        (model, text_hash, embedding, expires_at)
+    VALUES (COALESCE(remember_embedding.model, memo_model),
+            semantic_cache.memo_key(query_text),
+            embedding::vector,
+            CASE WHEN ttl > 0 THEN NOW() + make_interval(secs => ttl) END)
+    ON CONFLICT ON CONSTRAINT cache_embedding_memo_pkey DO UPDATE SET
+        embedding = EXCLUDED.embedding,
+        last_used_at = NOW(),
+        expires_at = EXCLUDED.expires_at;
+
+    RETURN true;
+END;
+$$;
+
+-- Note: Implemented in PL/pgSQL; one row per input text, in order, with a NULL
+--       embedding for texts not in the memo.  Hits refresh last_used_at at most
+--       once a minute, and not at all on a standby or in a read-only transaction
+CREATE FUNCTION get_embeddings(
+    query_texts text[],
+    model text DEFAULT NULL
+)
+RETURNS TABLE(
+    ord integer,
+    query_text text,
+    embedding vector
+)
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    memo_model text := get_embeddings.model;
+BEGIN
+    IF memo_model IS NULL THEN
+        SELECT COALESCE(MAX(value), 'default') INTO memo_model
+        FROM semantic_cache.cache_config
+        WHERE key = 'embedding_model';
+    END IF;
+
+    IF NOT (pg_is_in_recovery() OR current_setting('transaction_read_only')::boolean) THEN
+        UPDATE semantic_cache.cache_embedding_memo m
+        SET last_used_at = NOW()
+        WHERE m.model = memo_model
+          AND m.text_hash = ANY(ARRAY(SELECT semantic_cache.memo_key(t) FROM unnest(query_texts) t))
+          AND m.last_used_at < NOW() - interval '1 minute'
+          AND (m.expires_at IS NULL OR m.expires_at > NOW());
+    END IF;
+
+    RETURN QUERY
+    SELECT q.n::integer, q.t, m.embedding
+    FROM unnest(query_texts) WITH ORDINALITY q(t, n)
+    LEFT JOIN semantic_cache.cache_embedding_memo m
+           ON m.model = memo_model
+          AND m.text_hash = semantic_cache.memo_key(q.t)
+          AND (m.expires_at IS NULL OR m.expires_at > NOW())
+    ORDER BY q.n;
+END;
+$$;
+
+-- Note: Implemented in SQL as a convenience wrapper over get_embeddings()
+CREATE FUNCTION get_embedding(query_text text, model text DEFAULT NULL)
+RETURNS vector
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    SELECT e.embedding FROM semantic_cache.get_embeddings(ARRAY[query_text], model) e
+$$;
+
+-- Note: Implemented in SQL; removes expired memo entries, then the least recently
+--       used beyond memo_max_entries.  auto_evict() runs it
+CREATE FUNCTION evict_embedding_memo()
+RETURNS bigint
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    WITH expired AS (
+        DELETE FROM semantic_cache.cache_embedding_memo
+        WHERE expires_at <= NOW()
+        RETURNING model, text_hash
+    ),
+    overflow AS (
+        DELETE FROM semantic_cache.cache_embedding_memo m
+        WHERE (m.model, m.text_hash) IN (
+            SELECT o.model, o.text_hash
+            FROM semantic_cache.cache_embedding_memo o
+            WHERE (o.model, o.text_hash) NOT IN (SELECT model, text_hash FROM expired)
+            ORDER BY o.last_used_at DESC
+            OFFSET (SELECT COALESCE(MAX(GREATEST(value::bigint, 0)), 100000)
+                    FROM semantic_cache.cache_config
+                    WHERE key = 'memo_max_entries')
+        )
+        RETURNING 1
+    )
+    SELECT (SELECT COUNT(*) FROM expired) + (SELECT COUNT(*) FROM overflow)
+$$;
+
+-- ============================================================================
+-- EMBEDDING PROVIDER FUNCTIONS
+-- Note: set_embedding_provider() registers a function embedding a text in the
+--       database, such as a model in a C extension or a local stand-in.  The
+--       _by_text variants embed through it, memoized in cache_embedding_memo,
+--       and run the cache operation in the same call
+-- ============================================================================
+
+-- Note: Implemented in PL/pgSQL; the provider takes one text argument and returns
+--       vector, real[] or text.  Its signature becomes embedding_model, so the
+--       memo never serves another model's embeddings, and the memo entries of
+--       the previous model are evicted.  NULL unregisters it
+CREATE FUNCTION set_embedding_provider(provider regprocedure)
+RETURNS void
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    previous_model text;
+BEGIN
+    SELECT COALESCE(MAX(value), 'default') INTO previous_model
+    FROM semantic_cache.cache_config
+    WHERE key = 'embedding_model';
+
+    IF provider IS NULL THEN
+        -- Only a model name set by the provider itself goes with it
+        DELETE FROM semantic_cache.cache_config
+        WHERE key = 'embedding_model'
+          AND value = (SELECT value FROM semantic_cache.cache_config WHERE key = 'embedding_provider');
+        DELETE FROM semantic_cache.cache_config WHERE key = 'embedding_provider';
+        RETURN;
+    END IF;
+
+    IF NOT EXISTS (
+        SELECT 1 FROM pg_proc p
+        WHERE p.oid = provider
+          AND p.prokind = 'f'
+          AND NOT p.proretset
+          AND p.pronargs = 1
+          AND p.proargtypes[0] = 'text'::regtype
+          AND p.prorettype IN ('vector'::regtype, 'real[]'::regtype, 'text'::regtype)
+    ) THEN
+        RAISE EXCEPTION 'set_embedding_provider: % must take one text argument and return vector, real[] or text',
+            provider;
+    END IF;
+
+    INSERT INTO semantic_cache.cache_config (key, value)
+    VALUES ('embedding_provider', provider::text),
+           ('embedding_model', provider::text)
+    ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;
+
+    IF previous_model <> provider::text THEN
+        DELETE FROM semantic_cache.cache_embedding_memo WHERE model = previous_model;
+    END IF;
+END;
+$$;
+
+CREATE FUNCTION get_embedding_provider()
+RETURNS regprocedure
+LANGUAGE sql STABLE PARALLEL SAFE
+AS $$
+    SELECT value::regprocedure
+    FROM semantic_cache.cache_config
+    WHERE key = 'embedding_provider'
+$$;
+
+-- Note: Implemented in PL/pgSQL; one row per input text, in order.  The provider
+--       runs once per distinct text missing from the memo, and its embeddings
+--       are memoized under embedding_model
+CREATE FUNCTION embed_texts(query_texts text[])
+RETURNS TABLE(
+    ord integer,
+    query_text text,
+    embedding vector
+)
+LANGUAGE plpgsql PARALLEL UNSAFE
+AS $$
+DECLARE
+    provider regprocedure := semantic_cache.get_embedding_provider();
+    call_sql text;
+    missing text;
+    vec vector;
+    computed_keys text[] := '{}';
+    computed vector[] := '{}';
+BEGIN
+    IF provider IS NULL THEN
+        RAISE EXCEPTION 'embed_texts: no embedding provider, call set_embedding_provider() first';
+    END IF;
+
+    SELECT format('SELECT %I.%I($1)::vector', n.nspname, p.proname) INTO call_sql
+    FROM pg_proc p
+    JOIN pg_namespace n ON n.oid = p.pronamespace
+    WHERE p.oid = provider;
+
+    FOR missing IN
+        SELECT DISTINCT ON (semantic_cache.memo_key(e.query_text)) e.query_text
+        FROM semantic_cache.get_embeddings(query_texts) e
+        WHERE e.embedding IS NULL
+          AND e.query_text IS NOT NULL
+    LOOP
+        EXECUTE call_sql INTO vec USING missing;
+
+        IF vec IS NULL THEN
+            RAISE EXCEPTION 'embed_texts: % returned NULL for "%"', provider, missing;
+        END IF;
+
+        PERFORM semantic_cache.remember_embedding(missing, vec::text);
+        computed_keys := computed_keys || semantic_cache.memo_key(missing);
+        computed := computed || vec;
+    END LOOP;
+
+    -- Computed embeddings are returned even when the memo is disabled
+    RETURN QUERY
+    SELECT e.ord, e.query_text, COALESCE(e.embedding, c.embedding)
+    FROM semantic_cache.get_embeddings(query_texts) e
+    LEFT JOIN unnest(computed_keys, computed) AS c(text_hash, embedding)
+           ON c.text_hash = semantic_cache.memo_key(e.query_text)
+    ORDER BY e.ord;
+END;
+$$;
+
+-- Note: Implemented in SQL as a convenience wrapper over embed_texts()
+CREATE FUNCTION embed_text(query_text text)
+RETURNS vector
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    SELECT e.embedding FROM semantic_cache.embed_texts(ARRAY[query_text]) e
+$$;
+
+-- Note: Implemented in SQL; get_cached_result() on the provider's embedding
+CREATE FUNCTION get_cached_result_by_text(
+    query_text text,
+    similarity_threshold float4 DEFAULT 0.95,
+    max_age_seconds integer DEFAULT NULL
+)
+RETURNS TABLE(
+    found boolean,
+    result_data jsonb,
+    similarity_score float4,
+    age_seconds integer,
+    cache_id bigint,
+    stale boolean,
+    refresh_lease boolean,
+    negative boolean
+)
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    SELECT * FROM semantic_cache.get_cached_result(
+        semantic_cache.embed_text(query_text)::text, similarity_threshold, max_age_seconds)
+$$;
+
+-- Note: Implemented in SQL; cache_query() with the provider's embedding
+CREATE FUNCTION cache_query_by_text(
+    query_text text,
+    result_data jsonb,
+    ttl_seconds integer DEFAULT 3600,
+    tags text[] DEFAULT NULL
+)
+RETURNS bigint
+LANGUAGE sql PARALLEL UNSAFE
+AS $$
+    SELECT semantic_cache.cache_query(
+        query_text, semantic_cache.embed_text(query_text)::text, result_data, ttl_seconds, tags)
+$$;
+
+-- ============================================================================
+-- HEALTH GAUGES
+-- Note: With shared_preload_libraries, the cache_health view reads entry
+--       counts kept in shared memory instead of scanning cache_entries.
+--       Statement triggers installed by reconcile_cache_gauges() apply each
+--       writer's changes as it commits, and auto_evict() reloads the counts
+--       from the table every gauge_reconcile_seconds.  Like the hash filter,
+--       the gauges serve one database and are bypassed elsewhere and on standbys
+-- ============================================================================
+
+-- Trigger on cache_entries (installed by reconcile_cache_gauges()): counts the
+-- rows each statement changed
+CREATE FUNCTION track_cache_gauges()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'track_cache_gauges'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Note: Implemented in C; locks out writers while it scans cache_entries and
+--       returns NULL when not preloaded.  auto_evict() runs it every
+--       gauge_reconcile_seconds
+CREATE FUNCTION reconcile_cache_gauges()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'reconcile_cache_gauges'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- expired_entries is estimated from a histogram of expiry times
+CREATE FUNCTION cache_gauges(
+    OUT enabled boolean,
+    OUT reconciled boolean,
+    OUT reconciled_at timestamptz,
+    OUT total_entries bigint,
+    OUT expired_entries bigint,
+    OUT size_bytes bigint,
+    OUT access_count bigint,
+    OUT negative_entries bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'cache_gauges'
+LANGUAGE C PARALLEL SAFE;
+
+-- Note: Implemented in PL/pgSQL; the gauges when they serve this database,
+--       otherwise one scan of cache_entries
+CREATE FUNCTION cache_entry_totals()
+RETURNS TABLE(
+    total_entries bigint,
+    expired_entries bigint,
+    size_bytes bigint,
+    avg_access_count numeric,
+    negative_entries bigint
+)
+LANGUAGE plpgsql PARALLEL SAFE
+AS $$
+BEGIN
+    RETURN QUERY
+    SELECT g.total_entries, g.expired_entries,
+           CASE WHEN g.total_entries > 0 THEN g.size_bytes END,
+           g.access_count::numeric / NULLIF(g.total_entries, 0),
+           g.negative_entries
+    FROM semantic_cache.cache_gauges() g
+    WHERE g.reconciled;
+
+    IF NOT FOUND THEN
+        RETURN QUERY
+        SELECT COUNT(*),
+               COUNT(*) FILTER (WHERE ce.expires_at <= NOW()),
+               SUM(ce.result_size_bytes)::bigint,
+               AVG(ce.access_count),
+               COUNT(*) FILTER (WHERE ce.is_negative)
+        FROM semantic_cache.cache_entries ce;
+    END IF;
+END;
+$$;
+
+-- ============================================================================
+-- TOP QUERIES
+-- Note: With shared_preload_libraries, top_cached_queries reads Space-Saving
+--       sketches that log_cache_access() updates on every logged hit, one
+--       ranked by hits and one by cost saved, instead of grouping the whole
+--       access log.  rebuild_top_queries() seeds them from the log, and
+--       auto_evict() repeats that every top_queries_rebuild_seconds so
+--       trimmed log rows drop out.  Like the hash filter, the sketches serve
+--       one database and are bypassed elsewhere and on standbys
+-- ============================================================================
+
+-- Note: Implemented in C; locks out log_cache_access() while it groups the
+--       access log and returns NULL when not preloaded
+CREATE FUNCTION rebuild_top_queries()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'rebuild_top_queries'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- ranking is 'hits' or 'cost_saved'; the true total lies between
+-- estimate - max_error and estimate
+CREATE FUNCTION top_queries(
+    ranking text DEFAULT 'cost_saved',
+    max_rows integer DEFAULT 100
+)
+RETURNS TABLE(
+    query_hash text,
+    estimate float8,
+    max_error float8,
+    hit_count bigint,
+    avg_similarity float8,
+    last_access timestamptz
+)
+AS 'MODULE_PATHNAME', 'top_queries'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION top_queries_stats(
+    OUT enabled boolean,
+    OUT built boolean,
+    OUT rebuilt_at timestamptz,
+    OUT slots integer,
+    OUT queries_by_hits integer,
+    OUT queries_by_cost integer,
+    OUT total_hits bigint,
+    OUT total_cost_saved float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'top_queries_stats'
+LANGUAGE C PARALLEL SAFE;
+
+-- Note: Implemented in PL/pgSQL; the cost sketch when it serves this
+--       database, otherwise one GROUP BY over cache_access_log
+CREATE FUNCTION top_cached_query_totals(max_rows integer DEFAULT 100)
+RETURNS TABLE(
+    query_hash text,
+    hit_count bigint,
+    avg_similarity float8,
+    total_cost_saved numeric,
+    last_access timestamptz,
+    max_error numeric
+)
+LANGUAGE plpgsql PARALLEL SAFE
+AS $$
+BEGIN
+    IF EXISTS (SELECT 1 FROM semantic_cache.top_queries_stats() s WHERE s.built) THEN
+        RETURN QUERY
+        SELECT t.query_hash, t.hit_count, t.avg_similarity,
+               ROUND(t.estimate::numeric, 6), t.last_access,
+               ROUND(t.max_error::numeric, 6)
+        FROM semantic_cache.top_queries('cost_saved', max_rows) t;
+        RETURN;
+    END IF;
+
+    RETURN QUERY
+    SELECT l.query_hash,
+           COUNT(*),
+           AVG(l.similarity_score)::float8,
+           ROUND(SUM(l.cost_saved)::NUMERIC, 6) AS saved,
+           MAX(l.access_time),
+           0::numeric
+    FROM semantic_cache.cache_access_log l
+    WHERE l.cache_hit = true
+    GROUP BY l.query_hash
+    ORDER BY saved DESC
+    LIMIT max_rows;
+END;
+$$;
+
+-- ============================================================================
+-- DISTINCT QUERIES
+-- Note: With shared_preload_libraries, log_cache_access() adds every query
+--       hash to HyperLogLog sketches of the current hour in shared memory,
+--       one over all accesses and one over misses.  auto_evict() merges them
+--       into cache_access_sketches (see flush_access_sketches()), and
+--       distinct_queries() combines the buckets of any window instead of
+--       counting distinct hashes in the access log
+-- ============================================================================
+
+-- Union of two sketches; NULL stands for the empty sketch
+CREATE FUNCTION hll_merge(a bytea, b bytea)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'hll_merge'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION hll_estimate(sketch bytea)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'hll_estimate'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE hll_union(bytea) (
+    SFUNC = hll_merge,
+    STYPE = bytea,
+    COMBINEFUNC = hll_merge,
+    PARALLEL = SAFE
+);
+
+-- Note: Implemented in C; returns NULL when not preloaded.  auto_evict() runs it
+CREATE FUNCTION flush_access_sketches()
+RETURNS integer
+AS 'MODULE_PATHNAME', 'flush_access_sketches'
+LANGUAGE C PARALLEL UNSAFE;
+
+-- Internal: hourly sketches still in shared memory
+CREATE FUNCTION pending_access_sketches()
+RETURNS TABLE(
+    bucket_start timestamptz,
+    accesses bigint,
+    queries bytea,
+    missed_queries bytea
+)
+AS 'MODULE_PATHNAME', 'pending_access_sketches'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION access_sketch_stats(
+    OUT enabled boolean,
+    OUT buckets integer,
+    OUT pending_buckets integer,
+    OUT oldest_pending timestamptz,
+    OUT recycled bigint,
+    OUT standard_error float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'access_sketch_stats'
+LANGUAGE C PARALLEL SAFE;
+
+-- Note: Implemented in PL/pgSQL; with the sketches, counts whole hourly
+--       buckets overlapping the window and estimated is true, otherwise
+--       counts the access log exactly
+CREATE FUNCTION distinct_queries(
+    since timestamptz,
+    until timestamptz DEFAULT NOW()
+)
+RETURNS TABLE(
+    accesses bigint,
+    distinct_queries bigint,
+    distinct_missed bigint,
+    estimated boolean
+)
+LANGUAGE plpgsql PARALLEL SAFE
+AS $$
+BEGIN
+    IF EXISTS (SELECT 1 FROM semantic_cache.access_sketch_stats() s WHERE s.enabled) THEN
+        RETURN QUERY
+        SELECT COALESCE(SUM(b.accesses), 0)::bigint,
+               COALESCE(semantic_cache.hll_estimate(semantic_cache.hll_union(b.queries)), 0),
+               COALESCE(semantic_cache.hll_estimate(semantic_cache.hll_union(b.missed_queries)), 0),
+               true
+        FROM (
+            SELECT s.accesses, s.queries, s.missed_queries
+            FROM semantic_cache.cache_access_sketches s
+            WHERE s.bucket_start > since - INTERVAL '1 hour' AND s.bucket_start < until
+            UNION ALL
+            SELECT p.accesses, p.queries, p.missed_queries
+            FROM semantic_cache.pending_access_sketches() p
+            WHERE p.bucket_start > since - INTERVAL '1 hour' AND p.bucket_start < until
+        ) b;
+        RETURN;
+    END IF;
+
+    RETURN QUERY
+    SELECT COUNT(*),
+           COUNT(DISTINCT l.query_hash),
+           COUNT(DISTINCT l.query_hash) FILTER (WHERE NOT l.cache_hit),
+           false
+    FROM semantic_cache.cache_access_log l
+    WHERE l.access_time >= since AND l.access_time < until;
+END;
+$$;
+
+-- ============================================================================
+-- INITIALIZE SCHEMA
+-- ============================================================================
+
+SELECT init_schema();
+
+-- Applies events arriving from other regions; fires for replicated rows too
+CREATE TRIGGER cache_sync_apply
+    BEFORE INSERT ON semantic_cache.cache_sync_events
+    FOR EACH ROW EXECUTE FUNCTION semantic_cache.apply_sync_event();
+ALTER TABLE semantic_cache.cache_sync_events ENABLE ALWAYS TRIGGER cache_sync_apply;
+
+-- ============================================================================
+-- HELPER VIEWS
+-- ============================================================================
+
+-- Counts come from cache_entry_totals(): the gauges, or one parallel-capable scan
+CREATE VIEW cache_health AS
+SELECT
+    e.total_entries,
+    e.expired_entries,
+    e.total_size,
+    e.avg_access_count,
+    m.total_hits,
+    m.total_misses,
+    ROUND((m.total_hits::NUMERIC / NULLIF(m.total_hits + m.total_misses, 0) * 100)::NUMERIC, 2) as hit_rate_pct,
+    e.negative_entries,
+    m.total_negative_hits as negative_hits
+FROM semantic_cache.cache_metadata m,
+     (SELECT t.total_entries,
+             t.expired_entries,
+             pg_size_pretty(t.size_bytes) as total_size,
+             t.avg_access_count,
+             t.negative_entries
+      FROM semantic_cache.cache_entry_totals() t) e
+WHERE m.id = 1;
+
+CREATE VIEW recent_cache_activity AS
+SELECT
+    id,
+    LEFT(query_text, 80) as query_preview,
+    access_count,
+    created_at,
+    last_accessed_at,
+    expires_at,
+    pg_size_pretty(result_size_bytes::BIGINT) as result_size
+FROM semantic_cache.cache_entries
+ORDER BY last_accessed_at DESC
+LIMIT 50;
+
+-- Tags are unnested in FROM rather than the select list so the scan can be parallel
+CREATE VIEW cache_by_tag AS
+SELECT
+    t.tag,
+    COUNT(*) as entry_count,
+    pg_size_pretty(SUM(ce.result_size_bytes)::BIGINT) as total_size,
+    AVG(ce.access_count) as avg_access_count
+FROM semantic_cache.cache_entries ce
+CROSS JOIN LATERAL UNNEST(ce.tags) AS t(tag)
+WHERE ce.tags IS NOT NULL
+GROUP BY t.tag
+ORDER BY entry_count DESC;
+
+-- Logging and cost analysis views
+CREATE VIEW cache_access_summary AS
+SELECT
+    DATE_TRUNC('hour', access_time) as hour,
+    COUNT(*) as total_accesses,
+    SUM(CASE WHEN cache_hit THEN 1 ELSE 0 END) as hits,
+    SUM(CASE WHEN NOT cache_hit THEN 1 ELSE 0 END) as misses,
+    ROUND((SUM(CASE WHEN cache_hit THEN 1 ELSE 0 END)::NUMERIC / COUNT(*)::NUMERIC * 100)::NUMERIC, 2) as hit_rate_pct,
+    ROUND(SUM(cost_saved)::NUMERIC, 6) as cost_saved
+FROM semantic_cache.cache_access_log
+GROUP BY DATE_TRUNC('hour', access_time)
+ORDER BY hour DESC;
+
+CREATE VIEW cost_savings_daily AS
+SELECT
+    DATE(access_time) as date,
+    COUNT(*) as total_queries,
+    SUM(CASE WHEN cache_hit THEN 1 ELSE 0 END) as cache_hits,
+    SUM(CASE WHEN NOT cache_hit THEN 1 ELSE 0 END) as cache_misses,
+    ROUND((SUM(CASE WHEN cache_hit THEN 1 ELSE 0 END)::NUMERIC / COUNT(*)::NUMERIC * 100)::NUMERIC, 2) as hit_rate_pct,
+    ROUND(SUM(cost_saved)::NUMERIC, 6) as total_cost_saved,
+    ROUND(AVG(CASE WHEN cache_hit THEN cost_saved END)::NUMERIC, 6) as avg_cost_per_hit
+FROM semantic_cache.cache_access_log
+GROUP BY DATE(access_time)
+ORDER BY date DESC;
+
+-- Rows come from top_cached_query_totals(): the cost sketch, or one GROUP BY
+-- over the access log.  max_error is 0 for exact rows
+CREATE VIEW top_cached_queries AS
+SELECT
+    t.query_hash,
+    t.hit_count,
+    t.avg_similarity,
+    t.total_cost_saved,
+    t.last_access,
+    t.max_error
+FROM semantic_cache.top_cached_query_totals(100) t
+ORDER BY t.total_cost_saved DESC;
+
+-- ============================================================================
+-- COMMENTS
+-- ============================================================================
+
+COMMENT ON FUNCTION init_schema() IS 'Initialize cache schema and create required tables';
+COMMENT ON FUNCTION cache_query(text, text, jsonb, integer, text[]) IS 'Cache a query result with its vector embedding';
+COMMENT ON FUNCTION cache_negative(text, text, integer, text[]) IS 'Cache a negative entry for a query known to have no usable answer';
+COMMENT ON FUNCTION unit_vector(vector) IS 'Scale an embedding to unit length, as cache entries are stored';
+COMMENT ON FUNCTION metric_distance_sql(text, integer, text) IS 'Internal: index-compatible distance expression for a distance metric';
+COMMENT ON FUNCTION metric_similarity(float8, text, integer) IS 'Internal: similarity reported for a distance under a distance metric';
+COMMENT ON FUNCTION metric_max_distance(float8, text, integer) IS 'Internal: largest distance whose similarity reaches a threshold';
+COMMENT ON FUNCTION embedding_similarity(vector, vector, text) IS 'Internal: similarity of two embeddings under a distance metric';
+COMMENT ON FUNCTION get_cached_result(text, float4, integer) IS 'Retrieve cached result by semantic similarity (automatically optimizes IVFFlat probes)';
+COMMENT ON FUNCTION coalesce_inflight(text, float4, integer) IS 'Wait for a concurrent miss on a near-identical query, or register as the session computing it';
+COMMENT ON FUNCTION note_readonly_lookup(boolean, boolean, bigint) IS 'Count a lookup in shared memory instead of cache_metadata (read-only mode)';
+COMMENT ON FUNCTION readonly_lookup_stats() IS 'Lookup counters kept in shared memory by read-only lookups on this server';
+COMMENT ON FUNCTION drain_pending_accesses(integer) IS 'Remove and return entry accesses queued by read-only lookups';
+COMMENT ON FUNCTION discard_pending_accesses(oid) IS 'Drop queued entry accesses of another or a dropped database';
+COMMENT ON FUNCTION apply_access_batch(bigint[], timestamptz[]) IS 'Apply entry accesses drained from a standby to access_count and last_accessed_at';
+COMMENT ON FUNCTION create_sync_publication(text) IS 'Publish cached entries and invalidations for other regions over logical replication';
+COMMENT ON FUNCTION drop_sync_publication(text) IS 'Stop publishing cached entries and invalidations';
+COMMENT ON FUNCTION sync_subscription_command(text, text, text) IS 'Build the CREATE SUBSCRIPTION command that pulls another region''s cache';
+COMMENT ON FUNCTION nearest_clusters(vector, integer) IS 'Clusters of the centroids nearest to an embedding (partitioned layout)';
+COMMENT ON FUNCTION entry_cluster(text, integer) IS 'Internal: partition of a new entry, keeping query_hash unique across partitions';
+COMMENT ON FUNCTION check_entry_hash() IS 'Internal: reject a query_hash already cached in another partition';
+COMMENT ON FUNCTION rebuild_cache_layout(integer) IS 'Internal: rebuild cache_entries as a plain or partitioned table, keeping its entries';
+COMMENT ON FUNCTION enable_partitioned_layout(integer, integer, integer) IS 'Partition cache_entries by nearest centroid so lookups search only a few partitions';
+COMMENT ON FUNCTION disable_partitioned_layout() IS 'Move cache entries back into a single table';
+COMMENT ON FUNCTION cache_generation() IS 'Current invalidation generation announced by enable_invalidation_notify()';
+COMMENT ON FUNCTION notify_invalidation() IS 'Internal: announce deleted or replaced cache entries with pg_notify()';
+COMMENT ON FUNCTION enable_invalidation_notify(text, integer) IS 'Announce deleted cache entries on a NOTIFY channel for application-side caches';
+COMMENT ON FUNCTION disable_invalidation_notify() IS 'Stop announcing deleted cache entries';
+COMMENT ON FUNCTION capture_source_change() IS 'Internal: queue the cache tags affected by a change to a registered source table';
+COMMENT ON FUNCTION register_cache_dependency(regclass, text, text) IS 'Invalidate entries with a tag whenever a source table changes';
+COMMENT ON FUNCTION unregister_cache_dependency(regclass, text) IS 'Remove dependencies of a source table on cache tags';
+COMMENT ON FUNCTION process_pending_invalidations(integer) IS 'Delete the entries whose tags were queued by source table changes';
+COMMENT ON FUNCTION generation_invalidated(bigint, text[]) IS 'Internal: whether invalidate_cache_lazy() has invalidated an entry';
+COMMENT ON FUNCTION invalidate_cache_lazy(text) IS 'Invalidate all entries, or those with a tag, in constant time; collect_invalidated() deletes them later';
+COMMENT ON FUNCTION collect_invalidated(integer) IS 'Delete a batch of entries invalidated by invalidate_cache_lazy()';
+COMMENT ON FUNCTION hash_filter_add(text) IS 'Internal: add a query hash to the hash filter';
+COMMENT ON FUNCTION rebuild_hash_filter() IS 'Reload the hash filter from cache_entries, dropping deleted entries';
+COMMENT ON FUNCTION get_cached_exact(text, integer) IS 'Look up a cached result by exact query text, rejecting most misses from the hash filter';
+COMMENT ON FUNCTION hash_filter_stats() IS 'Size, fill, estimated false-positive rate and counters of the hash filter';
+COMMENT ON FUNCTION train_pq_codebook(integer, integer, integer) IS 'Internal: train the product-quantization codebook from a sample of cache entries';
+COMMENT ON FUNCTION pq_encode(text) IS 'Internal: product-quantization codes of an embedding';
+COMMENT ON FUNCTION pq_candidates(text, integer, integer[], integer, bigint) IS 'Internal: live entries in the probed partitions whose PQ codes score best against an embedding, for exact re-ranking';
+COMMENT ON FUNCTION pq_forget_entries() IS 'Internal: drop the PQ codes of deleted cache entries';
+COMMENT ON FUNCTION enable_pq_lookup(integer, integer, integer) IS 'Train a PQ codebook and look up entries by their compressed codes';
+COMMENT ON FUNCTION disable_pq_lookup() IS 'Drop the PQ codebook and codes and go back to the vector index';
+COMMENT ON FUNCTION pq_encode_pending(integer) IS 'Encode a batch of cache entries that have no PQ codes yet';
+COMMENT ON FUNCTION apply_storage_options(regclass) IS 'Internal: apply the split storage settings to a cache_entries table and its partitions';
+COMMENT ON FUNCTION enable_split_storage(integer) IS 'Keep payloads and embeddings out of the cache_entries heap and leave room for HOT access updates';
+COMMENT ON FUNCTION disable_split_storage() IS 'Return cache_entries to the default storage settings';
+COMMENT ON FUNCTION lexical_overlap(tsvector, text[]) IS 'Internal: share of query lexemes that occur in a cache entry''s query text';
+COMMENT ON FUNCTION enable_lexical_lookup(regconfig) IS 'Add a generated tsvector column on query_text with a GIN index for hybrid lookups';
+COMMENT ON FUNCTION disable_lexical_lookup() IS 'Drop the tsvector column and index used by hybrid lookups';
+COMMENT ON FUNCTION get_cached_hybrid(text, text, float4, float4, integer) IS 'Retrieve a cached result scored on vector similarity and lexical overlap together';
+COMMENT ON FUNCTION forget_entry_aliases() IS 'Internal: drop the paraphrase embeddings of deleted cache entries';
+COMMENT ON FUNCTION attach_embedding(bigint, text) IS 'Attach another embedding, such as a confirmed paraphrase, to a cached entry';
+COMMENT ON FUNCTION memo_key(text) IS 'Internal: embedding memo key of a query text, ignoring case and whitespace runs';
+COMMENT ON FUNCTION remember_embedding(text, text, text) IS 'Store the embedding a model produced for a query text in the embedding memo';
+COMMENT ON FUNCTION get_embeddings(text[], text) IS 'Look up the memoized embeddings of several query texts at once';
+COMMENT ON FUNCTION get_embedding(text, text) IS 'Look up the memoized embedding of a query text';
+COMMENT ON FUNCTION evict_embedding_memo() IS 'Remove expired and least recently used embedding memo entries';
+COMMENT ON FUNCTION set_embedding_provider(regprocedure) IS 'Register the function that embeds query texts in the database, or unregister it with NULL';
+COMMENT ON FUNCTION get_embedding_provider() IS 'Get the registered embedding provider';
+COMMENT ON FUNCTION embed_texts(text[]) IS 'Embed several query texts with the embedding provider, memoized';
+COMMENT ON FUNCTION embed_text(text) IS 'Embed a query text with the embedding provider, memoized';
+COMMENT ON FUNCTION get_cached_result_by_text(text, float4, integer) IS 'Retrieve a cached result by query text, embedded with the embedding provider';
+COMMENT ON FUNCTION cache_query_by_text(text, jsonb, integer, text[]) IS 'Cache a query result by query text, embedded with the embedding provider';
+COMMENT ON FUNCTION track_cache_gauges() IS 'Internal: keep the cache_health gauges current as cache_entries changes';
+COMMENT ON FUNCTION reconcile_cache_gauges() IS 'Reload the cache_health gauges from cache_entries';
+COMMENT ON FUNCTION cache_gauges() IS 'Entry counts kept in shared memory for cache_health';
+COMMENT ON FUNCTION cache_entry_totals() IS 'Internal: entry counts for cache_health, from the gauges or a table scan';
+COMMENT ON FUNCTION rebuild_top_queries() IS 'Reseed the top-queries sketches from cache_access_log';
+COMMENT ON FUNCTION top_queries(text, integer) IS 'Approximate top queries by hits or cost saved, with error bounds';
+COMMENT ON FUNCTION top_queries_stats() IS 'Size and totals of the top-queries sketches';
+COMMENT ON FUNCTION top_cached_query_totals(integer) IS 'Internal: rows for top_cached_queries, from the cost sketch or the access log';
+COMMENT ON FUNCTION hll_merge(bytea, bytea) IS 'Union of two distinct-query sketches';
+COMMENT ON FUNCTION hll_estimate(bytea) IS 'Estimated number of distinct queries in a sketch';
+COMMENT ON AGGREGATE hll_union(bytea) IS 'Union of distinct-query sketches';
+COMMENT ON FUNCTION flush_access_sketches() IS 'Merge the hourly distinct-query sketches into cache_access_sketches';
+COMMENT ON FUNCTION pending_access_sketches() IS 'Internal: hourly distinct-query sketches not yet freed from shared memory';
+COMMENT ON FUNCTION access_sketch_stats() IS 'Size and use of the hourly distinct-query sketches';
+COMMENT ON FUNCTION distinct_queries(timestamptz, timestamptz) IS 'Distinct queries and distinct misses logged in a time window';
+COMMENT ON FUNCTION take_refresh_lease(bigint) IS 'Try to take the stale-while-revalidate refresh lease on a cache entry';
+COMMENT ON FUNCTION release_refresh_lease(bigint) IS 'Release the stale-while-revalidate refresh lease held on a cache entry';
+COMMENT ON FUNCTION get_cached_candidates(text, integer, float4, boolean) IS 'Return the k nearest live cache entries for client-side re-ranking';
+COMMENT ON FUNCTION invalidate_cache(text, text) IS 'Invalidate cache entries by pattern or tag';
+COMMENT ON FUNCTION invalidate_cache(text[], text[]) IS 'Invalidate cache entries matching any of several patterns or tags';
+COMMENT ON FUNCTION invalidate_cache_similar(text, float4, integer) IS 'Invalidate cache entries semantically similar to an embedding';
+COMMENT ON FUNCTION cache_stats() IS 'Get cache statistics including hits, misses, and hit rate';
+COMMENT ON FUNCTION evict_expired() IS 'Remove expired cache entries';
+COMMENT ON FUNCTION evict_lru(integer) IS 'Evict least recently used entries';
+COMMENT ON FUNCTION evict_lfu(integer) IS 'Evict least frequently used entries';
+COMMENT ON FUNCTION evict_lru(integer, integer) IS 'Evict least recently used entries of one partition';
+COMMENT ON FUNCTION evict_lfu(integer, integer) IS 'Evict least frequently used entries of one partition';
+COMMENT ON FUNCTION clear_cache() IS 'Clear all cache entries';
+COMMENT ON FUNCTION auto_evict() IS 'Automatically evict entries based on cache configuration';
+COMMENT ON FUNCTION log_cache_access(text, boolean, float4, numeric) IS 'Log cache access event with cost information';
+COMMENT ON FUNCTION get_cost_savings(integer) IS 'Get cost savings report for the specified number of days';
+COMMENT ON FUNCTION set_vector_dimension(integer) IS 'Configure vector embedding dimension (768, 1536, etc.) - call rebuild_index() to apply';
+COMMENT ON FUNCTION get_vector_dimension() IS 'Get configured vector embedding dimension';
+COMMENT ON FUNCTION set_index_type(text) IS 'Set vector index type: ivfflat (default, fast) or hnsw (accurate, requires pgvector 0.5.0+) - call rebuild_index() to apply';
+COMMENT ON FUNCTION get_index_type() IS 'Get configured vector index type';
+COMMENT ON FUNCTION rebuild_index() IS 'Rebuild cache table and index with current configuration (WARNING: clears all cached data)';
+COMMENT ON FUNCTION set_distance_metric(text) IS 'Compare embeddings by cosine (default), inner_product, l2 or hamming (WARNING: clears all cached data)';
+COMMENT ON FUNCTION get_distance_metric() IS 'Get configured distance metric';
+
+COMMENT ON TABLE semantic_cache.cache_entries IS 'Stores cached query results with vector embeddings';
+COMMENT ON TABLE semantic_cache.cache_metadata IS 'Cache statistics and metadata';
+COMMENT ON TABLE semantic_cache.cache_config IS 'Cache configuration settings';
+COMMENT ON TABLE semantic_cache.cache_access_log IS 'Logs all cache access events with cost tracking';
+COMMENT ON TABLE semantic_cache.cache_sync_events IS 'Cached entries and invalidations published to other regions';
+COMMENT ON TABLE semantic_cache.cache_centroids IS 'Centroids of the partitioned layout, one per cache_entries partition';
+COMMENT ON TABLE semantic_cache.cache_dependencies IS 'Source tables whose changes invalidate entries with a tag';
+COMMENT ON TABLE semantic_cache.cache_pending_invalidations IS 'Tags queued by source table changes, waiting for process_pending_invalidations()';
+COMMENT ON TABLE semantic_cache.cache_invalidation_cutoffs IS 'Per-tag generation cutoffs recorded by invalidate_cache_lazy()';
+COMMENT ON TABLE semantic_cache.cache_pq_codebook IS 'Product-quantization centroids, one row per subspace';
+COMMENT ON TABLE semantic_cache.cache_pq_codes IS 'Compressed PQ codes of each cache entry, scanned by PQ lookups';
+COMMENT ON TABLE semantic_cache.cache_entry_aliases IS 'Extra embeddings of cache entries, sharing their payload and expiry';
+COMMENT ON TABLE semantic_cache.cache_embedding_memo IS 'Embeddings of previously seen query texts, by model';
+COMMENT ON TABLE semantic_cache.cache_access_sketches IS 'Hourly sketches of the distinct queries in the access log';
+COMMENT ON SEQUENCE semantic_cache.cache_generation IS 'Invalidation generations announced on the notify channel';
+COMMENT ON SEQUENCE semantic_cache.cache_pq_codebook_version IS 'Versions of the PQ codebook, one per training';
+
+COMMENT ON VIEW semantic_cache.cache_health IS 'Real-time cache health metrics';
+COMMENT ON VIEW semantic_cache.recent_cache_activity IS 'Most recently accessed cache entries';
+COMMENT ON VIEW semantic_cache.cache_by_tag IS 'Cache entries grouped by tag';
+COMMENT ON VIEW semantic_cache.cache_access_summary IS 'Hourly cache access statistics with cost savings';
+COMMENT ON VIEW semantic_cache.cost_savings_daily IS 'Daily cost savings breakdown';
+COMMENT ON VIEW semantic_cache.top_cached_queries IS 'Top queries by cost savings';
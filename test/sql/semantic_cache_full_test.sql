@@ -1,7 +1,14 @@
 -- pg_semantic_cache comprehensive feature test
 -- Covers: dimension changes, rebuild_index(), semantic similarity (hit/miss),
 -- tags, invalidate_cache(), eviction strategies, monitoring views,
--- cost tracking, HNSW index switching, and clear_cache().
+-- cost tracking, HNSW index switching, clear_cache(), top-k candidates,
+-- stale-while-revalidate, request coalescing, negative caching, read-only
+-- lookups, cross-region sync, the partitioned layout, invalidation
+-- broadcast, dependency-based, semantic, batched and lazy invalidation,
+-- exact-text lookups, product-quantization lookups, split storage,
+-- unit-length embeddings, distance metrics, hybrid lookups, paraphrase
+-- embeddings, the embedding memo, the embedding provider, health gauges,
+-- top-queries sketches and distinct-query sketches.
 
 -- Setup: create extensions
 CREATE EXTENSION IF NOT EXISTS vector;
@@ -246,6 +253,893 @@ SELECT semantic_cache.clear_cache() >= 0 AS cleared;
 
 SELECT total_entries FROM semantic_cache.cache_stats();
 
+-- ============================================================================
+-- Test 19: Top-k candidates for client-side re-ranking
+-- ============================================================================
+SELECT semantic_cache.set_vector_dimension(8);
+SELECT semantic_cache.rebuild_index();
+
+-- Probe every list so the 8-dim test data is searched exactly
+SET ivfflat.probes = 10;
+
+SELECT semantic_cache.cache_query(
+    'Candidate A',
+    '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "A"}'::jsonb,
+    3600,
+    ARRAY['candidates']
+) > 0 AS inserted_a;
+
+SELECT semantic_cache.cache_query(
+    'Candidate B',
+    '[0.80, 0.30, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "B"}'::jsonb,
+    3600,
+    ARRAY['candidates']
+) > 0 AS inserted_b;
+
+SELECT semantic_cache.cache_query(
+    'Candidate C',
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.90]',
+    '{"answer": "C"}'::jsonb,
+    3600,
+    ARRAY['candidates']
+) > 0 AS inserted_c;
+
+-- Nearest two, best first, payloads deferred
+SELECT
+    c.similarity_score > 0.9 AS close_match,
+    e.query_text,
+    c.result_data IS NULL AS payload_deferred
+FROM semantic_cache.get_cached_candidates(
+    '[0.90, 0.12, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 2
+) c
+JOIN semantic_cache.cache_entries e ON e.id = c.id
+ORDER BY c.similarity_score DESC;
+
+-- min_similarity trims the candidate set; payloads on request
+SELECT result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_candidates(
+    '[0.90, 0.12, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 3, 0.99, true
+);
+
+-- Candidate lookups do not touch hit/miss counters
+SELECT total_hits, total_misses FROM semantic_cache.cache_stats();
+
+-- ============================================================================
+-- Test 20: Stale-while-revalidate
+-- ============================================================================
+INSERT INTO semantic_cache.cache_config (key, value)
+VALUES ('stale_grace_seconds', '600');
+
+-- ttl 0 expires immediately
+SELECT semantic_cache.cache_query(
+    'Stale entry',
+    '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "old"}'::jsonb,
+    0,
+    NULL
+) > 0 AS inserted_stale;
+
+-- Served stale inside the grace window, with the refresh lease
+SELECT found, result_data->>'answer' AS answer, stale, refresh_lease
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+-- evict_expired() leaves entries inside the grace window alone
+SELECT semantic_cache.evict_expired() AS expired_evicted;
+
+-- The lease is a session-level lock; a transaction that aborts hands it back
+SELECT COUNT(*) AS leases_held
+FROM pg_locks
+WHERE locktype = 'advisory' AND pid = pg_backend_pid();
+
+BEGIN;
+SELECT 1 / 0;
+ROLLBACK;
+
+SELECT COUNT(*) AS leases_held
+FROM pg_locks
+WHERE locktype = 'advisory' AND pid = pg_backend_pid();
+
+SELECT refresh_lease
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+-- Refreshing through cache_query() replaces the entry and drops the lease
+SELECT semantic_cache.cache_query(
+    'Stale entry',
+    '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "new"}'::jsonb,
+    3600,
+    NULL
+) > 0 AS refreshed;
+
+SELECT COUNT(*) AS leases_held
+FROM pg_locks
+WHERE locktype = 'advisory' AND pid = pg_backend_pid();
+
+SELECT found, result_data->>'answer' AS answer, stale, refresh_lease
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+DELETE FROM semantic_cache.cache_config WHERE key = 'stale_grace_seconds';
+
+-- ============================================================================
+-- Test 21: Request coalescing is a no-op without shared_preload_libraries
+-- ============================================================================
+INSERT INTO semantic_cache.cache_config (key, value)
+VALUES ('coalesce_timeout_ms', '100');
+
+SELECT semantic_cache.coalesce_inflight(
+    '[0.50, 0.10, 0.50, 0.10, 0.50, 0.10, 0.50, 0.10]', 0.95, 100
+) IS NULL AS not_coalesced;
+
+SELECT found, cache_id IS NULL AS no_entry
+FROM semantic_cache.get_cached_result(
+    '[0.50, 0.10, 0.50, 0.10, 0.50, 0.10, 0.50, 0.10]',
+    0.95
+);
+
+DELETE FROM semantic_cache.cache_config WHERE key = 'coalesce_timeout_ms';
+
+-- ============================================================================
+-- Test 22: Negative caching
+-- ============================================================================
+SELECT semantic_cache.cache_negative(
+    'Known bad query',
+    '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    60
+) > 0 AS cached_negative;
+
+SELECT found, negative, result_data IS NULL AS no_payload, stale
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+-- Negative entries are never offered as re-ranking candidates
+SELECT COUNT(*) AS negative_candidates
+FROM semantic_cache.get_cached_candidates(
+    '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10]', 10, 0.95
+);
+
+SELECT negative_entries, negative_hits FROM semantic_cache.cache_stats();
+
+-- A real result replaces the negative entry
+SELECT semantic_cache.cache_query(
+    'Known bad query',
+    '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "recovered"}'::jsonb,
+    3600,
+    NULL
+) > 0 AS recovered;
+
+SELECT found, negative, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+SELECT negative_entries, negative_hits FROM semantic_cache.cache_stats();
+
+-- ============================================================================
+-- Test 23: Read-only lookup mode (hot standby / read-only transactions)
+-- ============================================================================
+INSERT INTO semantic_cache.cache_config (key, value)
+VALUES ('lookup_mode', 'read_only');
+
+CREATE TEMP TABLE stats_before AS
+SELECT total_hits, total_misses FROM semantic_cache.cache_stats();
+
+SELECT found, result_data->>'answer' AS answer, refresh_lease
+FROM semantic_cache.get_cached_result(
+    '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+
+SELECT found FROM semantic_cache.get_cached_result(
+    '[0.50, 0.10, 0.50, 0.10, 0.50, 0.10, 0.50, 0.10]',
+    0.95
+);
+
+-- Nothing was written to cache_metadata
+SELECT s.total_hits = b.total_hits AND s.total_misses = b.total_misses AS no_writes
+FROM semantic_cache.cache_stats() s, stats_before b;
+
+-- Shared-memory counters and the access queue need shared_preload_libraries
+SELECT hits IS NULL AS not_preloaded FROM semantic_cache.readonly_lookup_stats();
+SELECT COUNT(*) AS drained FROM semantic_cache.drain_pending_accesses();
+SELECT semantic_cache.discard_pending_accesses() IS NULL AS not_preloaded;
+
+DELETE FROM semantic_cache.cache_config WHERE key = 'lookup_mode';
+
+-- Read-only transactions switch to read-only lookups automatically
+BEGIN READ ONLY;
+SELECT found, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result(
+    '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    0.95
+);
+COMMIT;
+
+-- Accesses drained from a standby are applied on the primary
+CREATE TEMP TABLE access_before AS
+SELECT access_count FROM semantic_cache.cache_entries WHERE query_text = 'Candidate A';
+
+SELECT semantic_cache.apply_access_batch(ARRAY[id, id], ARRAY[NOW(), NOW()]) AS applied
+FROM semantic_cache.cache_entries WHERE query_text = 'Candidate A';
+
+SELECT ce.access_count - b.access_count AS accesses_added
+FROM semantic_cache.cache_entries ce, access_before b
+WHERE ce.query_text = 'Candidate A';
+
+DROP TABLE stats_before, access_before;
+
+-- ============================================================================
+-- Test 24: Cross-region sync (subscriber side)
+-- ============================================================================
+SELECT semantic_cache.sync_subscription_command(
+    'host=eu-primary dbname=app', 'cache_from_eu'
+) AS command;
+
+-- Simulate rows arriving through a subscription to another region
+SET session_replication_role = replica;
+
+INSERT INTO semantic_cache.cache_sync_events
+    (kind, query_hash, query_text, query_embedding, result_data,
+     result_size_bytes, ttl_seconds, created_at, expires_at)
+VALUES
+    ('I', md5('Remote entry'), 'Remote entry',
+     '[0.10, 0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10]', '{"answer": "remote"}',
+     20, 3600, NOW(), NOW() + interval '1 hour'),
+    ('I', md5('Expired remote entry'), 'Expired remote entry',
+     '[0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10, 0.10]', '{"answer": "old"}',
+     17, 60, NOW() - interval '2 hours', NOW() - interval '1 hour'),
+    ('I', md5('Wrong dimension'), 'Wrong dimension',
+     '[0.10, 0.90]', '{"answer": "2d"}',
+     16, 3600, NOW(), NOW() + interval '1 hour');
+
+RESET session_replication_role;
+
+-- Only the live entry with a matching dimension is applied; events are not kept
+SELECT query_text, result_data->>'answer' AS answer
+FROM semantic_cache.cache_entries
+WHERE query_text IN ('Remote entry', 'Expired remote entry', 'Wrong dimension');
+
+SELECT COUNT(*) AS stored_events FROM semantic_cache.cache_sync_events;
+
+-- Invalidations arrive as deletes
+SET session_replication_role = replica;
+
+INSERT INTO semantic_cache.cache_sync_events (kind, query_hash)
+VALUES ('D', md5('Remote entry'));
+
+RESET session_replication_role;
+
+SELECT COUNT(*) AS remote_entries
+FROM semantic_cache.cache_entries
+WHERE query_text = 'Remote entry';
+
+-- ============================================================================
+-- Test 25: Partitioned layout
+-- ============================================================================
+SELECT semantic_cache.enable_partitioned_layout(2) > 0 AS migrated;
+
+SELECT c.relkind,
+       (SELECT COUNT(*) FROM pg_inherits WHERE inhparent = c.oid) AS partitions,
+       (SELECT COUNT(*) FROM semantic_cache.cache_centroids) AS centroids
+FROM pg_class c
+WHERE c.oid = 'semantic_cache.cache_entries'::regclass;
+
+-- Every entry sits in the partition of its nearest centroid
+SELECT bool_and(cluster_id = (semantic_cache.nearest_clusters(query_embedding, 1))[1]) AS all_nearest
+FROM semantic_cache.cache_entries;
+
+-- New entries are routed the same way, and re-caching hits the same row
+SELECT semantic_cache.cache_query(
+    'Partitioned entry',
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10]',
+    '{"answer": "partitioned"}'::jsonb,
+    3600,
+    NULL
+) > 0 AS cached;
+
+SELECT semantic_cache.cache_query(
+    'Partitioned entry',
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10]',
+    '{"answer": "partitioned"}'::jsonb,
+    3600,
+    NULL
+) = ce.id AS same_entry,
+       ce.cluster_id = (semantic_cache.nearest_clusters(ce.query_embedding, 1))[1] AS nearest
+FROM semantic_cache.cache_entries ce
+WHERE ce.query_text = 'Partitioned entry';
+
+SELECT found, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10]',
+    0.95
+);
+
+-- Entries from other regions land in their nearest partition too
+SET session_replication_role = replica;
+
+INSERT INTO semantic_cache.cache_sync_events
+    (kind, query_hash, query_text, query_embedding, result_data,
+     result_size_bytes, ttl_seconds, created_at, expires_at)
+VALUES
+    ('I', md5('Remote partitioned entry'), 'Remote partitioned entry',
+     '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.90, 0.10]', '{"answer": "remote"}',
+     20, 3600, NOW(), NOW() + interval '1 hour');
+
+RESET session_replication_role;
+
+SELECT cluster_id = (semantic_cache.nearest_clusters(query_embedding, 1))[1] AS nearest
+FROM semantic_cache.cache_entries
+WHERE query_text = 'Remote partitioned entry';
+
+-- A query keeps its partition when re-cached with a far embedding, and
+-- query_hash stays unique across partitions
+SELECT semantic_cache.cache_query(
+    'Partitioned entry',
+    '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    '{"answer": "partitioned"}'::jsonb,
+    3600,
+    NULL
+) > 0 AS cached;
+
+SELECT COUNT(*) AS copies
+FROM semantic_cache.cache_entries
+WHERE query_text = 'Partitioned entry';
+
+DO $$
+BEGIN
+    INSERT INTO semantic_cache.cache_entries (query_hash, query_text, query_embedding, result_data, cluster_id)
+    SELECT query_hash, query_text, query_embedding, result_data, 1 - cluster_id
+    FROM semantic_cache.cache_entries
+    WHERE query_text = 'Partitioned entry';
+    RAISE NOTICE 'duplicate query_hash accepted';
+EXCEPTION
+    WHEN unique_violation THEN
+        RAISE NOTICE 'duplicate query_hash rejected';
+END $$;
+
+-- LRU/LFU eviction can work on one partition
+SELECT semantic_cache.evict_lru(1000, 0) AS partition_evicted;
+
+-- Views keep reading the cache after the table swap
+SELECT total_entries = (SELECT COUNT(*) FROM semantic_cache.cache_entries) AS health_matches
+FROM semantic_cache.cache_health;
+
+SELECT semantic_cache.disable_partitioned_layout() > 0 AS restored;
+
+SELECT c.relkind,
+       (SELECT COUNT(*) FROM semantic_cache.cache_centroids) AS centroids
+FROM pg_class c
+WHERE c.oid = 'semantic_cache.cache_entries'::regclass;
+
+SELECT found, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result(
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10]',
+    0.95
+);
+
+-- ============================================================================
+-- Test 26: Parallel safety labels (everything else is PARALLEL UNSAFE)
+-- ============================================================================
+SELECT proname, proparallel
+FROM pg_proc
+WHERE pronamespace = 'semantic_cache'::regnamespace
+  AND proparallel <> 'u'
+ORDER BY proname;
+
+-- ============================================================================
+-- Test 27: Invalidation broadcast
+-- ============================================================================
+SELECT semantic_cache.enable_invalidation_notify('semantic_cache_test', 2);
+SELECT tgname, tgenabled
+FROM pg_trigger
+WHERE tgrelid = 'semantic_cache.cache_entries'::regclass
+  AND tgname LIKE 'cache_notify_%'
+ORDER BY tgname;
+SELECT semantic_cache.cache_generation() AS generation;
+SELECT semantic_cache.cache_query(
+    'Notify entry one',
+    '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.90]',
+    '{"answer": "one"}'::jsonb,
+    3600,
+    ARRAY['notify']
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'Notify entry two',
+    '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.90]',
+    '{"answer": "two"}'::jsonb,
+    3600,
+    ARRAY['notify']
+) > 0 AS cached;
+-- Listed by id and hash, one generation per statement
+SELECT semantic_cache.invalidate_cache(tag := 'notify') AS invalidated;
+SELECT semantic_cache.cache_generation() AS generation;
+-- Statements that delete nothing are not announced
+SELECT semantic_cache.invalidate_cache(tag := 'notify') AS invalidated;
+SELECT semantic_cache.cache_generation() AS generation;
+-- More than max_ids entries: announced as a flush
+INSERT INTO semantic_cache.cache_entries (query_hash, query_text, query_embedding, result_data, tags)
+SELECT md5('Notify bulk ' || i), 'Notify bulk ' || i,
+       '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.90]', '{}'::jsonb, ARRAY['notify']
+FROM generate_series(1, 3) i;
+SELECT semantic_cache.invalidate_cache(tag := 'notify') AS invalidated;
+SELECT semantic_cache.cache_generation() AS generation;
+SELECT semantic_cache.disable_invalidation_notify();
+SELECT COUNT(*) AS notify_triggers
+FROM pg_trigger
+WHERE tgrelid = 'semantic_cache.cache_entries'::regclass
+  AND tgname LIKE 'cache_notify_%';
+
+-- ============================================================================
+-- Test 28: Dependency-based invalidation
+-- ============================================================================
+CREATE TABLE cache_test_products (id integer PRIMARY KEY, name text);
+INSERT INTO cache_test_products VALUES (1, 'Widget'), (2, 'Gadget');
+SELECT semantic_cache.register_cache_dependency('cache_test_products', 'product', 'id');
+SELECT semantic_cache.register_cache_dependency('cache_test_products', 'catalog');
+SELECT source_table, tag, key_column
+FROM semantic_cache.cache_dependencies
+ORDER BY tag;
+SELECT tgname
+FROM pg_trigger
+WHERE tgrelid = 'cache_test_products'::regclass
+ORDER BY tgname;
+INSERT INTO semantic_cache.cache_entries (query_hash, query_text, query_embedding, result_data, tags)
+VALUES (md5('Dep widget'), 'Dep widget', '[0.20, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['product:1']),
+       (md5('Dep gadget'), 'Dep gadget', '[0.10, 0.20, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['product:2']),
+       (md5('Dep catalog'), 'Dep catalog', '[0.10, 0.10, 0.20, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['catalog']);
+-- A change to one row queues its key and the table-wide tag, nothing more
+UPDATE cache_test_products SET name = 'Widget v2' WHERE id = 1;
+SELECT tag, all_keys, changes FROM semantic_cache.cache_pending_invalidations ORDER BY tag;
+-- A tag already queued is bumped, not dropped
+UPDATE cache_test_products SET name = 'Widget v3' WHERE id = 1;
+SELECT tag, all_keys, changes FROM semantic_cache.cache_pending_invalidations ORDER BY tag;
+SELECT semantic_cache.process_pending_invalidations() AS invalidated;
+SELECT query_text FROM semantic_cache.cache_entries WHERE query_text LIKE 'Dep %';
+SELECT COUNT(*) AS pending FROM semantic_cache.cache_pending_invalidations;
+-- TRUNCATE invalidates every key of the tag
+TRUNCATE cache_test_products;
+SELECT tag, all_keys FROM semantic_cache.cache_pending_invalidations ORDER BY tag;
+SELECT semantic_cache.process_pending_invalidations() AS invalidated;
+SELECT COUNT(*) AS remaining FROM semantic_cache.cache_entries WHERE query_text LIKE 'Dep %';
+SELECT semantic_cache.unregister_cache_dependency('cache_test_products') AS removed;
+SELECT COUNT(*) AS dependency_triggers
+FROM pg_trigger
+WHERE tgrelid = 'cache_test_products'::regclass;
+DROP TABLE cache_test_products;
+
+-- ============================================================================
+-- Test 29: Semantic invalidation
+-- ============================================================================
+INSERT INTO semantic_cache.cache_entries (query_hash, query_text, query_embedding, result_data)
+VALUES (md5('Similar one'), 'Similar one', '[-0.90, -0.10, 0.10, -0.10, 0.10, -0.10, 0.10, -0.15]', '{}'),
+       (md5('Similar two'), 'Similar two', '[-0.85, -0.10, 0.10, -0.10, 0.10, -0.10, 0.10, -0.10]', '{}'),
+       (md5('Similar three'), 'Similar three', '[-0.60, -0.10, 0.50, -0.10, 0.10, -0.10, 0.10, -0.10]', '{}');
+-- One entry per step: the walk continues until it meets an entry below 0.99
+SELECT semantic_cache.invalidate_cache_similar(
+    '[-0.90, -0.10, 0.10, -0.10, 0.10, -0.10, 0.10, -0.10]', 0.99, 1
+) AS invalidated;
+SELECT query_text FROM semantic_cache.cache_entries WHERE query_text LIKE 'Similar %';
+SELECT semantic_cache.invalidate_cache_similar(
+    '[-0.90, -0.10, 0.10, -0.10, 0.10, -0.10, 0.10, -0.10]', 0.80
+) AS invalidated;
+SELECT COUNT(*) AS remaining FROM semantic_cache.cache_entries WHERE query_text LIKE 'Similar %';
+
+-- ============================================================================
+-- Test 30: Indexed and batched invalidation
+-- ============================================================================
+SELECT indexname, indexdef
+FROM pg_indexes
+WHERE schemaname = 'semantic_cache'
+  AND indexname = 'idx_cache_tags';
+INSERT INTO semantic_cache.cache_entries (query_hash, query_text, query_embedding, result_data, tags)
+VALUES (md5('Batch alpha'), 'Batch alpha', '[0.30, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['batch-one']),
+       (md5('Batch beta'), 'Batch beta', '[0.10, 0.30, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['batch-two']),
+       (md5('Batch gamma'), 'Batch gamma', '[0.10, 0.10, 0.30, 0.10, 0.10, 0.10, 0.10, 0.10]', '{}', ARRAY['batch-three']),
+       (md5('Batch delta'), 'Batch delta', '[0.10, 0.10, 0.10, 0.30, 0.10, 0.10, 0.10, 0.10]', '{}', NULL);
+-- Batch alpha matches a pattern and a tag and is counted once
+SELECT semantic_cache.invalidate_cache(
+    patterns := ARRAY['Batch alpha%', 'Batch delta%'],
+    tags := ARRAY['batch-one', 'batch-two']
+) AS invalidated;
+SELECT query_text FROM semantic_cache.cache_entries WHERE query_text LIKE 'Batch %';
+SELECT semantic_cache.invalidate_cache(NULL, ARRAY['batch-three']) AS invalidated;
+
+-- ============================================================================
+-- Test 31: Lazy invalidation
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'Lazy one', '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40, 0.10]', '{"answer": "one"}'::jsonb, 3600, ARRAY['lazy-a']
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'Lazy two', '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40]', '{"answer": "two"}'::jsonb, 3600, ARRAY['lazy-b']
+) > 0 AS cached;
+SELECT semantic_cache.invalidate_cache_lazy('lazy-a') > 0 AS invalidated;
+-- The entry is still there but no longer served; other tags are unaffected
+SELECT COUNT(*) AS lazy_entries FROM semantic_cache.cache_entries WHERE query_text LIKE 'Lazy %';
+SELECT found FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40, 0.10]', 0.99);
+SELECT found, result_data->>'answer' AS answer FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40]', 0.99);
+-- Caching the query again replaces the invalidated entry
+SELECT semantic_cache.cache_query(
+    'Lazy one', '[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40, 0.10]', '{"answer": "one again"}'::jsonb, 3600, ARRAY['lazy-a']
+) > 0 AS cached;
+SELECT found, result_data->>'answer' AS answer FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40, 0.10]', 0.99);
+-- A rolled-back invalidation leaves a gap in the generations and no cutoff
+BEGIN;
+SELECT semantic_cache.invalidate_cache_lazy('lazy-b') > 0 AS invalidated;
+ROLLBACK;
+SELECT found, result_data->>'answer' AS answer FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40]', 0.99);
+-- Without a tag every entry is invalidated
+SELECT semantic_cache.invalidate_cache_lazy() > 0 AS invalidated;
+SELECT found FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.40]', 0.99);
+SELECT semantic_cache.collect_invalidated() > 0 AS collected;
+SELECT COUNT(*) AS remaining FROM semantic_cache.cache_entries;
+-- Recent cutoffs are kept for writers that started before them
+SELECT tag FROM semantic_cache.cache_invalidation_cutoffs;
+
+-- ============================================================================
+-- Test 32: Exact-text lookups
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'Exact entry', '[0.30, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{"answer": "exact"}'::jsonb
+) > 0 AS cached;
+SELECT semantic_cache.cache_negative(
+    'Exact negative', '[0.10, 0.30, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]'
+) > 0 AS cached;
+SELECT found, result_data->>'answer' AS answer, negative FROM semantic_cache.get_cached_exact('Exact entry');
+SELECT found, result_data, negative FROM semantic_cache.get_cached_exact('Exact negative');
+-- Only the exact text matches
+SELECT found, result_data, cache_id FROM semantic_cache.get_cached_exact('Exact entry.');
+SELECT found FROM semantic_cache.get_cached_exact('Exact entry', 3600);
+SELECT found, cache_id FROM semantic_cache.get_cached_exact(NULL);
+-- Lazily invalidated entries are not served
+SELECT semantic_cache.invalidate_cache_lazy() > 0 AS invalidated;
+SELECT found FROM semantic_cache.get_cached_exact('Exact entry');
+SELECT semantic_cache.collect_invalidated() AS collected;
+-- The hash filter lives in shared memory and needs shared_preload_libraries
+SELECT enabled, built, memory_bytes IS NULL AS no_memory, rebuilt_at FROM semantic_cache.hash_filter_stats();
+SELECT semantic_cache.rebuild_hash_filter() IS NULL AS not_preloaded;
+
+-- ============================================================================
+-- Test 33: Product-quantization lookups
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'PQ alpha', '[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{"answer": "alpha"}'::jsonb, 3600, ARRAY['pq']
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'PQ beta', '[0.10, 0.10, 0.10, 0.10, 0.90, 0.10, 0.10, 0.10]', '{"answer": "beta"}'::jsonb, 3600, ARRAY['pq-beta']
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'PQ gamma', '[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.90]', '{"answer": "gamma"}'::jsonb, 3600, ARRAY['pq']
+) > 0 AS cached;
+-- Two subspaces: two bytes of codes per entry
+SELECT semantic_cache.enable_pq_lookup(2) AS encoded;
+SELECT subspace, dim_start, dim_count, array_length(centroids, 1) AS floats
+FROM semantic_cache.cache_pq_codebook ORDER BY subspace;
+SELECT COUNT(*) AS entries, MIN(octet_length(codes)) AS min_bytes, MAX(octet_length(codes)) AS max_bytes
+FROM semantic_cache.cache_pq_codes;
+SELECT semantic_cache.pq_encode('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]') = c.codes AS same_codes
+FROM semantic_cache.cache_pq_codes c
+JOIN semantic_cache.cache_entries ce ON ce.id = c.cache_id
+WHERE ce.query_text = 'PQ alpha';
+SELECT (semantic_cache.pq_candidates('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 2, ARRAY[0]))[1] =
+       (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'PQ alpha') AS best_first,
+       array_length(semantic_cache.pq_candidates('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 2, ARRAY[0]), 1) AS candidates;
+-- Codes outside the probed partitions, or of invalidated generations, are not ranked
+SELECT cardinality(semantic_cache.pq_candidates('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 2, ARRAY[7])) AS other_partition,
+       cardinality(semantic_cache.pq_candidates('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 2, ARRAY[0], 0,
+                                                (SELECT MAX(generation) + 1 FROM semantic_cache.cache_pq_codes))) AS invalidated,
+       semantic_cache.pq_candidates(NULL, 2, ARRAY[0]) IS NULL AS strict;
+-- Lookups re-rank the candidates exactly
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 0.99);
+SELECT found FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10]', 0.95);
+-- New entries are encoded as they are cached, deleted entries lose their codes
+SELECT semantic_cache.cache_query(
+    'PQ delta', '[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{"answer": "delta"}'::jsonb, 3600, ARRAY['pq']
+) > 0 AS cached;
+SELECT found, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result('[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 0.99);
+SELECT semantic_cache.invalidate_cache(tag := 'pq-beta') AS invalidated;
+SELECT COUNT(*) AS encoded_entries FROM semantic_cache.cache_pq_codes;
+SELECT semantic_cache.pq_encode_pending() AS pending;
+-- Codes left from an older codebook are not ranked until re-encoded
+UPDATE semantic_cache.cache_pq_codes SET codebook_version = codebook_version - 1
+WHERE cache_id = (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'PQ delta');
+SELECT (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'PQ delta') =
+       ANY(semantic_cache.pq_candidates('[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 3, ARRAY[0])) AS stale_ranked;
+SELECT semantic_cache.pq_encode_pending() AS reencoded;
+SELECT (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'PQ delta') =
+       ANY(semantic_cache.pq_candidates('[0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 3, ARRAY[0])) AS ranked;
+SELECT semantic_cache.disable_pq_lookup();
+SELECT (SELECT COUNT(*) FROM semantic_cache.cache_pq_codebook) AS codebook_rows,
+       (SELECT COUNT(*) FROM semantic_cache.cache_pq_codes) AS code_rows;
+SELECT semantic_cache.pq_encode('[0.90, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]') IS NULL AS no_codebook;
+SELECT found, result_data->>'answer' AS answer
+FROM semantic_cache.get_cached_result('[0.10, 0.10, 0.90, 0.10, 0.10, 0.10, 0.10, 0.90]', 0.99);
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 34: Split storage
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'Split small', '[0.50, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{"answer": "small"}'::jsonb
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'Split large', '[0.10, 0.50, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]',
+    jsonb_build_object('answer', (SELECT string_agg(md5(i::text), '') FROM generate_series(1, 100) i))
+) > 0 AS cached;
+SELECT semantic_cache.enable_split_storage(90) AS moved;
+SELECT reloptions FROM pg_class WHERE oid = 'semantic_cache.cache_entries'::regclass;
+SELECT attname, attstorage
+FROM pg_attribute
+WHERE attrelid = 'semantic_cache.cache_entries'::regclass
+  AND attname IN ('query_hash', 'query_text', 'query_embedding', 'result_data', 'tags')
+ORDER BY attnum;
+-- Entries and lookups are unaffected
+SELECT found, length(result_data->>'answer') AS answer_length
+FROM semantic_cache.get_cached_result('[0.10, 0.50, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', 0.99);
+SELECT semantic_cache.cache_query(
+    'Split small', '[0.50, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10, 0.10]', '{"answer": "small"}'::jsonb
+) > 0 AS cached;
+SELECT query_text, access_count FROM semantic_cache.cache_entries ORDER BY query_text;
+SELECT semantic_cache.disable_split_storage() AS moved;
+SELECT reloptions FROM pg_class WHERE oid = 'semantic_cache.cache_entries'::regclass;
+SELECT bool_and(a.attstorage = t.typstorage) AS default_storage
+FROM pg_attribute a
+JOIN pg_type t ON t.oid = a.atttypid
+WHERE a.attrelid = 'semantic_cache.cache_entries'::regclass
+  AND a.attnum > 0
+  AND NOT a.attisdropped;
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 35: Unit-length embeddings
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'Unit entry', '[3, 4, 0, 0, 0, 0, 0, 0]', '{"answer": "unit"}'::jsonb
+) > 0 AS cached;
+-- Stored scaled to unit length
+SELECT query_embedding FROM semantic_cache.cache_entries WHERE query_text = 'Unit entry';
+SELECT semantic_cache.unit_vector('[0, 0, 0, 0, 0, 0, 0, 0]') AS zero;
+-- Lookups normalize the query too, and compare by inner product
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result('[6, 8, 0, 0, 0, 0, 0, 0]', 0.99);
+SELECT ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_candidates('[0, 8, 6, 0, 0, 0, 0, 0]', 5);
+SELECT o.opcname
+FROM pg_index i
+JOIN pg_opclass o ON o.oid = i.indclass[0]
+WHERE i.indexrelid = 'semantic_cache.idx_cache_embedding'::regclass;
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 36: Distance metrics
+-- ============================================================================
+SELECT semantic_cache.set_distance_metric('l2');
+SELECT semantic_cache.get_distance_metric() AS metric;
+SELECT semantic_cache.cache_query(
+    'L2 entry', '[3, 4, 0, 0, 0, 0, 0, 0]', '{"answer": "l2"}'::jsonb
+) > 0 AS cached;
+-- Stored as given; similarity is 1 / (1 + L2 distance)
+SELECT query_embedding FROM semantic_cache.cache_entries WHERE query_text = 'L2 entry';
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result('[3, 5, 0, 0, 0, 0, 0, 0]', 0.5);
+SELECT o.opcname
+FROM pg_index i
+JOIN pg_opclass o ON o.oid = i.indclass[0]
+WHERE i.indexrelid = 'semantic_cache.idx_cache_embedding'::regclass;
+-- Switching metric rebuilds the index and clears the cache
+SELECT semantic_cache.set_distance_metric('inner_product');
+SELECT COUNT(*) AS entries FROM semantic_cache.cache_entries;
+SELECT semantic_cache.cache_query(
+    'Dot entry', '[3, 4, 0, 0, 0, 0, 0, 0]', '{"answer": "dot"}'::jsonb
+) > 0 AS cached;
+-- Similarity is the raw inner product
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result('[1, 1, 0, 0, 0, 0, 0, 0]', 5);
+SELECT semantic_cache.set_distance_metric('cosine');
+SELECT o.opcname
+FROM pg_index i
+JOIN pg_opclass o ON o.oid = i.indclass[0]
+WHERE i.indexrelid = 'semantic_cache.idx_cache_embedding'::regclass;
+
+-- ============================================================================
+-- Test 37: Hybrid lexical and semantic lookups
+-- ============================================================================
+SELECT semantic_cache.enable_lexical_lookup();
+SELECT semantic_cache.cache_query(
+    'price of sku1001', '[1, 0, 0, 0, 0, 0, 0, 0]', '{"answer": "1001"}'::jsonb
+) > 0 AS cached;
+SELECT semantic_cache.cache_query(
+    'price of sku1002', '[0, 1, 0, 0, 0, 0, 0, 0]', '{"answer": "1002"}'::jsonb
+) > 0 AS cached;
+SELECT query_tsv FROM semantic_cache.cache_entries WHERE query_text = 'price of sku1002';
+SELECT indexdef FROM pg_indexes WHERE indexname = 'idx_cache_query_tsv';
+-- Both entries are equally close by embedding alone
+SELECT found, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result('[1, 1, 0, 0, 0, 0, 0, 0]', 0.8);
+-- The shared product code lifts one of them over the threshold
+SELECT found, result_data->>'answer' AS answer,
+       ROUND(similarity_score::numeric, 4) AS similarity,
+       ROUND(lexical_score::numeric, 4) AS lexical,
+       ROUND(hybrid_score::numeric, 4) AS hybrid
+FROM semantic_cache.get_cached_hybrid('price of sku1002', '[1, 1, 0, 0, 0, 0, 0, 0]', 0.8);
+-- Another product code matches neither
+SELECT found, result_data->>'answer' AS answer, ROUND(hybrid_score::numeric, 4) AS hybrid
+FROM semantic_cache.get_cached_hybrid('price of sku1003', '[1, 1, 0, 0, 0, 0, 0, 0]', 0.8);
+-- Entries sharing no word are still scored on their embedding
+SELECT found, ROUND(similarity_score::numeric, 4) AS similarity,
+       ROUND(lexical_score::numeric, 4) AS lexical, ROUND(hybrid_score::numeric, 4) AS hybrid
+FROM semantic_cache.get_cached_hybrid('weather today', '[1, 1, 0, 0, 0, 0, 0, 0]', 0.8);
+SELECT found, result_data->>'answer' AS answer, ROUND(hybrid_score::numeric, 4) AS hybrid
+FROM semantic_cache.get_cached_hybrid('cost for item one', '[0, 1, 0, 0, 0, 0, 0, 0]', 0.5);
+SELECT semantic_cache.disable_lexical_lookup();
+SELECT COUNT(*) AS tsv_columns
+FROM pg_attribute
+WHERE attrelid = 'semantic_cache.cache_entries'::regclass
+  AND attname = 'query_tsv'
+  AND NOT attisdropped;
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 38: Paraphrase embeddings
+-- ============================================================================
+SELECT semantic_cache.cache_query(
+    'What is the capital of France?', '[1, 0, 0, 0, 0, 0, 0, 0]', '{"answer": "Paris"}'::jsonb
+) > 0 AS cached;
+-- A paraphrase whose embedding lies elsewhere misses
+SELECT found FROM semantic_cache.get_cached_result('[0, 0, 3, 4.1, 0, 0, 0, 0]', 0.95);
+SELECT semantic_cache.attach_embedding(
+    (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'What is the capital of France?'),
+    '[0, 0, 3, 4, 0, 0, 0, 0]'
+) > 0 AS attached;
+-- Attaching the same embedding again reuses it
+SELECT semantic_cache.attach_embedding(
+    (SELECT id FROM semantic_cache.cache_entries WHERE query_text = 'What is the capital of France?'),
+    '[0, 0, 3, 4, 0, 0, 0, 0]'
+) = (SELECT MIN(id) FROM semantic_cache.cache_entry_aliases) AS reused;
+SELECT query_embedding FROM semantic_cache.cache_entry_aliases;
+-- Now it hits the one stored payload
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity,
+       cache_id = (SELECT id FROM semantic_cache.cache_entries) AS same_entry
+FROM semantic_cache.get_cached_result('[0, 0, 3, 4.1, 0, 0, 0, 0]', 0.95);
+SELECT COUNT(*) AS entries FROM semantic_cache.cache_entries;
+-- Invalidation follows the paraphrase too, and its embedding goes with the entry
+SELECT semantic_cache.invalidate_cache_similar('[0, 0, 3, 4, 0, 0, 0, 0]', 0.99) AS invalidated;
+SELECT COUNT(*) AS aliases FROM semantic_cache.cache_entry_aliases;
+
+-- ============================================================================
+-- Test 39: Embedding memo
+-- ============================================================================
+-- Earlier tests' cache_query() calls filled the memo
+SELECT COUNT(*) > 0 AS memoized FROM semantic_cache.cache_embedding_memo;
+TRUNCATE semantic_cache.cache_embedding_memo;
+SELECT semantic_cache.cache_query(
+    'What is  the capital of Italy?', '[0, 1, 0, 0, 0, 0, 0, 0]', '{"answer": "Rome"}'::jsonb
+) > 0 AS cached;
+SELECT model, embedding FROM semantic_cache.cache_embedding_memo;
+-- Case and whitespace do not matter; unknown texts come back NULL, in order
+SELECT ord, query_text, embedding
+FROM semantic_cache.get_embeddings(ARRAY['  what is the capital of ITALY?', 'Unknown question']);
+-- Entries are kept per model
+SELECT semantic_cache.get_embedding('What is the capital of Italy?', 'other-model') IS NULL AS other_model_miss;
+SELECT semantic_cache.remember_embedding('Hello', '[1, 0, 0]', 'other-model') AS remembered;
+SELECT semantic_cache.get_embedding('hello', 'other-model');
+-- Only the most recently used entry fits a budget of one
+INSERT INTO semantic_cache.cache_config (key, value)
+VALUES ('memo_max_entries', '1');
+SELECT semantic_cache.evict_embedding_memo() AS evicted;
+SELECT model FROM semantic_cache.cache_embedding_memo;
+-- A budget of zero turns the memo off
+UPDATE semantic_cache.cache_config SET value = '0' WHERE key = 'memo_max_entries';
+SELECT semantic_cache.remember_embedding('Hello', '[1, 0, 0]') AS remembered;
+DELETE FROM semantic_cache.cache_config WHERE key = 'memo_max_entries';
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 40: Embedding provider
+-- ============================================================================
+CREATE TABLE embed_calls (query_text text);
+CREATE FUNCTION test_embed(query_text text)
+RETURNS real[]
+LANGUAGE sql
+AS $$
+    INSERT INTO embed_calls VALUES (query_text);
+    SELECT CASE WHEN query_text ILIKE '%capital%'
+                THEN ARRAY[1, 0, 0, 0, 0, 0, 0, 0]::real[]
+                ELSE ARRAY[0, 0, 0, 0, 0, 0, 0, 1]::real[]
+           END;
+$$;
+-- An embedding memoized under the default model
+SELECT semantic_cache.remember_embedding('Weather today?', '[1, 0, 0, 0, 0, 0, 0, 0]') AS remembered;
+SELECT semantic_cache.set_embedding_provider('test_embed(text)');
+SELECT semantic_cache.get_embedding_provider();
+-- The provider names the memo's model; entries of the previous model are evicted
+SELECT (SELECT value FROM semantic_cache.cache_config WHERE key = 'embedding_model') AS model,
+       (SELECT COUNT(*) FROM semantic_cache.cache_embedding_memo WHERE model = 'default') AS default_entries;
+-- A miss embeds the text once; caching the answer reuses the memoized embedding
+SELECT found FROM semantic_cache.get_cached_result_by_text('What is the capital of Spain?');
+SELECT semantic_cache.cache_query_by_text(
+    'What is the capital of Spain?', '{"answer": "Madrid"}'::jsonb
+) > 0 AS cached;
+SELECT found, result_data->>'answer' AS answer, ROUND(similarity_score::numeric, 4) AS similarity
+FROM semantic_cache.get_cached_result_by_text('what is the  capital of spain?');
+SELECT COUNT(*) AS provider_calls FROM embed_calls;
+-- Batches call the provider once per distinct new text
+SELECT ord, embedding
+FROM semantic_cache.embed_texts(ARRAY['Weather today?', 'WEATHER today?', 'What is the capital of Spain?', NULL]);
+SELECT COUNT(*) AS provider_calls FROM embed_calls;
+SELECT semantic_cache.set_embedding_provider(NULL);
+SELECT semantic_cache.get_embedding_provider() IS NULL AS unregistered;
+SELECT COUNT(*) AS model_settings FROM semantic_cache.cache_config WHERE key = 'embedding_model';
+DROP FUNCTION test_embed(text);
+DROP TABLE embed_calls;
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 41: Health gauges are bypassed without shared_preload_libraries
+-- ============================================================================
+SELECT enabled, reconciled, reconciled_at IS NULL AS never_reconciled, total_entries
+FROM semantic_cache.cache_gauges();
+SELECT semantic_cache.reconcile_cache_gauges() IS NULL AS not_preloaded;
+SELECT COUNT(*) AS gauge_triggers
+FROM pg_trigger
+WHERE tgrelid = 'semantic_cache.cache_entries'::regclass
+  AND tgname LIKE 'cache_gauges_%';
+-- cache_health counts the table instead
+SELECT semantic_cache.cache_query(
+    'Gauge entry', '[0, 0, 0, 0, 1, 0, 0, 0]', '{"answer": "gauge"}'::jsonb
+) > 0 AS cached;
+SELECT total_entries, expired_entries, negative_entries FROM semantic_cache.cache_health;
+SELECT semantic_cache.clear_cache() AS cleared;
+
+-- ============================================================================
+-- Test 42: Top-queries sketches are bypassed without shared_preload_libraries
+-- ============================================================================
+SELECT enabled, built, rebuilt_at IS NULL AS never_built, slots
+FROM semantic_cache.top_queries_stats();
+SELECT semantic_cache.rebuild_top_queries() IS NULL AS not_preloaded;
+SELECT COUNT(*) AS sketch_rows FROM semantic_cache.top_queries('hits', 10);
+-- top_cached_queries groups the access log instead
+SELECT semantic_cache.log_cache_access('sketch-query', true, 0.95, 0.02);
+SELECT semantic_cache.log_cache_access('sketch-query', true, 0.97, 0.03);
+SELECT semantic_cache.log_cache_access('sketch-query', false, 0.40, 0.03);
+SELECT query_hash, hit_count, ROUND(avg_similarity::numeric, 2) AS avg_similarity,
+       total_cost_saved, max_error
+FROM semantic_cache.top_cached_queries
+WHERE query_hash = 'sketch-query';
+
+-- ============================================================================
+-- Test 43: Distinct queries
+-- ============================================================================
+SELECT enabled, pending_buckets, ROUND(standard_error::numeric, 3) AS standard_error
+FROM semantic_cache.access_sketch_stats();
+SELECT semantic_cache.flush_access_sketches() IS NULL AS not_preloaded;
+-- Without the sketches the access log is counted exactly
+SELECT * FROM semantic_cache.distinct_queries(NOW() - INTERVAL '1 day');
+-- Sketch arithmetic: 4096 empty registers, then every register at 1
+SELECT semantic_cache.hll_estimate(decode(repeat('00', 4096), 'hex')) AS empty_estimate;
+SELECT semantic_cache.hll_estimate(decode(repeat('01', 4096), 'hex')) AS full_estimate;
+SELECT semantic_cache.hll_merge(decode(repeat('00', 4096), 'hex'), decode(repeat('01', 4096), 'hex'))
+       = decode(repeat('01', 4096), 'hex') AS merge_keeps_max,
+       semantic_cache.hll_merge(NULL, NULL) IS NULL AS empty_merge;
+SELECT semantic_cache.hll_estimate(semantic_cache.hll_union(s)) AS union_estimate
+FROM (VALUES (decode(repeat('00', 4096), 'hex')), (decode(repeat('01', 4096), 'hex'))) v(s);
+
 -- ============================================================================
 -- Cleanup
 -- ============================================================================